@@ -0,0 +1,224 @@
+﻿/*! \file allocationcheck.cpp
+    \brief 定常状態のステップでヒープからメモリを確保していないかを調べるプログラム
+
+    Copyright ©  2017 @dc1394 All Rights Reserved.
+    This software is released under the BSD 2-Clause License.
+*/
+
+#include "../moleculardynamics/Ar_moleculardynamics.h"
+#include <atomic>           // for std::atomic
+#include <cstdint>          // for std::int32_t, std::int64_t
+#include <cstdio>           // for std::printf
+#include <cstdlib>          // for std::atoi, std::free, std::malloc
+#include <new>              // for std::bad_alloc
+
+namespace {
+    //! A global variable.
+    /*!
+        グローバルなoperator newが呼ばれた回数
+    */
+    std::atomic<std::int64_t> allocationcount(0);
+
+    //! A global function.
+    /*!
+        メモリを確保して、確保した回数を数える
+        \param size 確保するバイト数
+        \return 確保したメモリの先頭アドレス
+    */
+    void * countedalloc(std::size_t size)
+    {
+        ++allocationcount;
+
+        auto const p = std::malloc(size ? size : 1);
+        if (!p) {
+            throw std::bad_alloc();
+        }
+
+        return p;
+    }
+
+    //! A struct.
+    /*!
+        調べる設定
+    */
+    struct CheckCase {
+        //! A public member variable.
+        /*!
+            ペアリストの種類
+        */
+        moleculardynamics::PairListType type;
+
+        //! A public member variable.
+        /*!
+            動的な刈り込みを使うかどうか
+        */
+        bool pruning;
+
+        //! A public member variable.
+        /*!
+            16ビットの差で表したペアリストを使うかどうか
+        */
+        bool compressed;
+
+        //! A public member variable.
+        /*!
+            ペアリストをヘルパースレッドで作るかどうか
+        */
+        bool async;
+
+        //! A public member variable.
+        /*!
+            原子を番地の空間充填曲線の順に並べ替えるかどうか
+        */
+        bool morton;
+
+        //! A public member variable.
+        /*!
+            マージンを自動調整するかどうか
+        */
+        bool autotune;
+
+        //! A public member variable.
+        /*!
+            2体ポテンシャルの数表の区間の数（0のときは数表を使わない）
+        */
+        std::int32_t resolution;
+
+        //! A public member variable.
+        /*!
+            クラスタペアリストの力の計算を混合精度にするかどうか
+        */
+        bool mixed;
+
+        //! A public member variable.
+        /*!
+            格子定数のスケール（大きくすると、番地あたりの原子が少なくなり疎な住所録を使う）
+        */
+        double scale;
+
+        //! A public member variable.
+        /*!
+            設定の名前
+        */
+        char const * name;
+    };
+}
+
+void * operator new(std::size_t size)
+{
+    return countedalloc(size);
+}
+
+void * operator new[](std::size_t size)
+{
+    return countedalloc(size);
+}
+
+void operator delete(void * p) throw()
+{
+    std::free(p);
+}
+
+void operator delete[](void * p) throw()
+{
+    std::free(p);
+}
+
+void operator delete(void * p, std::size_t) throw()
+{
+    std::free(p);
+}
+
+void operator delete[](void * p, std::size_t) throw()
+{
+    std::free(p);
+}
+
+//! The main function.
+/*!
+    並列化の方法と、ペアリストの種類などの設定のすべての組み合わせで、ウォームアップの後にrunCalc()を繰り返し、
+    その間に一度でもメモリを確保したら0以外を返す
+    \param argc コマンドライン引数の数
+    \param argv コマンドライン引数（1番目は計測するステップ数、2番目はウォームアップのステップ数）
+    \return すべての組み合わせでメモリを確保しなかったら0
+*/
+int main(int argc, char * argv[])
+{
+    using namespace moleculardynamics;
+
+    auto const steps = argc > 1 ? std::atoi(argv[1]) : 500;
+    auto const warmup = argc > 2 ? std::atoi(argv[2]) : 300;
+
+    ParallelMethod const methods[] = {
+        ParallelMethod::REDUCTION,
+        ParallelMethod::FULLLIST,
+        ParallelMethod::COLORING,
+        ParallelMethod::DETERMINISTIC
+    };
+
+    CheckCase const cases[] = {
+        { PairListType::ATOM, false, false, false, false, false, 0, false, 1.0, "atom" },
+        { PairListType::ATOM, true, false, false, false, false, 0, false, 1.0, "atom+pruning" },
+        { PairListType::ATOM, false, true, false, false, false, 0, false, 1.0, "atom+compressed" },
+        { PairListType::ATOM, false, false, true, false, false, 0, false, 1.0, "atom+async" },
+        { PairListType::ATOM, false, false, false, true, false, 0, false, 1.0, "atom+morton" },
+        { PairListType::ATOM, false, false, false, false, true, 0, false, 1.0, "atom+autotune" },
+        { PairListType::ATOM, false, false, false, false, false, 1024, false, 1.0, "atom+table" },
+        { PairListType::ATOM, false, false, false, false, false, 0, false, 8.0, "atom+sparse" },
+        { PairListType::CLUSTER, false, false, false, false, false, 0, false, 1.0, "cluster" },
+        { PairListType::CLUSTER, false, false, false, false, false, 0, true, 1.0, "cluster+mixed" }
+    };
+
+    // 単位胞の数が10ならメッシュで、4なら総当たりでペアリストを作る
+    std::int32_t const ncs[] = { 10, 4 };
+
+    auto failures = 0;
+    for (auto const nc : ncs) {
+        for (auto const method : methods) {
+            for (auto const & check : cases) {
+                Ar_moleculardynamics md;
+                md.setNc(nc);
+                md.setScale(check.scale);
+                md.setEnsemble(EnsembleType::NVT);
+                md.setTempContMethod(TempControlMethod::LANGEVIN);
+                md.setParallelMethod(method);
+                md.setPairListType(check.type);
+                md.setDynamicPruning(check.pruning);
+                md.setCompressedPairlist(check.compressed);
+                md.setAsyncRebuild(check.async);
+                md.setAtomOrderType(check.morton ? AtomOrderType::MORTON : AtomOrderType::INITIAL);
+                md.setMarginAutotune(check.autotune);
+                md.setTableResolution(check.resolution);
+                md.setPrecisionType(check.mixed ? PrecisionType::MIXED : PrecisionType::DOUBLE);
+
+                // ペアリストやバッファの容量が、定常状態の大きさに育つまで進める
+                for (auto i = 0; i < warmup; i++) {
+                    md.runCalc();
+                }
+
+                auto const before = allocationcount.load();
+                auto checksum = 0.0;
+                for (auto i = 0; i < steps; i++) {
+                    md.runCalc();
+
+                    // 観測量を読んだ直後のステップでは、ポテンシャルエネルギーとビリアルも計算する
+                    if (i % 7 == 0) {
+                        checksum += md.Up + md.getPressure();
+                    }
+                }
+                auto const count = allocationcount.load() - before;
+
+                std::printf("Nc = %2d, method = %d, case = %-15s : %lld allocations (checksum = %f)\n",
+                    nc, static_cast<std::int32_t>(md.getParallelMethod()), check.name, static_cast<long long>(count), checksum);
+
+                if (count) {
+                    failures++;
+                }
+            }
+        }
+    }
+
+    std::printf(failures ? "FAILED: %d case(s) allocated memory\n" : "OK\n", failures);
+
+    return failures ? 1 : 0;
+}
@@ -6,9 +6,17 @@
 */
 
 #include "Ar_moleculardynamics.h"
-#include "myrandom/myrand.h"
-#include <cmath>                    // for std::sqrt, std::pow
+#include <algorithm>                // for std::copy, std::fill, std::lower_bound, std::max, std::min
+#include <chrono>                   // for std::chrono::steady_clock
+#include <cmath>                    // for std::fabs, std::sqrt, std::pow
+#include <limits>                   // for std::numeric_limits
+#include <numeric>                  // for std::iota
 #include <random>                   // for std::uniform_real_distribution
+#include <utility>                  // for std::move, std::swap
+
+#ifdef _OPENMP
+    #include <omp.h>                // for omp_get_max_threads, omp_get_num_procs, omp_get_num_threads, omp_get_thread_num, omp_set_num_threads
+#endif
 
 namespace moleculardynamics {
     // #region static private 定数
@@ -23,6 +31,10 @@ namespace moleculardynamics {
 
     double const Ar_moleculardynamics::ALPHA = 0.2;
 
+    double const Ar_moleculardynamics::ASYNCREBUILDLEAD = 2.0;
+
+    double const Ar_moleculardynamics::ASYNCREBUILDSTART = 0.5;
+
     double const Ar_moleculardynamics::ATM = 9.86923266716013E-6;
 
     double const Ar_moleculardynamics::AVOGADRO_CONSTANT = 6.022140857E+23;
@@ -35,6 +47,18 @@ namespace moleculardynamics {
 
     double const Ar_moleculardynamics::KB = 1.3806488E-23;
 
+    double const Ar_moleculardynamics::MARGINMAX = 1.5;
+
+    double const Ar_moleculardynamics::MARGINMIN = 0.2;
+
+    double const Ar_moleculardynamics::MARGINSTEP = 0.2;
+
+    double const Ar_moleculardynamics::MARGINSTEPMIN = 0.05;
+
+    double const Ar_moleculardynamics::PRUNEMARGIN = 0.1;
+
+    double const Ar_moleculardynamics::TABLER2MIN = 0.64;
+
     double const Ar_moleculardynamics::TAU =
         std::sqrt(0.039948 / Ar_moleculardynamics::AVOGADRO_CONSTANT * Ar_moleculardynamics::SIGMA * Ar_moleculardynamics::SIGMA / Ar_moleculardynamics::YPSILON);
 
@@ -48,40 +72,74 @@ namespace moleculardynamics {
 
     Ar_moleculardynamics::Ar_moleculardynamics()
         :
-        Atoms([this] { return std::cref(atoms_); }, nullptr),
+        Atoms([this] { return std::cref(getAtomsView()); }, nullptr),
         MD_iter([this] { return MD_iter_; }, nullptr),
         Nc([this] { return Nc_; }, nullptr),
         NumAtom([this] { return NumAtom_; }, nullptr),
         periodiclen([this] { return periodiclen_; }, nullptr),
         Uk([this] { return DimensionlessToHartree(Uk_); }, nullptr),
-        Up([this] { return DimensionlessToHartree(Up_); }, nullptr),
-        Utot([this] { return DimensionlessToHartree(Utot_); }, nullptr),
-        atoms_(Nc_ * Nc_ * Nc_ * 4),
+        Up([this] { observed_ = true; return DimensionlessToHartree(Up_); }, nullptr),
+        Utot([this] { observed_ = true; return DimensionlessToHartree(Utot_); }, nullptr),
         dt2(DT * DT),
-        rc2_(SystemParam::RCUTOFF * SystemParam::RCUTOFF),
-        rcm6_(std::pow(SystemParam::RCUTOFF, -6.0)),
-        rcm12_(std::pow(SystemParam::RCUTOFF, -12.0)),
+        langevinrand_(std::normal_distribution<double>(0.0, 1.0)),
+        rc2_(potential::LennardJones::cutoff() * potential::LennardJones::cutoff()),
         Tg_(Ar_moleculardynamics::FIRSTTEMP * Ar_moleculardynamics::KB / Ar_moleculardynamics::YPSILON),
-        Vrc_(4.0 * (rcm6_ - rcm12_))
+        Vrc_(-potential::LennardJones::energy(rc2_))
     {
+        atoms_.resize(Nc_ * Nc_ * Nc_ * 4);
+        selectKernel();
+
+#ifdef _OPENMP
+        numthreads_ = omp_get_max_threads();
+#else
+        numthreads_ = 1;
+#endif
+
         // initalize parameters
         lat_ = std::pow(2.0, 2.0 / 3.0) * scale_;
 
         recalc();
     }
 
+    Ar_moleculardynamics::~Ar_moleculardynamics()
+    {
+        // ヘルパースレッドは作成の途中でもメンバ変数を使うので、作り終えるのを待ってから止める
+        cancelAsyncRebuild();
+
+        if (asyncthread_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(asyncmutex_);
+                asyncquit_ = true;
+            }
+
+            asynccond_.notify_one();
+            asyncthread_.join();
+        }
+    }
+
     // #endregion コンストラクタ
 
     // #region publicメンバ関数
+
+    AtomOrderType Ar_moleculardynamics::getAtomOrderType() const
+    {
+        return atomordertype_;
+    }
         
     double Ar_moleculardynamics::getDeltat() const
     {
         return Ar_moleculardynamics::TAU * t_ * 1.0E+12;
     }
 
+    double Ar_moleculardynamics::getEnergyDrift() const
+    {
+        return energydrift_;
+    }
+
     float Ar_moleculardynamics::getForce(std::int32_t n) const
     {
-        return static_cast<float>(atoms_[n].f.norm());
+        auto const k = atomslot_[n];
+        return static_cast<float>(std::sqrt(atoms_.fx[k] * atoms_.fx[k] + atoms_.fy[k] * atoms_.fy[k] + atoms_.fz[k] * atoms_.fz[k]));
     }
 
     double Ar_moleculardynamics::getLatticeconst() const
@@ -89,19 +147,87 @@ namespace moleculardynamics {
         return Ar_moleculardynamics::SIGMA * lat_ * 1.0E+9;
     }
 
+    double Ar_moleculardynamics::getMargin() const
+    {
+        return Ar_moleculardynamics::SIGMA * pairlistMargin() * 1.0E+9;
+    }
+
+    std::int32_t Ar_moleculardynamics::getMeshDivision() const
+    {
+        return meshdivision_;
+    }
+
     double Ar_moleculardynamics::getPeriodiclen() const
     {
         return Ar_moleculardynamics::SIGMA * periodiclen_ * 1.0E+9;
     }
 
+    PairListType Ar_moleculardynamics::getPairListType() const
+    {
+        return useClusterPairlist() ? PairListType::CLUSTER : PairListType::ATOM;
+    }
+
+    ParallelMethod Ar_moleculardynamics::getParallelMethod() const
+    {
+        return parallelmethodinuse_;
+    }
+
+    PrecisionType Ar_moleculardynamics::getPrecisionType() const
+    {
+        return useMixedPrecision() ? PrecisionType::MIXED : PrecisionType::DOUBLE;
+    }
+
     double Ar_moleculardynamics::getPressure() const
     {
         auto const V = std::pow(Ar_moleculardynamics::SIGMA * periodiclen_, 3);
-        auto const ideal = NumAtom * Ar_moleculardynamics::YPSILON * Tc_;
+        // ビリアルと同じステップの温度を使う（力だけを計算したステップでは、ビリアルは更新されない）
+        auto const ideal = NumAtom * Ar_moleculardynamics::YPSILON * sampletc_;
+
+        observed_ = true;
 
         return (ideal - virial_ * Ar_moleculardynamics::YPSILON / 3.0) / V * Ar_moleculardynamics::ATM;
     }
 
+    std::int32_t Ar_moleculardynamics::getPruneCount() const
+    {
+        return prunecount_;
+    }
+
+    std::int32_t Ar_moleculardynamics::getRebuildCount() const
+    {
+        return rebuildcount_;
+    }
+
+    double Ar_moleculardynamics::getRebuildInterval() const
+    {
+        return rebuilddisplacementcount_ ? static_cast<double>(rebuildintervalsum_) / static_cast<double>(rebuilddisplacementcount_) : 0.0;
+    }
+
+    RebuildReason Ar_moleculardynamics::getRebuildReason() const
+    {
+        return rebuildreason_;
+    }
+
+    std::int32_t Ar_moleculardynamics::getSampleIteration() const
+    {
+        return sampleiter_;
+    }
+
+    SimdType Ar_moleculardynamics::getSimdType() const
+    {
+        return simdtype_;
+    }
+
+    double Ar_moleculardynamics::getTableEnergyError() const
+    {
+        return ptable_ ? DimensionlessToHartree(ptable_->max_energy_error()) : 0.0;
+    }
+
+    double Ar_moleculardynamics::getTableForceError() const
+    {
+        return ptable_ ? ptable_->max_force_error() : 0.0;
+    }
+
     double Ar_moleculardynamics::getTcalc() const
     {
         return Ar_moleculardynamics::YPSILON / Ar_moleculardynamics::KB * Tc_;
@@ -114,6 +240,9 @@ namespace moleculardynamics {
 
     void Ar_moleculardynamics::recalc()
     {
+        // 作成中のペアリストは、原子数や周期の長さが変わるので捨てる
+        cancelAsyncRebuild();
+
         t_ = 0.0;
         MD_iter_ = 1;
 
@@ -121,41 +250,169 @@ namespace moleculardynamics {
 
         MD_initVel();
 
+        // 原子は初期配置の順に並んでいる
+        atomid_.resize(NumAtom_);
+        std::iota(atomid_.begin(), atomid_.end(), 0);
+        atomslot_ = atomid_;
+        reorderbuffer_.resize(NumAtom_);
+        reorderindex_.resize(NumAtom_);
+        listrx_.resize(NumAtom_);
+        listry_.resize(NumAtom_);
+        listrz_.resize(NumAtom_);
+        prunerx_.resize(NumAtom_);
+        prunery_.resize(NumAtom_);
+        prunerz_.resize(NumAtom_);
+        asyncatoms_.resize(NumAtom_);
+        asyncrx_.resize(NumAtom_);
+        asyncry_.resize(NumAtom_);
+        asyncrz_.resize(NumAtom_);
+
         periodiclen_ = lat_ * static_cast<double>(Nc_);
 
-        m_ = static_cast<std::int32_t>(periodiclen_ / (SystemParam::RCUTOFF + SystemParam::MARGIN)) - 1;
-        
-        if (m_ > 2) {
-            pmesh_.reset(new MeshList(periodiclen_));
-            pmesh_->set_number_of_atoms(atoms_.size());
-            pmesh_->make_pair(atoms_, pairs_);
-        }
-        else {
-            makePair();
+        // 周期の長さが変わるので、メッシュリストは作り直す
+        pmesh_.reset();
+        sparemesh_.reset();
+        makeMesh();
+        if (marginautotune_) {
+            reserveMesh();
         }
 
+        rebuildcount_ = 0;
+        rebuilddisplacementcount_ = 0;
+        rebuildintervalsum_ = 0;
+        prunecount_ = 0;
+        asynclatency_ = 0;
+        sampleiter_ = -1;
+
+        selectParallelMethod();
+        rebuildPairlist(RebuildReason::INITIAL);
+
         zeta_ = 0.0;
+        atomsviewdirty_ = true;
+        observed_ = true;
+        resetdrift_ = true;
+        energydrift_ = 0.0;
     }
 
     void Ar_moleculardynamics::runCalc()
     {
+        auto const start = std::chrono::steady_clock::now();
+
+        // 観測量が読まれるステップでだけ、ポテンシャルエネルギーとビリアルを計算する
+        computeflags_ = observed_ || MD_iter_ % samplinginterval_ == 0 ?
+            ljkernel::ComputeFlags::ENERGY_VIRIAL : ljkernel::ComputeFlags::FORCE;
+        observed_ = false;
+
         moveAtoms();
         checkPairlist();
         calcForcePair();
         moveAtoms();
-        periodic();
+        atomsviewdirty_ = true;
+
+        // ポテンシャルエネルギーとビリアルを計算したステップでだけ、同じステップの運動エネルギーと温度と一緒に記録する
+        // （力だけを計算したステップの値と組み合わせると、違うステップの値が混ざる）
+        if (computeflags_ != ljkernel::ComputeFlags::FORCE) {
+            Utot_ = Uk_ + Up_;
+            sampletc_ = Tc_;
+            sampleiter_ = MD_iter_;
+
+            if (resetdrift_) {
+                Utot0_ = Utot_;
+                resetdrift_ = false;
+            }
+
+            energydrift_ = (Utot_ - Utot0_) / std::fabs(Utot0_);
+        }
+
+        // マージンの自動調整のために、ペアリストの作り直しを含めたステップの時間を測る
+        if (marginautotune_) {
+            cycletime_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            cyclesteps_++;
+        }
 
         // 繰り返し回数と時間を増加
         t_ = static_cast<double>(MD_iter_)* Ar_moleculardynamics::DT;
         MD_iter_++;
     }
 
+    void Ar_moleculardynamics::setAsyncRebuild(bool asyncrebuild)
+    {
+        cancelAsyncRebuild();
+        asyncrebuild_ = asyncrebuild;
+
+        // ヘルパースレッドは、ペアリストを作り直すたびに作らず、最初に一度だけ作って使い回す
+        if (asyncrebuild_ && !asyncthread_.joinable()) {
+            asyncthread_ = std::thread([this]() { asyncRebuildThread(); });
+        }
+    }
+
+    void Ar_moleculardynamics::setAtomOrderType(AtomOrderType atomordertype)
+    {
+        atomordertype_ = atomordertype;
+
+        // 初期配置の順に戻すときは、元の原子の番号の順に並べ直す（MORTONのときは、ペアリストを作り直すときに並べ替える）
+        if (atomordertype_ == AtomOrderType::INITIAL) {
+            reorderAtoms(atomslot_);
+        }
+
+        rebuildPairlist(RebuildReason::SETTING);
+    }
+
+    void Ar_moleculardynamics::setCompressedPairlist(bool compresspairlist)
+    {
+        compresspairlist_ = compresspairlist;
+        compressPairlist();
+    }
+
+    void Ar_moleculardynamics::setDynamicPruning(bool dynamicpruning)
+    {
+        dynamicpruning_ = dynamicpruning;
+        rebuildPairlist(RebuildReason::SETTING);
+    }
+
     void Ar_moleculardynamics::setEnsemble(EnsembleType ensemble)
     {
         ensemble_ = ensemble;
         recalc();
     }
 
+    void Ar_moleculardynamics::setMarginAutotune(bool marginautotune)
+    {
+        marginautotune_ = marginautotune;
+        marginstep_ = Ar_moleculardynamics::MARGINSTEP;
+        lastcyclecost_ = 0.0;
+
+        if (marginautotune_) {
+            // 番地の大きさをたどったメッシュリストは、今のペアリストを作ったときの状態ではないので、ペアリストも作り直す
+            reserveMesh();
+            selectParallelMethod();
+            rebuildPairlist(RebuildReason::SETTING);
+        }
+        else if (margin_ != SystemParam::MARGIN) {
+            // 作成中のペアリストはマージンを使うので、マージンを変える前に捨てる
+            cancelAsyncRebuild();
+            margin_ = SystemParam::MARGIN;
+            makeMesh();
+            selectParallelMethod();
+            rebuildPairlist(RebuildReason::SETTING);
+        }
+    }
+
+    void Ar_moleculardynamics::setMeshDivision(std::int32_t division)
+    {
+        BOOST_ASSERT(division >= 1 && division <= 3);
+
+        meshdivision_ = division;
+
+        // 番地の大きさが変わるので、メッシュリストを作り直す
+        makeMesh();
+        if (marginautotune_) {
+            reserveMesh();
+        }
+        selectParallelMethod();
+        rebuildPairlist(RebuildReason::SETTING);
+    }
+
     void Ar_moleculardynamics::setNc(std::int32_t Nc)
     {
         Nc_ = Nc;
@@ -164,12 +421,94 @@ namespace moleculardynamics {
         ModLattice();
     }
 
+    void Ar_moleculardynamics::setPairListType(PairListType pairlisttype)
+    {
+        pairlisttype_ = pairlisttype;
+        selectParallelMethod();
+        rebuildPairlist(RebuildReason::SETTING);
+    }
+
+    void Ar_moleculardynamics::setParallelMethod(ParallelMethod parallelmethod)
+    {
+        // 作成中のペアリストは、作り始めたときの並列化の方法に合わせた向きなので捨てる
+        cancelAsyncRebuild();
+
+        auto const cluster = useClusterPairlist();
+
+        parallelmethod_ = parallelmethod;
+        selectParallelMethod();
+
+        // DETERMINISTICに切り替えるときなど、ペアリストの種類が変わるときは作り直す
+        // （動的な刈り込みでは、外側のペアリストも力の計算に使うペアリストと同じ向きにするので作り直す）
+        if (useClusterPairlist() != cluster || useDynamicPruning()) {
+            rebuildPairlist(RebuildReason::SETTING);
+        }
+        else if (useFullPairlist()) {
+            makeFullPairlist(pairs_, fullpairs_);
+            compressPairlist();
+        }
+        else {
+            // 両方向のペアリストから片方向のペアリストに切り替えたときも、圧縮したペアリストは作り直す
+            compressPairlist();
+        }
+    }
+
+    void Ar_moleculardynamics::setPrecisionType(PrecisionType precisiontype)
+    {
+        precisiontype_ = precisiontype;
+        resetdrift_ = true;
+        energydrift_ = 0.0;
+    }
+
+    void Ar_moleculardynamics::setSamplingInterval(std::int32_t samplinginterval)
+    {
+        BOOST_ASSERT(samplinginterval > 0);
+        samplinginterval_ = samplinginterval;
+    }
+
     void Ar_moleculardynamics::setScale(double scale)
     {
         scale_ = scale;
         ModLattice();
     }
 
+    void Ar_moleculardynamics::setSimdType(SimdType simdtype)
+    {
+        simdtype_ = std::min(simdtype, ljkernel::detect_simd_type());
+        selectKernel();
+
+        // 作成中のペアリストは、今のふるい分けの関数を使っているので捨てる
+        if (pmesh_) {
+            cancelAsyncRebuild();
+            pmesh_->set_simd_type(simdtype_);
+        }
+    }
+
+    void Ar_moleculardynamics::setTableResolution(std::int32_t resolution)
+    {
+        BOOST_ASSERT(resolution >= 0);
+
+        if (!resolution) {
+            ptable_.reset();
+        }
+        else {
+            // 2体ポテンシャル（カットオフでエネルギーを0にずらしたもの）を数表にする
+            auto const energy = potentialenergy_;
+            auto const vrc = Vrc_;
+            ptable_.reset(new PairTable(
+                [energy, vrc](double r2) { return energy(r2) + vrc; },
+                potentialforce_,
+                Ar_moleculardynamics::TABLER2MIN,
+                rc2_,
+                resolution));
+        }
+
+        // クラスタペアリストから原子のペアリストに切り替わることがある
+        selectKernel();
+        selectParallelMethod();
+        rebuildPairlist(RebuildReason::SETTING);
+    }
+
     void Ar_moleculardynamics::setTempContMethod(TempControlMethod tempcontmethod)
     {
         tempcontmethod_ = tempcontmethod;
@@ -185,104 +524,862 @@ namespace moleculardynamics {
 
     // #region privateメンバ関数
 
+    void Ar_moleculardynamics::asyncRebuildThread()
+    {
+#ifdef _OPENMP
+        // ヘルパースレッドの中のOpenMPのチームは、メインスレッドのチームと合わせてコア数を超えないようにする
+        // （メインスレッドのチームがすべてのコアを使うときは、ヘルパースレッドは1スレッドで作る）
+        omp_set_num_threads(std::max(omp_get_num_procs() - numthreads_, 1));
+#endif
+
+        std::unique_lock<std::mutex> lock(asyncmutex_);
+        while (true) {
+            asynccond_.wait(lock, [this]() { return asyncrequested_ || asyncquit_; });
+            if (asyncquit_) {
+                return;
+            }
+
+            // 作っている間はメインスレッドを止めないように、ロックを外す
+            lock.unlock();
+            try {
+                buildAsyncPairlist(asyncfull_, asyncmorton_);
+            }
+            catch (...) {
+                asyncexception_ = std::current_exception();
+            }
+            lock.lock();
+
+            asyncrequested_ = false;
+            asyncready_ = true;
+            asynccond_.notify_one();
+        }
+    }
+
+    void Ar_moleculardynamics::buildAsyncPairlist(bool full, bool morton)
+    {
+        // ヘルパースレッドで実行するので、原子の座標は作り始めたときに写したものだけを読む
+        auto & atoms = asyncatoms_;
+
+        // 写した座標を周期の内側に戻す（差し替えるときに、今の座標も同じだけずらす）
+        for (auto n = 0; n < NumAtom_; n++) {
+            atoms.rx[n] = asyncrx_[n] + periodicShift(asyncrx_[n]);
+            atoms.ry[n] = asyncry_[n] + periodicShift(asyncry_[n]);
+            atoms.rz[n] = asyncrz_[n] + periodicShift(asyncrz_[n]);
+        }
+
+        // 原子を並べ替える順番を求め、写した座標だけを先に並べ替える（原子そのものは差し替えるときに並べ替える）
+        if (morton) {
+            pmesh_->sort_atoms(atoms);
+            asyncorder_ = pmesh_->sorted_atoms();
+
+            // 写した座標の力の配列は使わないので、並べ替えの作業用にする
+            auto const permute = [this](AtomSoA::mydoublevector & v)
+            {
+                for (auto k = 0; k < NumAtom_; k++) {
+                    asyncatoms_.fx[k] = v[asyncorder_[k]];
+                }
+
+                v.swap(asyncatoms_.fx);
+            };
+
+            permute(atoms.rx);
+            permute(atoms.ry);
+            permute(atoms.rz);
+        }
+
+        if (pmesh_) {
+            pmesh_->make_pair(atoms, asyncpairs_);
+        }
+        else {
+            makePair(atoms, asyncmargin_, asyncpairs_);
+        }
+
+        if (full) {
+            makeFullPairlist(asyncpairs_, asyncfullpairs_);
+        }
+    }
+
     void Ar_moleculardynamics::calcForcePair()
     {
-        // 各原子に働く力の初期化
-        for (auto && a : atoms_) {
-            a.f = Eigen::Vector4d::Zero();
+        if (useClusterPairlist()) {
+            calcForcePairCluster();
+            return;
+        }
+
+        switch (parallelmethodinuse_) {
+        case ParallelMethod::COLORING:
+            calcForcePairColoring();
+            break;
+
+        case ParallelMethod::REDUCTION:
+            calcForcePairReduction();
+            break;
+
+        case ParallelMethod::FULLLIST:
+            calcForcePairFullList();
+            break;
+
+        case ParallelMethod::DETERMINISTIC:
+            calcForcePairDeterministic();
+            break;
+
+        default:
+            BOOST_ASSERT(!"何かがおかしい！");
+            break;
+        }
+    }
+
+    void Ar_moleculardynamics::calcForcePairCluster()
+    {
+        auto & cp = clusterpairs_;
+        auto const nslots = static_cast<std::int32_t>(cp.atomindex.size());
+        auto const mixed = useMixedPrecision();
+
+        // クラスタの順に並べ替えた配列は原子数より長いので、足りなければスレッドごとのバッファを広げる
+        // （作り直すたびに少しずつ広げないように、クラスタペアリストが確保している容量まで広げる）
+        if (!forcebuffers_.empty() && forcebuffers_[0].fx.size() < cp.atomindex.size()) {
+            for (auto & buf : forcebuffers_) {
+                buf.resize(cp.atomindex.capacity());
+            }
+        }
+
+        // ポテンシャルエネルギーとビリアルは、スレッドごとに計算して最後に足し合わせる
+        auto up = 0.0;
+        auto virial = 0.0;
+
+#pragma omp parallel num_threads(numthreads_) reduction(+:up, virial)
+        {
+#ifdef _OPENMP
+            auto const thread = omp_get_thread_num();
+            auto const nthreads = omp_get_num_threads();
+#else
+            auto const thread = 0;
+            auto const nthreads = 1;
+#endif
+            // 原子の座標を、クラスタの順に並べ替えてコピーする（パディングは原点に置き、ビットマスクで除外する）
+            // 混合精度のときは、クラスタがいる番地の原点からの相対座標をfloatにする
+            if (mixed) {
+#pragma omp for
+                for (std::int32_t s = 0; s < nslots; s++) {
+                    auto const n = cp.atomindex[s];
+                    auto const c = s / ClusterPairList::CLUSTERSIZE;
+                    cp.xf[s] = n >= 0 ? static_cast<float>(atoms_.rx[n] - cp.originx[c]) : 0.0f;
+                    cp.yf[s] = n >= 0 ? static_cast<float>(atoms_.ry[n] - cp.originy[c]) : 0.0f;
+                    cp.zf[s] = n >= 0 ? static_cast<float>(atoms_.rz[n] - cp.originz[c]) : 0.0f;
+                }
+            }
+            else {
+#pragma omp for
+                for (std::int32_t s = 0; s < nslots; s++) {
+                    auto const n = cp.atomindex[s];
+                    cp.x[s] = n >= 0 ? atoms_.rx[n] : 0.0;
+                    cp.y[s] = n >= 0 ? atoms_.ry[n] : 0.0;
+                    cp.z[s] = n >= 0 ? atoms_.rz[n] : 0.0;
+                }
+            }
+
+            // スレッド0はクラスタの順の力の配列に直接書き込み、それ以外のスレッドは自分のバッファに書き込む
+            ljkernel::ClusterKernelArgs args;
+            args.x = cp.x.data();
+            args.y = cp.y.data();
+            args.z = cp.z.data();
+            args.xf = cp.xf.data();
+            args.yf = cp.yf.data();
+            args.zf = cp.zf.data();
+            args.joriginx = cp.joriginx.data();
+            args.joriginy = cp.joriginy.data();
+            args.joriginz = cp.joriginz.data();
+            args.fx = thread == 0 ? cp.fx.data() : forcebuffers_[thread - 1].fx.data();
+            args.fy = thread == 0 ? cp.fy.data() : forcebuffers_[thread - 1].fy.data();
+            args.fz = thread == 0 ? cp.fz.data() : forcebuffers_[thread - 1].fz.data();
+            args.jcluster = cp.jcluster.data();
+            args.mask = cp.mask.data();
+            args.shift = cp.shift.data();
+            args.flags = computeflags_;
+            args.offsets = cp.offsets.data();
+            args.periodiclen = periodiclen_;
+            args.rc2 = rc2_;
+            args.vrc = Vrc_;
+
+            std::fill(args.fx, args.fx + nslots, 0.0);
+            std::fill(args.fy, args.fy + nslots, 0.0);
+            std::fill(args.fz, args.fz + nslots, 0.0);
+
+            rowRange(cp.offsets, thread, nthreads, args.ibegin, args.iend);
+            (mixed ? mixedclusterkernel_ : clusterkernel_)(args, up, virial);
+
+            // すべてのスレッドが書き込み終わるまで待つ
+#pragma omp barrier
+
+            // スレッドごとのバッファを足し合わせて元の原子の順に戻し、力積の分だけ運動量を更新する
+#pragma omp for
+            for (std::int32_t s = 0; s < nslots; s++) {
+                auto const n = cp.atomindex[s];
+                if (n < 0) {
+                    continue;
+                }
+
+                auto fx = cp.fx[s];
+                auto fy = cp.fy[s];
+                auto fz = cp.fz[s];
+                for (auto t = 0; t < nthreads - 1; t++) {
+                    fx += forcebuffers_[t].fx[s];
+                    fy += forcebuffers_[t].fy[s];
+                    fz += forcebuffers_[t].fz[s];
+                }
+
+                atoms_.fx[n] = fx;
+                atoms_.fy[n] = fy;
+                atoms_.fz[n] = fz;
+                atoms_.px[n] += fx * DT;
+                atoms_.py[n] += fy * DT;
+                atoms_.pz[n] += fz * DT;
+            }
+        }
+
+        if (computeflags_ != ljkernel::ComputeFlags::FORCE) {
+            Up_ = up;
+            virial_ = virial;
+        }
+    }
+
+    void Ar_moleculardynamics::calcForcePairColoring()
+    {
+        auto const & coloroffsets = pmesh_->color_offsets();
+        auto const & coloredcells = pmesh_->colored_cells();
+        auto const & count = pmesh_->count();
+        auto const & indexes = pmesh_->indexes();
+        auto const & sortedatoms = pmesh_->sorted_atoms();
+        auto const ncolors = static_cast<std::int32_t>(coloroffsets.size()) - 1;
+
+        // ポテンシャルエネルギーとビリアルは、スレッドごとに計算して最後に足し合わせる
+        auto up = 0.0;
+        auto virial = 0.0;
+
+#pragma omp parallel num_threads(numthreads_) reduction(+:up, virial)
+        {
+            auto args = makeKernelArgs(pairs_, true);
+
+#pragma omp for
+            for (std::int32_t n = 0; n < NumAtom_; n++) {
+                atoms_.fx[n] = 0.0;
+                atoms_.fy[n] = 0.0;
+                atoms_.fz[n] = 0.0;
+            }
+
+            // 同じ色の番地どうしは力を書き込む原子が重ならないので、スレッドごとのバッファなしで同時に計算できる
+            for (auto c = 0; c < ncolors; c++) {
+#pragma omp for schedule(dynamic)
+                for (std::int32_t k = coloroffsets[c]; k < coloroffsets[c + 1]; k++) {
+                    auto const id = coloredcells[k];
+
+                    for (auto m = indexes[id]; m < indexes[id] + count[id]; m++) {
+                        args.ibegin = sortedatoms[m];
+                        args.iend = args.ibegin + 1;
+                        ljkernel_(args, up, virial);
+                    }
+                }
+            }
+
+            // 力積の分だけ運動量を更新する
+            // （ペアごとに運動量を書き戻すと、ペアのループでのメモリアクセスが増えるため、ここでまとめて行う）
+#pragma omp for
+            for (std::int32_t n = 0; n < NumAtom_; n++) {
+                atoms_.px[n] += atoms_.fx[n] * DT;
+                atoms_.py[n] += atoms_.fy[n] * DT;
+                atoms_.pz[n] += atoms_.fz[n] * DT;
+            }
+        }
+
+        if (computeflags_ != ljkernel::ComputeFlags::FORCE) {
+            Up_ = up;
+            virial_ = virial;
+        }
+    }
+
+    void Ar_moleculardynamics::calcForcePairDeterministic()
+    {
+        auto const nblocks = (NumAtom_ + DETERMINISTICBLOCKSIZE - 1) / DETERMINISTICBLOCKSIZE;
+        blockup_.resize(nblocks);
+        blockvirial_.resize(nblocks);
+
+        // 原子iに働く力は、原子iの行を受け持つブロックだけが行の順に足し合わせるので、スレッド数によらない
+#pragma omp parallel for num_threads(numthreads_) schedule(dynamic)
+        for (std::int32_t b = 0; b < nblocks; b++) {
+            auto args = makeKernelArgs(fullpairs_, false);
+            args.ibegin = b * DETERMINISTICBLOCKSIZE;
+            args.iend = std::min(args.ibegin + DETERMINISTICBLOCKSIZE, NumAtom_);
+
+            std::fill(atoms_.fx.begin() + args.ibegin, atoms_.fx.begin() + args.iend, 0.0);
+            std::fill(atoms_.fy.begin() + args.ibegin, atoms_.fy.begin() + args.iend, 0.0);
+            std::fill(atoms_.fz.begin() + args.ibegin, atoms_.fz.begin() + args.iend, 0.0);
+
+            auto up = 0.0;
+            auto virial = 0.0;
+            ljkernel_(args, up, virial);
+            blockup_[b] = up;
+            blockvirial_[b] = virial;
+
+            // 力積の分だけ運動量を更新する
+            for (auto n = args.ibegin; n < args.iend; n++) {
+                atoms_.px[n] += atoms_.fx[n] * DT;
+                atoms_.py[n] += atoms_.fy[n] * DT;
+                atoms_.pz[n] += atoms_.fz[n] * DT;
+            }
         }
 
-        // ポテンシャルエネルギーの初期化
-        Up_ = 0.0;
+        // ブロックごとの値を、ブロックの順に足し合わせる（両方向のペアリストでは、各ペアを2回ずつ数えている）
+        if (computeflags_ != ljkernel::ComputeFlags::FORCE) {
+            auto up = 0.0;
+            auto virial = 0.0;
+            for (auto b = 0; b < nblocks; b++) {
+                up += blockup_[b];
+                virial += blockvirial_[b];
+            }
 
-        // ビリアルの初期化
-        virial_ = 0.0;
+            Up_ = 0.5 * up;
+            virial_ = 0.5 * virial;
+        }
+    }
+
+    void Ar_moleculardynamics::calcForcePairFullList()
+    {
+        // ポテンシャルエネルギーとビリアルは、スレッドごとに計算して最後に足し合わせる
+        auto up = 0.0;
+        auto virial = 0.0;
+
+#pragma omp parallel num_threads(numthreads_) reduction(+:up, virial)
+        {
+#ifdef _OPENMP
+            auto const thread = omp_get_thread_num();
+            auto const nthreads = omp_get_num_threads();
+#else
+            auto const thread = 0;
+            auto const nthreads = 1;
+#endif
+            auto args = makeKernelArgs(fullpairs_, false);
+            rowRange(fullpairs_.offsets, thread, nthreads, args.ibegin, args.iend);
+
+            // 原子iに働く力は、原子iを受け持つスレッドしか書き込まないので、バッファは要らない
+            std::fill(atoms_.fx.begin() + args.ibegin, atoms_.fx.begin() + args.iend, 0.0);
+            std::fill(atoms_.fy.begin() + args.ibegin, atoms_.fy.begin() + args.iend, 0.0);
+            std::fill(atoms_.fz.begin() + args.ibegin, atoms_.fz.begin() + args.iend, 0.0);
+
+            ljkernel_(args, up, virial);
+
+            // 力積の分だけ運動量を更新する
+            // （ペアごとに運動量を書き戻すと、ペアのループでのメモリアクセスが増えるため、ここでまとめて行う）
+            for (auto n = args.ibegin; n < args.iend; n++) {
+                atoms_.px[n] += atoms_.fx[n] * DT;
+                atoms_.py[n] += atoms_.fy[n] * DT;
+                atoms_.pz[n] += atoms_.fz[n] * DT;
+            }
+        }
 
-        for (auto k = 0; k < pairs_.size(); ++k) {
-            auto const i = pairs_[k].first;
-            auto const j = pairs_[k].second;
-            Eigen::Vector4d d = atoms_[j].r - atoms_[i].r;
+        // 両方向のペアリストでは、各ペアを2回ずつ数えている
+        if (computeflags_ != ljkernel::ComputeFlags::FORCE) {
+            Up_ = 0.5 * up;
+            virial_ = 0.5 * virial;
+        }
+    }
 
-            SystemParam::adjust_periodic(d, periodiclen_);
-            auto const r2 = d.squaredNorm();
+    void Ar_moleculardynamics::calcForcePairReduction()
+    {
+        // ポテンシャルエネルギーとビリアルは、スレッドごとに計算して最後に足し合わせる
+        auto up = 0.0;
+        auto virial = 0.0;
+
+#pragma omp parallel num_threads(numthreads_) reduction(+:up, virial)
+        {
+#ifdef _OPENMP
+            auto const thread = omp_get_thread_num();
+            auto const nthreads = omp_get_num_threads();
+#else
+            auto const thread = 0;
+            auto const nthreads = 1;
+#endif
+            // スレッド0は原子の力の配列に直接書き込み、それ以外のスレッドは自分のバッファに書き込む
+            auto args = makeKernelArgs(pairs_, true);
+            if (thread > 0) {
+                auto & buf = forcebuffers_[thread - 1];
+                args.fx = buf.fx.data();
+                args.fy = buf.fy.data();
+                args.fz = buf.fz.data();
+            }
 
-            if (r2 <= rc2_) {
-                auto const r6 = r2 * r2 * r2;
-                auto const dFdr = (24.0 * r6 - 48.0) / (r6 * r6 * r2);
+            std::fill(args.fx, args.fx + NumAtom_, 0.0);
+            std::fill(args.fy, args.fy + NumAtom_, 0.0);
+            std::fill(args.fz, args.fz + NumAtom_, 0.0);
 
-                atoms_[i].f += dFdr * d;
-                atoms_[j].f -= dFdr * d;
+            rowRange(pairs_.offsets, thread, nthreads, args.ibegin, args.iend);
+            ljkernel_(args, up, virial);
 
-                auto const df = dFdr * DT;
+            // すべてのスレッドが書き込み終わるまで待つ
+#pragma omp barrier
 
-                atoms_[i].p += df * d;
-                atoms_[j].p -= df * d;
+            // スレッドごとのバッファを足し合わせ、力積の分だけ運動量を更新する
+            // （ペアごとに運動量を書き戻すと、ペアのループでのメモリアクセスが増えるため、ここでまとめて行う）
+#pragma omp for
+            for (std::int32_t n = 0; n < NumAtom_; n++) {
+                for (auto t = 0; t < nthreads - 1; t++) {
+                    atoms_.fx[n] += forcebuffers_[t].fx[n];
+                    atoms_.fy[n] += forcebuffers_[t].fy[n];
+                    atoms_.fz[n] += forcebuffers_[t].fz[n];
+                }
 
-                auto const r12 = r6 * r6;
-                Up_ += 4.0 * (1.0 / r12 - 1.0 / r6) + Vrc_;
-                virial_ += r2 * dFdr;
+                atoms_.px[n] += atoms_.fx[n] * DT;
+                atoms_.py[n] += atoms_.fy[n] * DT;
+                atoms_.pz[n] += atoms_.fz[n] * DT;
             }
         }
+
+        if (computeflags_ != ljkernel::ComputeFlags::FORCE) {
+            Up_ = up;
+            virial_ = virial;
+        }
+    }
+
+    double Ar_moleculardynamics::calcDisplacementBound(AtomSoA::mydoublevector const & rx0, AtomSoA::mydoublevector const & ry0, AtomSoA::mydoublevector const & rz0) const
+    {
+        auto d1 = 0.0, d2 = 0.0;
+
+        for (auto n = 0; n < NumAtom_; n++) {
+            auto const dx = atoms_.rx[n] - rx0[n];
+            auto const dy = atoms_.ry[n] - ry0[n];
+            auto const dz = atoms_.rz[n] - rz0[n];
+            auto const r2 = dx * dx + dy * dy + dz * dz;
+
+            if (r2 > d1) {
+                d2 = d1;
+                d1 = r2;
+            }
+            else if (r2 > d2) {
+                d2 = r2;
+            }
+        }
+
+        return std::sqrt(d1) + std::sqrt(d2);
+    }
+
+    void Ar_moleculardynamics::cancelAsyncRebuild()
+    {
+        if (asyncrunning_) {
+            waitAsyncRebuild();
+        }
     }
 
     void Ar_moleculardynamics::checkPairlist()
     {
-        auto vmax2 = 0.0;
+        // 周期の長さがカットオフ半径の2倍以下の箱では、カットオフ半径の中に入る像が変位によって入れ替わるので、
+        // ペアリストの周期的な像は作ったときの座標でしか正しくない（マージンが0なので、毎ステップ作り直す）
+        if (!pmesh_ && pairlistMargin() <= 0.0) {
+            rebuildPairlist(RebuildReason::DISPLACEMENT);
+            return;
+        }
 
-        for (auto && a : atoms_) {
-            auto const v2 = a.p.squaredNorm();
-            if (vmax2 < v2) {
-                vmax2 = v2;
+        // 2つの原子の距離は、それぞれの変位の和より大きく縮まないので、変位が最も大きい2つの原子の変位の和が
+        // マージン以下なら、カットオフ半径の中に入る組はすべてペアリストに含まれている
+        // 動的な刈り込みでは、外側のペアリストから、カットオフ半径とPRUNEMARGINの和の中の組をすべて刈り込めなければならない
+        auto const pruning = useDynamicPruning();
+        auto limit = pruning ? listmargin_ - Ar_moleculardynamics::PRUNEMARGIN : listmargin_;
+        auto bound = calcDisplacementBound(listrx_, listry_, listrz_);
+
+        if (useAsyncRebuild()) {
+            if (asyncrunning_) {
+                // 作成中のペアリストができていれば差し替え、今のペアリストが使えなくなったときは、できるまで待つ
+                if (bound > limit || isAsyncRebuildReady()) {
+                    finishAsyncRebuild();
+
+                    // 差し替えたペアリストは作り始めたときの座標から作ったので、それからの変位で調べ直す
+                    bound = calcDisplacementBound(listrx_, listry_, listrz_);
+                    limit = pruning ? listmargin_ - Ar_moleculardynamics::PRUNEMARGIN : listmargin_;
+                }
             }
+            else if (asynclatency_ > 0 && MD_iter_ > listiter_ ?
+                     bound * (1.0 + Ar_moleculardynamics::ASYNCREBUILDLEAD * static_cast<double>(asynclatency_) / static_cast<double>(MD_iter_ - listiter_)) > limit :
+                     bound > limit * Ar_moleculardynamics::ASYNCREBUILDSTART) {
+                // 変位がステップ数に比例して増えるとみて、前に作るのにかかったステップ数のASYNCREBUILDLEAD倍の後に
+                // 今のペアリストが使えなくなるなら作り始める（まだ作ったことがないときは、マージンのASYNCREBUILDSTART倍で作り始める）
+                // マージンを変えるのは、次のペアリストを作り始めるときだけにする（今のペアリストは、作ったときのマージンで調べ続ける）
+                if (marginautotune_) {
+                    tuneMargin();
+                }
+
+                startAsyncRebuild();
+            }
+        }
+
+        if (bound > limit) {
+            // マージンを変えるのは、ペアリストを作り直すときだけにする（作り直さずに大きくすると、ペアを見落とす）
+            if (marginautotune_) {
+                tuneMargin();
+            }
+
+            rebuildPairlist(RebuildReason::DISPLACEMENT);
+        }
+        else if (pruning && calcDisplacementBound(prunerx_, prunery_, prunerz_) > Ar_moleculardynamics::PRUNEMARGIN) {
+            prunePairlist();
+        }
+    }
+
+    void Ar_moleculardynamics::compressPairlist()
+    {
+        if (!useCompressedPairlist()) {
+            return;
         }
 
-        auto const vmax = std::sqrt(vmax2);
-        margin_length_ -= vmax * 2.0 * DT;
+        auto const & pairs = useFullPairlist() ? fullpairs_ : pairs_;
+        auto & compact = compactpairs_;
+        auto const npairs = pairs.offsets[NumAtom_];
+
+        // 相手の原子のインデックスと区間の基準の差が16ビットに収まらないときは、新しい区間を始める
+        // 区間の基準は、原子iとの差で表せるときは原子i、表せないときはその相手の原子にする
+        auto const fits = [](std::int32_t d)
+        {
+            return d >= std::numeric_limits<std::int16_t>::min() && d <= std::numeric_limits<std::int16_t>::max();
+        };
+
+        compact.segoffsets.resize(NumAtom_ + 1);
+        compact.jdelta.resize(npairs + PairList::SHIFTPADDING);
+
+#pragma omp parallel num_threads(numthreads_)
+        {
+            // 1回目は、行ごとの区間の数をsegoffsets[i + 1]に数える
+#pragma omp for
+            for (std::int32_t i = 0; i < NumAtom_; i++) {
+                auto nsegs = 0;
+                auto base = i;
+
+                for (auto k = pairs.offsets[i]; k < pairs.offsets[i + 1]; k++) {
+                    auto const j = pairs.jindex[k];
+
+                    if (k == pairs.offsets[i] || !fits(j - base)) {
+                        base = fits(j - i) ? i : j;
+                        nsegs++;
+                    }
+                }
 
-        if (margin_length_ < 0.0) {
-            margin_length_ = SystemParam::MARGIN;
-            if (m_ > 2) {
-                pmesh_->make_pair(atoms_, pairs_);
+                compact.segoffsets[i + 1] = nsegs;
             }
-            else {
-                makePair();
+
+            // 区間の数を累積和にして、区間ごとの配列を確保する
+#pragma omp single
+            {
+                compact.segoffsets[0] = 0;
+                for (auto i = 0; i < NumAtom_; i++) {
+                    compact.segoffsets[i + 1] += compact.segoffsets[i];
+                }
+
+                auto const nsegs = compact.segoffsets[NumAtom_];
+                compact.segatom.resize(nsegs);
+                compact.segbase.resize(nsegs);
+                compact.offsets.resize(nsegs + 1);
+                compact.offsets[nsegs] = npairs;
+                std::fill(compact.jdelta.begin() + npairs, compact.jdelta.end(), static_cast<std::int16_t>(0));
+            }
+
+            // 2回目は、1回目と同じ規則で区間を分けながら、区間と差を書き込む
+#pragma omp for
+            for (std::int32_t i = 0; i < NumAtom_; i++) {
+                auto r = compact.segoffsets[i] - 1;
+                auto base = i;
+
+                for (auto k = pairs.offsets[i]; k < pairs.offsets[i + 1]; k++) {
+                    auto const j = pairs.jindex[k];
+
+                    if (k == pairs.offsets[i] || !fits(j - base)) {
+                        base = fits(j - i) ? i : j;
+                        r++;
+                        compact.segatom[r] = i;
+                        compact.segbase[r] = base;
+                        compact.offsets[r] = k;
+                    }
+
+                    compact.jdelta[k] = static_cast<std::int16_t>(j - base);
+                }
             }
         }
     }
 
+    void Ar_moleculardynamics::countRebuild(RebuildReason reason)
+    {
+        if (reason == RebuildReason::DISPLACEMENT) {
+            rebuilddisplacementcount_++;
+            rebuildintervalsum_ += MD_iter_ - lastrebuilditer_;
+        }
+        else {
+            // 設定が変わったときは、マージンの自動調整の時間の測り直しにする
+            cycletime_ = 0.0;
+            cyclesteps_ = 0;
+            lastcyclecost_ = 0.0;
+        }
+
+        lastrebuilditer_ = MD_iter_;
+        rebuildcount_++;
+        rebuildreason_ = reason;
+    }
+
     double Ar_moleculardynamics::DimensionlessToHartree(double e) const
     {
         return e * Ar_moleculardynamics::YPSILON / Ar_moleculardynamics::HARTREE;
     }
 
+    void Ar_moleculardynamics::finishAsyncRebuild()
+    {
+        waitAsyncRebuild();
+        asynclatency_ = MD_iter_ - asynciter_;
+
+        // 写した座標を周期の内側に戻したのと同じだけ、今の座標もずらす（ペアリストの像の番号は、写した座標で決めている）
+        for (auto n = 0; n < NumAtom_; n++) {
+            atoms_.rx[n] += periodicShift(asyncrx_[n]);
+            atoms_.ry[n] += periodicShift(asyncry_[n]);
+            atoms_.rz[n] += periodicShift(asyncrz_[n]);
+        }
+
+        if (asyncmorton_) {
+            reorderAtoms(asyncorder_);
+        }
+
+        // 次に作り直すかどうかは、作り始めたときの座標（周期の内側に戻し、並べ替えた後の座標）からの変位で決める
+        std::copy(asyncatoms_.rx.begin(), asyncatoms_.rx.end(), listrx_.begin());
+        std::copy(asyncatoms_.ry.begin(), asyncatoms_.ry.end(), listry_.begin());
+        std::copy(asyncatoms_.rz.begin(), asyncatoms_.rz.end(), listrz_.begin());
+        listmargin_ = asyncmargin_;
+        listiter_ = asynciter_;
+
+        countRebuild(RebuildReason::DISPLACEMENT);
+
+        std::swap(pairs_, asyncpairs_);
+        if (useFullPairlist()) {
+            std::swap(fullpairs_, asyncfullpairs_);
+        }
+
+        if (useDynamicPruning()) {
+            std::swap(useFullPairlist() ? fullpairs_ : pairs_, outerpairs_);
+            prunePairlist();
+        }
+        else {
+            compressPairlist();
+        }
+    }
+
+    SystemParam::myatomvector const & Ar_moleculardynamics::getAtomsView() const
+    {
+        if (atomsviewdirty_) {
+            atomsview_.resize(atoms_.size());
+
+            // ペアリストを作り直すまでは原子がセルの外側にいることがあるので、セル内に戻した座標を渡す
+            auto const wrap = [this](double r)
+            {
+                return r > periodiclen_ ? r - periodiclen_ : (r < 0.0 ? r + periodiclen_ : r);
+            };
+
+            // 原子を並べ替えていても、元の原子の番号の順に渡す
+            for (auto n = 0; n < NumAtom_; n++) {
+                auto & atom = atomsview_[atomid_[n]];
+                atom.f = Eigen::Vector4d(atoms_.fx[n], atoms_.fy[n], atoms_.fz[n], 0.0);
+                atom.p = Eigen::Vector4d(atoms_.px[n], atoms_.py[n], atoms_.pz[n], 0.0);
+                atom.r = Eigen::Vector4d(wrap(atoms_.rx[n]), wrap(atoms_.ry[n]), wrap(atoms_.rz[n]), 0.0);
+            }
+
+            atomsviewdirty_ = false;
+        }
+
+        return atomsview_;
+    }
+
+    bool Ar_moleculardynamics::isAsyncRebuildReady()
+    {
+        std::lock_guard<std::mutex> lock(asyncmutex_);
+        return asyncready_;
+    }
+
     void Ar_moleculardynamics::Langevin()
     {
         auto const D = std::sqrt(2.0 * Ar_moleculardynamics::GAMMA * Tg_ / DT);
 
-        std::normal_distribution<double> nd(0.0, D);
-        myrandom::MyRand<std::normal_distribution<double> > mr(nd);
-        for (auto && atom : atoms_) {
-            atom.p[0] += (-Ar_moleculardynamics::GAMMA * atom.p[0] + mr.myrand()) * DT;
-            atom.p[1] += (-Ar_moleculardynamics::GAMMA * atom.p[1] + mr.myrand()) * DT;
-            atom.p[2] += (-Ar_moleculardynamics::GAMMA * atom.p[2] + mr.myrand()) * DT;
+        // 乱数エンジンは呼び出しごとに作り直さず、標準正規分布の乱数をD倍して使う
+        for (auto n = 0; n < NumAtom_; n++) {
+            atoms_.px[n] += (-Ar_moleculardynamics::GAMMA * atoms_.px[n] + D * langevinrand_.myrand()) * DT;
+            atoms_.py[n] += (-Ar_moleculardynamics::GAMMA * atoms_.py[n] + D * langevinrand_.myrand()) * DT;
+            atoms_.pz[n] += (-Ar_moleculardynamics::GAMMA * atoms_.pz[n] + D * langevinrand_.myrand()) * DT;
         }
     }
 
-    void Ar_moleculardynamics::makePair()
+    void Ar_moleculardynamics::makePair(AtomSoA const & atoms, double margin, PairList & pairs) const
     {
-        pairs_.clear();
+        // ペアリストには、カットオフ半径とマージンの和までの組を登録する（変位がマージンを超えるまで作り直さないため）
+        auto const ml2 = (SystemParam::RCUTOFF + margin) * (SystemParam::RCUTOFF + margin);
+
+        // ペアを登録する間にメモリを確保し直さないように、前回のペアの数に余裕を持たせた容量を先に確保しておく
+        auto const npairs = pairs.jindex.size();
+        pairs.reserve(npairs + npairs / 8);
+
+        pairs.jindex.clear();
+        pairs.shift.clear();
+        pairs.offsets.resize(NumAtom_ + 1);
+
+        for (auto i = 0; i < NumAtom_; i++) {
+            pairs.offsets[i] = static_cast<std::int32_t>(pairs.jindex.size());
 
-        for (auto i = 0; i < NumAtom_ - 1; i++) {
             for (auto j = i + 1; j < NumAtom_; j++) {
-                Eigen::Vector4d d = atoms_[j].r - atoms_[i].r;
+                auto dx = atoms.rx[j] - atoms.rx[i];
+                auto dy = atoms.ry[j] - atoms.ry[i];
+                auto dz = atoms.rz[j] - atoms.rz[i];
+
+                auto const shift = SystemParam::periodic_shift(dx, dy, dz, periodiclen_);
+
+                if (dx * dx + dy * dy + dz * dz <= ml2) {
+                    pairs.jindex.push_back(j);
+                    pairs.shift.push_back(shift);
+                }
+            }
+        }
+
+        pairs.offsets[NumAtom_] = static_cast<std::int32_t>(pairs.jindex.size());
+        pairs.shift.resize(pairs.jindex.size() + PairList::SHIFTPADDING, SystemParam::shift_index(0, 0, 0));
+    }
+
+    void Ar_moleculardynamics::makeFullPairlist(PairList const & pairs, PairList & fullpairs) const
+    {
+        auto & offsets = fullpairs.offsets;
+
+        // 各原子の相手の原子の数を数える
+        offsets.assign(NumAtom_ + 1, 0);
+        for (auto i = 0; i < NumAtom_; i++) {
+            offsets[i + 1] += pairs.offsets[i + 1] - pairs.offsets[i];
+
+            for (auto k = pairs.offsets[i]; k < pairs.offsets[i + 1]; k++) {
+                offsets[pairs.jindex[k] + 1]++;
+            }
+        }
+
+        for (auto i = 0; i < NumAtom_; i++) {
+            offsets[i + 1] += offsets[i];
+        }
+
+        // offsets[i]を原子iの行の書き込み位置として使い、ペア(i, j)を行iと行jの両方に書き込む
+        // 行jに書き込むペアでは、周期的な像の向きも逆になる
+        fullpairs.reserve(offsets[NumAtom_]);
+        fullpairs.jindex.resize(offsets[NumAtom_]);
+        fullpairs.shift.assign(offsets[NumAtom_] + PairList::SHIFTPADDING, SystemParam::shift_index(0, 0, 0));
+        for (auto i = 0; i < NumAtom_; i++) {
+            for (auto k = pairs.offsets[i]; k < pairs.offsets[i + 1]; k++) {
+                auto const j = pairs.jindex[k];
+                auto const shift = pairs.shift[k];
+
+                fullpairs.shift[offsets[i]] = shift;
+                fullpairs.jindex[offsets[i]++] = j;
+                fullpairs.shift[offsets[j]] = SystemParam::reverse_shift(shift);
+                fullpairs.jindex[offsets[j]++] = i;
+            }
+        }
+
+        // 書き込み位置は次の行の始まりまで進んでいるので、1つずらして元に戻す
+        for (auto i = NumAtom_; i > 0; i--) {
+            offsets[i] = offsets[i - 1];
+        }
+        offsets[0] = 0;
+    }
+
+    ljkernel::ForceKernelArgs Ar_moleculardynamics::makeKernelArgs(PairList const & pairs, bool newton)
+    {
+        ljkernel::ForceKernelArgs args;
+        args.rx = atoms_.rx.data();
+        args.ry = atoms_.ry.data();
+        args.rz = atoms_.rz.data();
+        args.fx = atoms_.fx.data();
+        args.fy = atoms_.fy.data();
+        args.fz = atoms_.fz.data();
+        args.jindex = pairs.jindex.data();
+        args.offsets = pairs.offsets.data();
+        args.shift = pairs.shift.data();
+
+        // 圧縮したペアリストは、力の計算に使うペアリストから作ってあり、ペアの番号と周期的な像の番号は共通
+        if (useCompressedPairlist()) {
+            BOOST_ASSERT(&pairs == &(useFullPairlist() ? fullpairs_ : pairs_));
+
+            args.offsets = compactpairs_.offsets.data();
+            args.jdelta = compactpairs_.jdelta.data();
+            args.segoffsets = compactpairs_.segoffsets.data();
+            args.segatom = compactpairs_.segatom.data();
+            args.segbase = compactpairs_.segbase.data();
+        }
+        else {
+            args.jdelta = nullptr;
+            args.segoffsets = nullptr;
+            args.segatom = nullptr;
+            args.segbase = nullptr;
+        }
+        args.ibegin = 0;
+        args.iend = NumAtom_;
+        args.newton = newton;
+        args.flags = computeflags_;
+        args.periodiclen = periodiclen_;
+        args.rc2 = rc2_;
+        args.vrc = Vrc_;
+
+        if (ptable_) {
+            args.table = ptable_->coefficients().data();
+            args.tabler2min = ptable_->r2min();
+            args.tableinvdr2 = ptable_->inverse_interval();
+            args.tablesize = ptable_->size();
+        }
+        else {
+            args.table = nullptr;
+            args.tabler2min = 0.0;
+            args.tableinvdr2 = 0.0;
+            args.tablesize = 0;
+        }
 
-                SystemParam::adjust_periodic(d, periodiclen_);
+        return args;
+    }
 
-                if (d.squaredNorm() <= rc2_) {
-                    pairs_.push_back(std::make_pair(i, j));
+    void Ar_moleculardynamics::makeMesh()
+    {
+        // 作成中のペアリストは、今のメッシュリストを使っているので捨てる
+        cancelAsyncRebuild();
+
+        // 一辺の番地の数がステンシルの幅（2 * division + 1番地）以下だと同じ番地の像を2回たどってしまうので、
+        // 小さな箱では、それより多くの番地がとれるまで番地を細かくする
+        // 細かくしきれない箱では、総当たりでペアリストを作る
+        // （そのような箱では、周期の長さがカットオフ半径とマージンの和の2倍より短いことがあり、周期的な像を固定できる範囲に
+        // マージンを削るのは総当たりの側で行う。pairlistMargin()を参照）
+        auto division = meshdivision_;
+        while (MeshList::calc_mesh_number(periodiclen_, margin_, division) <= 2 * division) {
+            if (++division > Ar_moleculardynamics::SMALLBOXMAXDIVISION) {
+                // 総当たりにしている間も、マージンの自動調整でメッシュに戻ったときに使い回せるように、メッシュリストは取っておく
+                if (pmesh_) {
+                    sparemesh_ = std::move(pmesh_);
                 }
+
+                return;
             }
         }
+
+        if (!pmesh_) {
+            pmesh_ = std::move(sparemesh_);
+        }
+
+        if (!pmesh_) {
+            pmesh_.reset(new MeshList(periodiclen_, margin_, division));
+            pmesh_->set_number_of_atoms(atoms_.size());
+        }
+        else if (pmesh_->division() != division ||
+                 pmesh_->mesh_number() != MeshList::calc_mesh_number(periodiclen_, margin_, division)) {
+            // マージンの自動調整では番地の大きさが何度も変わるので、メッシュリストは作り直さずに番地の大きさだけを変える
+            // （番地ごとの配列やスレッドごとのペアリストのバッファの容量は残るので、前に通った大きさならメモリを確保し直さない）
+            pmesh_->set_mesh(margin_, division);
+            pmesh_->set_number_of_atoms(atoms_.size());
+        }
+        else {
+            pmesh_->set_margin(margin_);
+        }
+
+        pmesh_->set_simd_type(simdtype_);
+
+        // 一辺の番地の数がステンシルの幅より多ければ、周期の長さはカットオフ半径とマージンの和の2倍より長く、周期的な像を固定できる
+        BOOST_ASSERT(periodiclen_ > 2.0 * (SystemParam::RCUTOFF + margin_));
     }
 
     void Ar_moleculardynamics::MD_initPos()
@@ -299,16 +1396,24 @@ namespace moleculardynamics {
                     sz = static_cast<double>(k)* lat_;
 
                     // 基本セル内には4つの原子がある
-                    atoms_[n].r = Eigen::Vector4d(sx, sy, sz, 0.0);
+                    atoms_.rx[n] = sx;
+                    atoms_.ry[n] = sy;
+                    atoms_.rz[n] = sz;
                     n++;
 
-                    atoms_[n].r = Eigen::Vector4d(0.5 * lat_ + sx, 0.5 * lat_ + sy, sz, 0.0);
+                    atoms_.rx[n] = 0.5 * lat_ + sx;
+                    atoms_.ry[n] = 0.5 * lat_ + sy;
+                    atoms_.rz[n] = sz;
                     n++;
 
-                    atoms_[n].r = Eigen::Vector4d(sx, 0.5 * lat_ + sy, 0.5 * lat_ + sz, 0.0);
+                    atoms_.rx[n] = sx;
+                    atoms_.ry[n] = 0.5 * lat_ + sy;
+                    atoms_.rz[n] = 0.5 * lat_ + sz;
                     n++;
 
-                    atoms_[n].r = Eigen::Vector4d(0.5 * lat_ + sx, sy, 0.5 * lat_ + sz, 0.0);
+                    atoms_.rx[n] = 0.5 * lat_ + sx;
+                    atoms_.ry[n] = sy;
+                    atoms_.rz[n] = 0.5 * lat_ + sz;
                     n++;
                 }
             }
@@ -318,16 +1423,22 @@ namespace moleculardynamics {
 
         // move the center of mass to the origin
         // 系の重心を座標系の原点とする
-        Eigen::Vector4d s(0.0, 0.0, 0.0, 0.0);
+        auto sumx = 0.0, sumy = 0.0, sumz = 0.0;
 
-        for (auto && atom : atoms_) {
-            s += atom.r;
+        for (auto n = 0; n < NumAtom_; n++) {
+            sumx += atoms_.rx[n];
+            sumy += atoms_.ry[n];
+            sumz += atoms_.rz[n];
         }
 
-        s /= static_cast<double>(NumAtom_);
+        sumx /= static_cast<double>(NumAtom_);
+        sumy /= static_cast<double>(NumAtom_);
+        sumz /= static_cast<double>(NumAtom_);
 
         for (auto n = 0; n < NumAtom_; n++) {
-            atoms_[n].r -= s;
+            atoms_.rx[n] -= sumx;
+            atoms_.ry[n] -= sumy;
+            atoms_.rz[n] -= sumz;
         }
     }
 
@@ -338,24 +1449,33 @@ namespace moleculardynamics {
         std::uniform_real_distribution<double> dist(-1.0, 1.0);
         myrandom::MyRand<std::uniform_real_distribution<double> > mr(dist);
 
-        for (auto && a : atoms_) {
+        for (auto n = 0; n < NumAtom_; n++) {
             Eigen::Vector4d rnd(mr.myrand(), mr.myrand(), mr.myrand(), 0.0);
 
             // 方向はランダムに与える
-            a.p = v * rnd / rnd.norm();
+            Eigen::Vector4d const p = v * rnd / rnd.norm();
+            atoms_.px[n] = p[0];
+            atoms_.py[n] = p[1];
+            atoms_.pz[n] = p[2];
         }
 
-        Eigen::Vector4d s(0.0, 0.0, 0.0, 0.0);
+        auto sumx = 0.0, sumy = 0.0, sumz = 0.0;
 
-        for (auto && a : atoms_) {
-            s += a.p;
+        for (auto n = 0; n < NumAtom_; n++) {
+            sumx += atoms_.px[n];
+            sumy += atoms_.py[n];
+            sumz += atoms_.pz[n];
         }
 
-        s /= static_cast<double>(NumAtom_);
+        sumx /= static_cast<double>(NumAtom_);
+        sumy /= static_cast<double>(NumAtom_);
+        sumz /= static_cast<double>(NumAtom_);
 
         // 重心の並進運動を避けるために、速度の和がゼロになるように補正
-        for (auto && a : atoms_) {
-            a.p -= s;
+        for (auto n = 0; n < NumAtom_; n++) {
+            atoms_.px[n] -= sumx;
+            atoms_.py[n] -= sumy;
+            atoms_.pz[n] -= sumz;
         }
     }
 
@@ -371,16 +1491,13 @@ namespace moleculardynamics {
         Uk_ = 0.0;
 
         // calculate temperture
-        for (auto && a : atoms_) {
-            Uk_ += a.p.squaredNorm();
+        for (auto n = 0; n < NumAtom_; n++) {
+            Uk_ += atoms_.px[n] * atoms_.px[n] + atoms_.py[n] * atoms_.py[n] + atoms_.pz[n] * atoms_.pz[n];
         }
 
         // 運動エネルギーの計算
         Uk_ *= 0.5;
 
-        // 全エネルギー（運動エネルギー+ポテンシャルエネルギー）の計算
-        Utot_ = Uk_ + Up_;
-
         // 温度の計算
         Tc_ = Uk_ / (1.5 * static_cast<double>(NumAtom_));
 
@@ -413,8 +1530,10 @@ namespace moleculardynamics {
             break;
         }
 
-        for (auto && atom : atoms_) {
-            atom.r += atom.p * DT * 0.5;
+        for (auto n = 0; n < NumAtom_; n++) {
+            atoms_.rx[n] += atoms_.px[n] * DT * 0.5;
+            atoms_.ry[n] += atoms_.py[n] * DT * 0.5;
+            atoms_.rz[n] += atoms_.pz[n] * DT * 0.5;
         }
     }
 
@@ -422,8 +1541,10 @@ namespace moleculardynamics {
     {
         zeta_ += (Tc_ - Tg_) / (Ar_moleculardynamics::TAU_NOSE_HOOVER * Ar_moleculardynamics::TAU_NOSE_HOOVER) * DT;
 
-        for (auto && atom : atoms_){
-            atom.p -= atom.p * zeta_ * DT;
+        for (auto n = 0; n < NumAtom_; n++) {
+            atoms_.px[n] -= atoms_.px[n] * zeta_ * DT;
+            atoms_.py[n] -= atoms_.py[n] * zeta_ * DT;
+            atoms_.pz[n] -= atoms_.pz[n] * zeta_ * DT;
         }
     }
 
@@ -431,36 +1552,417 @@ namespace moleculardynamics {
     {
         // consider the periodic boundary condination
         // セルの外側に出たら座標をセル内に戻す
-        for (auto && atom : atoms_) {
-            if (atom.r[0] > periodiclen_) {
-                atom.r[0] -= periodiclen_;
+        for (auto n = 0; n < NumAtom_; n++) {
+            if (atoms_.rx[n] > periodiclen_) {
+                atoms_.rx[n] -= periodiclen_;
             }
-            else if (atom.r[0] < 0.0) {
-                atom.r[0] += periodiclen_;
+            else if (atoms_.rx[n] < 0.0) {
+                atoms_.rx[n] += periodiclen_;
             }
 
-            if (atom.r[1] > periodiclen_) {
-                atom.r[1] -= periodiclen_;
+            if (atoms_.ry[n] > periodiclen_) {
+                atoms_.ry[n] -= periodiclen_;
             }
-            else if (atom.r[1] < 0.0) {
-                atom.r[1] += periodiclen_;
+            else if (atoms_.ry[n] < 0.0) {
+                atoms_.ry[n] += periodiclen_;
             }
 
-            if (atom.r[2] > periodiclen_) {
-                atom.r[2] -= periodiclen_;
+            if (atoms_.rz[n] > periodiclen_) {
+                atoms_.rz[n] -= periodiclen_;
             }
-            else if (atom.r[2] < 0.0) {
-                atom.r[2] += periodiclen_;
+            else if (atoms_.rz[n] < 0.0) {
+                atoms_.rz[n] += periodiclen_;
             }
         }
     }
 
+    double Ar_moleculardynamics::periodicShift(double r) const
+    {
+        return r > periodiclen_ ? -periodiclen_ : (r < 0.0 ? periodiclen_ : 0.0);
+    }
+
+    double Ar_moleculardynamics::pairlistMargin() const
+    {
+        // 変位がマージン以下の間に、作ったときと別の像がカットオフ半径の中に入らないのは、
+        // 周期の長さがカットオフ半径とマージンの和の2倍以上のときだけ
+        // メッシュを使うときは、一辺の番地の数がステンシルの幅より多いので、この条件を満たしている
+        if (pmesh_) {
+            return margin_;
+        }
+
+        return std::max(std::min(margin_, 0.5 * periodiclen_ - SystemParam::RCUTOFF), 0.0);
+    }
+
+    void Ar_moleculardynamics::prunePairlist()
+    {
+        // 力の計算に使うペアリストを、外側のペアリストと同じ向きのまま刈り込む
+        auto & pairs = useFullPairlist() ? fullpairs_ : pairs_;
+        auto const & outer = outerpairs_;
+
+        // 内側のペアリストには、ポテンシャルのカットオフ半径とPRUNEMARGINの和までの組を残す
+        auto const rc = std::sqrt(rc2_) + Ar_moleculardynamics::PRUNEMARGIN;
+        auto const rl2 = rc * rc;
+
+        std::copy(atoms_.rx.begin(), atoms_.rx.end(), prunerx_.begin());
+        std::copy(atoms_.ry.begin(), atoms_.ry.end(), prunery_.begin());
+        std::copy(atoms_.rz.begin(), atoms_.rz.end(), prunerz_.begin());
+
+        pairs.offsets.resize(NumAtom_ + 1);
+        prunebuffers_.resize(numthreads_);
+
+#pragma omp parallel num_threads(numthreads_)
+        {
+#ifdef _OPENMP
+            auto const thread = omp_get_thread_num();
+            auto const nthreads = omp_get_num_threads();
+#else
+            auto const thread = 0;
+            auto const nthreads = 1;
+#endif
+            // スレッドごとに受け持つ行の組を作業用のペアリストに集め、行ごとの組の数をoffsets[i + 1]に書いておく
+            std::int32_t ibegin, iend;
+            rowRange(outer.offsets, thread, nthreads, ibegin, iend);
+
+            // 集める組は受け持つ行の外側のペアリストの組を超えないので、その数の容量を先に確保しておく（集める間にメモリを確保し直さない）
+            auto & buf = prunebuffers_[thread];
+            buf.reserve(static_cast<std::size_t>(outer.offsets[iend] - outer.offsets[ibegin]));
+
+            buf.jindex.clear();
+            buf.shift.clear();
+
+            ljkernel::PairPruneArgs args;
+            args.rx = atoms_.rx.data();
+            args.ry = atoms_.ry.data();
+            args.rz = atoms_.rz.data();
+            args.periodiclen = periodiclen_;
+            args.rl2 = rl2;
+
+            for (auto i = ibegin; i < iend; i++) {
+                args.jindex = outer.jindex.data() + outer.offsets[i];
+                args.shift = outer.shift.data() + outer.offsets[i];
+                args.n = outer.offsets[i + 1] - outer.offsets[i];
+                args.xi = atoms_.rx[i];
+                args.yi = atoms_.ry[i];
+                args.zi = atoms_.rz[i];
+
+                // 行の組がすべて残っても入るように広げてから刈り込んだ結果を書き込み、残った数に縮める
+                auto const size = buf.jindex.size();
+                buf.jindex.resize(size + args.n);
+                buf.shift.resize(size + args.n);
+                auto const kept = pairprune_(args, buf.jindex.data() + size, buf.shift.data() + size);
+
+                buf.jindex.resize(size + kept);
+                buf.shift.resize(size + kept);
+                pairs.offsets[i + 1] = kept;
+            }
+
+            // 行ごとの組の数を累積和にして、各スレッドの組を書き込む位置を決める
+#pragma omp barrier
+#pragma omp single
+            {
+                pairs.offsets[0] = 0;
+                for (auto i = 0; i < NumAtom_; i++) {
+                    pairs.offsets[i + 1] += pairs.offsets[i];
+                }
+
+                auto const npairs = static_cast<std::size_t>(pairs.offsets[NumAtom_]);
+                pairs.reserve(npairs);
+                pairs.jindex.resize(npairs);
+                pairs.shift.resize(npairs + PairList::SHIFTPADDING);
+                std::fill(pairs.shift.begin() + npairs, pairs.shift.end(), SystemParam::shift_index(0, 0, 0));
+            }
+
+            std::copy(buf.jindex.begin(), buf.jindex.end(), pairs.jindex.begin() + pairs.offsets[ibegin]);
+            std::copy(buf.shift.begin(), buf.shift.end(), pairs.shift.begin() + pairs.offsets[ibegin]);
+        }
+
+        prunecount_++;
+
+        compressPairlist();
+    }
+
+    void Ar_moleculardynamics::rebuildPairlist(RebuildReason reason)
+    {
+        // 作成中のペアリストがあれば捨てて、今の座標から作り直す
+        cancelAsyncRebuild();
+
+        // ペアリストを使う間は原子を周期の外側に出したままにして、作り直すときにまとめてセル内に戻す
+        periodic();
+
+        // 原子を番地の空間充填曲線の順に並べ替えて、ペアの相手の原子がメモリ上でも近くにあるようにする
+        if (atomordertype_ == AtomOrderType::MORTON && pmesh_) {
+            pmesh_->sort_atoms(atoms_);
+            reorderAtoms(pmesh_->sorted_atoms());
+        }
+
+        // 次に作り直すかどうかは、この座標からの変位で決める（周期の内側に戻し、並べ替えた後の座標）
+        std::copy(atoms_.rx.begin(), atoms_.rx.end(), listrx_.begin());
+        std::copy(atoms_.ry.begin(), atoms_.ry.end(), listry_.begin());
+        std::copy(atoms_.rz.begin(), atoms_.rz.end(), listrz_.begin());
+        listmargin_ = pairlistMargin();
+        listiter_ = MD_iter_;
+
+        // ペアの周期的な像を固定してよいのは、周期の長さがカットオフ半径とマージンの和の2倍以上のときだけ
+        BOOST_ASSERT(listmargin_ <= 0.5 * periodiclen_ - SystemParam::RCUTOFF || listmargin_ == 0.0);
+
+        countRebuild(reason);
+
+        if (useClusterPairlist()) {
+            pmesh_->make_cluster_pair(atoms_, clusterpairs_);
+            return;
+        }
+
+        if (pmesh_) {
+            pmesh_->make_pair(atoms_, pairs_);
+        }
+        else {
+            makePair(atoms_, listmargin_, pairs_);
+        }
+
+        if (useFullPairlist()) {
+            makeFullPairlist(pairs_, fullpairs_);
+        }
+
+        // 動的な刈り込みでは、作ったペアリストを外側のペアリストにして、力の計算に使うペアリストはそこから刈り込む
+        if (useDynamicPruning()) {
+            std::swap(useFullPairlist() ? fullpairs_ : pairs_, outerpairs_);
+            prunePairlist();
+        }
+        else {
+            compressPairlist();
+        }
+    }
+
+    void Ar_moleculardynamics::reorderAtoms(std::vector<std::int32_t> const & order)
+    {
+        // orderはatomslot_のこともあるので、atomslot_は最後に作り直す
+        auto const permute = [this, &order](AtomSoA::mydoublevector & v)
+        {
+            for (auto k = 0; k < NumAtom_; k++) {
+                reorderbuffer_[k] = v[order[k]];
+            }
+
+            v.swap(reorderbuffer_);
+        };
+
+        permute(atoms_.fx);
+        permute(atoms_.fy);
+        permute(atoms_.fz);
+        permute(atoms_.px);
+        permute(atoms_.py);
+        permute(atoms_.pz);
+        permute(atoms_.rx);
+        permute(atoms_.ry);
+        permute(atoms_.rz);
+
+        for (auto k = 0; k < NumAtom_; k++) {
+            reorderindex_[k] = atomid_[order[k]];
+        }
+
+        atomid_.swap(reorderindex_);
+
+        for (auto k = 0; k < NumAtom_; k++) {
+            atomslot_[atomid_[k]] = k;
+        }
+
+        atomsviewdirty_ = true;
+    }
+
+    void Ar_moleculardynamics::reserveMesh()
+    {
+        // 調整の途中で初めて細かい番地に切り替わると、番地ごとの配列を確保し直すので、
+        // 調整の最小の幅ごとにマージンを動かしてメッシュリストを作り、容量を通りうる大きさの最大まで育てておく
+        auto const margin = margin_;
+        for (margin_ = Ar_moleculardynamics::MARGINMIN; margin_ < Ar_moleculardynamics::MARGINMAX; margin_ += Ar_moleculardynamics::MARGINSTEPMIN) {
+            makeMesh();
+        }
+
+        margin_ = Ar_moleculardynamics::MARGINMAX;
+        makeMesh();
+
+        // ペアの数はマージンが最大のときにいちばん多いので、一度ペアリストを作って、スレッドごとのバッファとペアリストの容量も育てておく
+        if (pmesh_ && pairlisttype_ == PairListType::ATOM) {
+            pmesh_->make_pair(atoms_, pairs_);
+        }
+
+        margin_ = margin;
+        makeMesh();
+    }
+
+    void Ar_moleculardynamics::rowRange(std::vector<std::int32_t> const & offsets, std::int32_t thread, std::int32_t nthreads, std::int32_t & ibegin, std::int32_t & iend) const
+    {
+        // ペアの数の累積和であるoffsetsを二分探索して、ペアの数でnthreads等分した位置の行を求める
+        auto const nrows = static_cast<std::int32_t>(offsets.size()) - 1;
+        auto const first = offsets.begin();
+        auto const last = first + nrows;
+        auto const npairs = static_cast<std::int64_t>(offsets[nrows]);
+
+        auto const bound = [&](std::int32_t t)
+        {
+            return t >= nthreads ?
+                nrows :
+                static_cast<std::int32_t>(std::lower_bound(first, last, static_cast<std::int32_t>(npairs * t / nthreads)) - first);
+        };
+
+        ibegin = bound(thread);
+        iend = bound(thread + 1);
+    }
+
+    void Ar_moleculardynamics::selectKernel()
+    {
+        // 数表を使うときは、命令セットごとの数表のカーネル関数の方が速い
+        ljkernel_ = potentialkernel_ && !ptable_ ? potentialkernel_ : ljkernel::get_kernel(simdtype_);
+        clusterkernel_ = ljkernel::get_cluster_kernel(simdtype_);
+        mixedclusterkernel_ = ljkernel::get_mixed_cluster_kernel(simdtype_);
+        pairprune_ = ljkernel::get_pair_prune(simdtype_);
+    }
+
+    void Ar_moleculardynamics::selectParallelMethod()
+    {
+        if (useClusterPairlist()) {
+            // クラスタペアリストは、常にスレッドごとのバッファで並列化する
+            parallelmethodinuse_ = ParallelMethod::REDUCTION;
+        }
+        else if (parallelmethod_ == ParallelMethod::COLORING && !pmesh_) {
+            // メッシュを使わないときは、番地を塗り分けられない
+            parallelmethodinuse_ = ParallelMethod::REDUCTION;
+        }
+        else if (parallelmethod_ != ParallelMethod::AUTO) {
+            parallelmethodinuse_ = parallelmethod_;
+        }
+        else if (numthreads_ > 1 &&
+                 static_cast<std::size_t>(NumAtom_) * static_cast<std::size_t>(numthreads_) * 3 * sizeof(double) > MAXFORCEBUFFERSIZE) {
+            // 原子数が多く、スレッドごとのバッファの初期化と足し合わせがペアの計算より重くなるとき
+            parallelmethodinuse_ = ParallelMethod::FULLLIST;
+        }
+        else {
+            parallelmethodinuse_ = ParallelMethod::REDUCTION;
+        }
+
+        if (parallelmethodinuse_ == ParallelMethod::REDUCTION) {
+            forcebuffers_.resize(numthreads_ - 1);
+            for (auto & buf : forcebuffers_) {
+                buf.resize(NumAtom_);
+            }
+        }
+        else {
+            forcebuffers_.clear();
+        }
+    }
+
+    void Ar_moleculardynamics::startAsyncRebuild()
+    {
+        // ヘルパースレッドは写した座標だけを読むので、作っている間も原子を動かせる
+        std::copy(atoms_.rx.begin(), atoms_.rx.end(), asyncrx_.begin());
+        std::copy(atoms_.ry.begin(), atoms_.ry.end(), asyncry_.begin());
+        std::copy(atoms_.rz.begin(), atoms_.rz.end(), asyncrz_.begin());
+
+        auto const full = useFullPairlist();
+        auto const morton = atomordertype_ == AtomOrderType::MORTON && pmesh_;
+        asynciter_ = MD_iter_;
+        asyncmargin_ = pairlistMargin();
+        asyncmorton_ = morton;
+        asyncfull_ = full;
+
+        // ヘルパースレッドは作り直すたびに作らず、作成を頼むだけにする（スレッドも共有状態も確保し直さない）
+        BOOST_ASSERT(asyncthread_.joinable());
+        {
+            std::lock_guard<std::mutex> lock(asyncmutex_);
+            asyncready_ = false;
+            asyncrequested_ = true;
+        }
+
+        asynccond_.notify_one();
+        asyncrunning_ = true;
+    }
+
+    void Ar_moleculardynamics::tuneMargin()
+    {
+        if (cyclesteps_ > 0) {
+            // 1周期（ペアリストの作り直し1回と、次に作り直すまでのステップ）の、1ステップあたりの時間
+            // マージンを大きくすると作り直しは減るが、ペアが増えて1ステップが遅くなる
+            auto const cost = cycletime_ / static_cast<double>(cyclesteps_);
+
+            // 前の周期より遅くなったら、向きを変えて幅を半分にする
+            if (lastcyclecost_ > 0.0 && cost > lastcyclecost_) {
+                marginstep_ *= -0.5;
+                if (std::fabs(marginstep_) < Ar_moleculardynamics::MARGINSTEPMIN) {
+                    marginstep_ = marginstep_ < 0.0 ? -Ar_moleculardynamics::MARGINSTEPMIN : Ar_moleculardynamics::MARGINSTEPMIN;
+                }
+            }
+
+            lastcyclecost_ = cost;
+            margin_ = std::min(std::max(margin_ + marginstep_, Ar_moleculardynamics::MARGINMIN), Ar_moleculardynamics::MARGINMAX);
+
+            makeMesh();
+            selectParallelMethod();
+        }
+
+        cycletime_ = 0.0;
+        cyclesteps_ = 0;
+    }
+
+    bool Ar_moleculardynamics::useAsyncRebuild() const
+    {
+        // COLORINGは力の計算でメッシュリストを読み、DETERMINISTICは差し替えるステップで結果が変わるので、
+        // クラスタペアリストと同じく、ペアリストはその場で作り直す
+        return asyncrebuild_ && !useClusterPairlist() &&
+               parallelmethodinuse_ != ParallelMethod::COLORING && parallelmethodinuse_ != ParallelMethod::DETERMINISTIC;
+    }
+
+    bool Ar_moleculardynamics::useClusterPairlist() const
+    {
+        // メッシュを使わないときは、クラスタにまとめられない
+        // クラスタペアリスト用のカーネル関数は、Lennard-Jonesポテンシャルの式にしか対応していない（数表にも対応していない）
+        // クラスタペアリストはスレッドごとのバッファで並列化するので、結果がスレッド数によって変わる
+        return pairlisttype_ == PairListType::CLUSTER && pmesh_ && !ptable_ && !potentialkernel_ &&
+               parallelmethod_ != ParallelMethod::DETERMINISTIC;
+    }
+
+    bool Ar_moleculardynamics::useCompressedPairlist() const
+    {
+        // クラスタペアリストは、クラスタの番号で相手を表すので圧縮しない
+        return compresspairlist_ && !useClusterPairlist();
+    }
+
+    bool Ar_moleculardynamics::useDynamicPruning() const
+    {
+        // クラスタペアリストは、メッシュの番地からクラスタの組を作り直すので刈り込まない
+        return dynamicpruning_ && !useClusterPairlist();
+    }
+
+    bool Ar_moleculardynamics::useFullPairlist() const
+    {
+        return parallelmethodinuse_ == ParallelMethod::FULLLIST || parallelmethodinuse_ == ParallelMethod::DETERMINISTIC;
+    }
+
+    bool Ar_moleculardynamics::useMixedPrecision() const
+    {
+        // 混合精度のカーネル関数は、クラスタペアリストにしかない
+        return precisiontype_ == PrecisionType::MIXED && useClusterPairlist();
+    }
+
+    void Ar_moleculardynamics::waitAsyncRebuild()
+    {
+        std::unique_lock<std::mutex> lock(asyncmutex_);
+        asynccond_.wait(lock, [this]() { return asyncready_; });
+        asyncrunning_ = false;
+
+        if (asyncexception_) {
+            auto const e = asyncexception_;
+            asyncexception_ = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
     void Ar_moleculardynamics::Woodcock_velocity_scaling()
     {
         auto const s = std::sqrt((Tg_ + Ar_moleculardynamics::ALPHA * (Tc_ - Tg_)) / Tc_);
 
-        for (auto && atom : atoms_) {
-            atom.p *= s;
+        for (auto n = 0; n < NumAtom_; n++) {
+            atoms_.px[n] *= s;
+            atoms_.py[n] *= s;
+            atoms_.pz[n] *= s;
         }
     }
 
@@ -11,10 +11,23 @@
 #pragma once
 
 #include "../utility/property.h"
+#include "ljkernel.h"
 #include "meshlist.h"
+#include "myrandom/myrand.h"
+#include "pairtable.h"
+#include "potential.h"
+#include "potentialkernel.h"
 #include "systemparam.h"
+#include <condition_variable>       // for std::condition_variable
 #include <cstdint>                  // for std::int32_t
+#include <exception>                // for std::exception_ptr
 #include <memory>                   // for std::unique_ptr
+#include <mutex>                    // for std::mutex
+#include <random>                   // for std::normal_distribution
+#include <thread>                   // for std::thread
+#include <type_traits>              // for std::is_same
+#include <boost/assert.hpp>         // for BOOST_ASSERT
+#include <vector>                   // for std::vector
 
 namespace moleculardynamics {
     using namespace utility;
@@ -46,6 +59,82 @@ namespace moleculardynamics {
         VELOCITY = 2
     };;
 
+    //! A enum.
+    /*!
+        力の計算を並列化する方法の列挙型
+    */
+    enum class ParallelMethod : std::int32_t {
+        // 原子数とスレッド数から自動で選ぶ
+        AUTO = 0,
+
+        // 半分のペアリストを使い、スレッドごとの力のバッファを最後に足し合わせる
+        REDUCTION = 1,
+
+        // 両方向のペアを含むペアリストを使い、作用・反作用の法則を使わない
+        FULLLIST = 2,
+
+        // メッシュの番地を塗り分け、同じ色の番地を並列に計算する（メッシュを使わない小さな系ではREDUCTIONになる）
+        COLORING = 3,
+
+        // FULLLISTと同じく両方向のペアリストを使い、ポテンシャルエネルギーとビリアルを、
+        // スレッド数によらない原子のブロックごとに求めて順に足し合わせる（結果がスレッド数によらずビット単位で一致する）
+        // クラスタペアリストは使わない
+        DETERMINISTIC = 4
+    };
+
+    //! A enum.
+    /*!
+        ペアリストの種類の列挙型
+    */
+    enum class PairListType : std::int32_t {
+        // 原子ごとのペアリスト
+        ATOM = 0,
+
+        // 原子を4個ずつのクラスタにまとめた、クラスタペアリスト（メッシュを使わない小さな系ではATOMになる）
+        CLUSTER = 1
+    };
+
+    //! A enum.
+    /*!
+        力の計算の精度の列挙型
+    */
+    enum class PrecisionType : std::int32_t {
+        // 倍精度
+        DOUBLE = 0,
+
+        // 座標の差とLennard-Jonesポテンシャルの項を単精度で、力とエネルギーの和を倍精度で計算する
+        // （座標は番地の原点からの相対座標にして、単精度の桁を使い切る。クラスタペアリストを使わないときはDOUBLEになる）
+        MIXED = 1
+    };
+
+    //! A enum.
+    /*!
+        原子の並び順の列挙型
+    */
+    enum class AtomOrderType : std::int32_t {
+        // 初期配置（面心立方格子）の順のまま並べる
+        INITIAL = 0,
+
+        // ペアリストを作り直すたびに、原子がいるメッシュの番地の空間充填曲線（Morton順）の順に並べ替える
+        // （出力は元の原子の番号の順のまま。メッシュを使わない小さな系ではINITIALと同じになる）
+        MORTON = 1
+    };
+
+    //! A enum.
+    /*!
+        ペアリストを作り直した理由の列挙型
+    */
+    enum class RebuildReason : std::int32_t {
+        // recalc()で系を作り直した
+        INITIAL = 0,
+
+        // 最後にペアリストを作ってからの原子の変位が、マージンを超えるおそれがある
+        DISPLACEMENT = 1,
+
+        // ペアリストの種類や数表など、設定が変わった
+        SETTING = 2
+    };
+
     //! A class.
     /*!
         アルゴンに対して、分子動力学シミュレーションを行うクラス
@@ -62,14 +151,20 @@ namespace moleculardynamics {
 
         //! A destructor.
         /*!
-            デフォルトデストラクタ
+            デストラクタ（ヘルパースレッドを止める）
         */
-        ~Ar_moleculardynamics() = default;
+        ~Ar_moleculardynamics();
 
         // #endregion コンストラクタ・デストラクタ
 
         // #region publicメンバ関数
 
+        //! A public member function (constant).
+        /*!
+            原子の並び順を求める
+        */
+        AtomOrderType getAtomOrderType() const;
+
         //! A public member function (constant).
         /*!
             シミュレーションを開始してからの経過時間を求める
@@ -78,7 +173,15 @@ namespace moleculardynamics {
 
         //! A public member function (constant).
         /*!
-            n番目の原子に働く力を求める
+            NVEアンサンブルでの全エネルギーの相対的なドリフトを求める
+            recalc()かsetPrecisionType()の後で最初に全エネルギーを計算したステップを基準にして、
+            最後に全エネルギーを計算したステップまでの(Utot - Utot0) / |Utot0|を返す
+        */
+        double getEnergyDrift() const;
+
+        //! A public member function (constant).
+        /*!
+            n番目の原子（元の原子の番号）に働く力を求める
         */
         float getForce(std::int32_t n) const;
 
@@ -88,6 +191,20 @@ namespace moleculardynamics {
         */
         double getLatticeconst() const;
 
+        //! A public member function (constant).
+        /*!
+            ペアリストのマージンを求める（nm）
+            マージンの自動調整を使っているときは、調整した現在の値を返す
+            総当たりでペアリストを作る小さな箱では、周期の長さに合わせて削った値を返す
+        */
+        double getMargin() const;
+
+        //! A public member function (constant).
+        /*!
+            メッシュの番地の一辺を、カットオフ半径とマージンの和の何分の1にしているかを求める
+        */
+        std::int32_t getMeshDivision() const;
+
         //! A public member function (constant).
         /*!
             周期境界条件の長さを求める
@@ -96,10 +213,82 @@ namespace moleculardynamics {
 
         //! A public member function (constant).
         /*!
-            計算された圧力を求める
+            力の計算に実際に使っている並列化の方法を求める
+        */
+        ParallelMethod getParallelMethod() const;
+
+        //! A public member function (constant).
+        /*!
+            実際に使っているペアリストの種類を求める
+        */
+        PairListType getPairListType() const;
+
+        //! A public member function (constant).
+        /*!
+            実際に使っている力の計算の精度を求める
+        */
+        PrecisionType getPrecisionType() const;
+
+        //! A public member function (constant).
+        /*!
+            計算された圧力を求める（getSampleIteration()のステップで、ビリアルと一緒に記録した温度から求める）
         */
         double getPressure() const;
 
+        //! A public member function (constant).
+        /*!
+            recalc()の後で、内側のペアリストを外側のペアリストから刈り込んだ回数を求める（ペアリストを作り直したときを含む）
+            動的な刈り込みを使っていないときは数えない
+        */
+        std::int32_t getPruneCount() const;
+
+        //! A public member function (constant).
+        /*!
+            recalc()の後でペアリストを作り直した回数を求める（recalc()での最初の作成を含む）
+        */
+        std::int32_t getRebuildCount() const;
+
+        //! A public member function (constant).
+        /*!
+            原子の変位で作り直したときの、ペアリストを作り直す間隔のステップ数の平均を求める
+            まだ原子の変位で作り直していないときは0を返す
+        */
+        double getRebuildInterval() const;
+
+        //! A public member function (constant).
+        /*!
+            最後にペアリストを作り直した理由を求める
+        */
+        RebuildReason getRebuildReason() const;
+
+        //! A public member function (constant).
+        /*!
+            Up、Utot、getPressure()の値を計算したステップの番号を求める
+            これらの値は、ポテンシャルエネルギーとビリアルを計算した最後のステップで、運動エネルギーと温度と一緒にまとめて記録したもの
+            （recalc()の後でまだ計算していないときは-1を返す）
+        */
+        std::int32_t getSampleIteration() const;
+
+        //! A public member function (constant).
+        /*!
+            力の計算に使っているSIMD命令セットを求める
+        */
+        SimdType getSimdType() const;
+
+        //! A public member function (constant).
+        /*!
+            2体ポテンシャルの数表の、解析的な式と比べたポテンシャルエネルギーの誤差の最大値を求める（Hartree）
+            数表を使っていないときは0を返す
+        */
+        double getTableEnergyError() const;
+
+        //! A public member function (constant).
+        /*!
+            2体ポテンシャルの数表の、解析的な式と比べた力（力の大きさをrで割った量）の誤差の最大値を求める（換算単位）
+            数表を使っていないときは0を返す
+        */
+        double getTableForceError() const;
+
         //! A public member function (constant).
         /*!
             計算された温度の絶対温度を求める
@@ -124,6 +313,47 @@ namespace moleculardynamics {
         */
         void runCalc();
 
+        //! A public member function.
+        /*!
+            ペアリストをヘルパースレッドで作るかどうかを設定する
+            使うときは、変位がマージンのASYNCREBUILDSTART倍を超えたら、その座標を写してヘルパースレッドで次のペアリストを作り始め、
+            その間は今のペアリストで計算を続けて、できたステップで差し替える（今のペアリストが使えなくなったら、できるまで待つ）
+            差し替えるステップはスレッドの速さで変わるので、結果はビット単位では再現しない
+            （クラスタペアリスト、COLORING、DETERMINISTICでは、その場で作り直す）
+            \param asyncrebuild ペアリストをヘルパースレッドで作るならtrue
+        */
+        void setAsyncRebuild(bool asyncrebuild);
+
+        //! A public member function.
+        /*!
+            原子の並び順を設定する
+            \param atomordertype 原子の並び順
+        */
+        void setAtomOrderType(AtomOrderType atomordertype);
+
+        //! A public member function.
+        /*!
+            力の計算に、相手の原子のインデックスを16ビットの差で表した圧縮したペアリストを使うかどうかを設定する
+            使うときは、ペアリストを作り直したり刈り込んだりするたびに、力の計算に使うペアリストから圧縮したペアリストを作り、
+            カーネル関数はそれを読みながら相手の原子のインデックスを戻す（ペアあたり5バイトが3バイトになる）
+            ペアの順番は変えないが、SIMDのカーネル関数では区間に分けた行でレーンへの割り当てが変わるので、使わないときと結果はビット単位では一致しない
+            （クラスタペアリストには使わない）
+            \param compresspairlist 圧縮したペアリストを使うならtrue
+        */
+        void setCompressedPairlist(bool compresspairlist);
+
+        //! A public member function.
+        /*!
+            ペアリストの動的な刈り込みを使うかどうかを設定する
+            使うときは、マージンまでの組を集めた外側のペアリストから、カットオフ半径とPRUNEMARGINの和の中にいる組だけを
+            内側のペアリストに刈り込み、力の計算は内側のペアリストだけを読む
+            内側のペアリストは、刈り込んでからの変位がPRUNEMARGINを超えるおそれがあるときに外側のペアリストから刈り込み直し、
+            外側のペアリストは、作ってからの変位がマージンとPRUNEMARGINの差を超えるおそれがあるときに作り直す
+            （クラスタペアリストには使わない）
+            \param dynamicpruning 動的な刈り込みを使うならtrue
+        */
+        void setDynamicPruning(bool dynamicpruning);
+
         //! A public member function.
         /*!
             アンサンブルを設定する
@@ -131,6 +361,25 @@ namespace moleculardynamics {
         */
         void setEnsemble(EnsembleType ensemble);
 
+        //! A public member function.
+        /*!
+            ペアリストのマージンを自動で調整するかどうかを設定する
+            自動調整を使うときは、ペアリストを作り直すたびに、作り直しの時間を含めた1ステップあたりの時間が短くなるようにマージンを動かす
+            （メッシュの番地の大きさもマージンに合わせて変える。使わないときはSystemParam::MARGINに戻す）
+            \param marginautotune マージンを自動で調整するならtrue
+        */
+        void setMarginAutotune(bool marginautotune);
+
+        //! A public member function.
+        /*!
+            メッシュの番地の一辺を、カットオフ半径とマージンの和の何分の1にするかを設定する
+            番地を細かくすると、ペアリストを作るときに距離を調べる原子の組のうち、カットオフ球の外にある組の割合が減る
+            （一辺のメッシュの数が8の系で、約92%が2では約79%、3では約69%に減るが、たどる番地の数は13から62、155に増える。
+            番地あたりの原子が少なくなるので、クラスタペアリストは細かくすると遅くなる）
+            \param division 番地の一辺の分割数（1～3）
+        */
+        void setMeshDivision(std::int32_t division);
+
         //! A public member function.
         /*!
             スーパーセルの大きさを設定する
@@ -138,6 +387,46 @@ namespace moleculardynamics {
         */
         void setNc(std::int32_t Nc);
 
+        //! A public member function.
+        /*!
+            ペアリストの種類を設定する
+            \param pairlisttype ペアリストの種類
+        */
+        void setPairListType(PairListType pairlisttype);
+
+        //! A public member function.
+        /*!
+            力の計算を並列化する方法を設定する
+            \param parallelmethod 力の計算を並列化する方法
+        */
+        void setParallelMethod(ParallelMethod parallelmethod);
+
+        template <typename Potential>
+        //! A public member function (template function).
+        /*!
+            2体ポテンシャルを設定する（最初はpotential::LennardJones）
+            Lennard-Jonesポテンシャル以外では、ポリシー構造体の式をインライン展開した汎用のカーネル関数で力を計算する
+            数表を使っているときは、新しいポテンシャルで数表を作り直して、命令セットごとの数表のカーネル関数で力を計算する
+            \tparam Potential 2体ポテンシャルのポリシー構造体（potential.hを参照）
+        */
+        void setPotential();
+
+        //! A public member function.
+        /*!
+            力の計算の精度を設定する
+            \param precisiontype 力の計算の精度
+        */
+        void setPrecisionType(PrecisionType precisiontype);
+
+        //! A public member function.
+        /*!
+            ポテンシャルエネルギーとビリアルを計算するステップの間隔を設定する
+            それ以外のステップでは力だけを計算するが、Up、Utot、getPressure()が読まれた直後のステップでは必ず計算する
+            これらの値は、計算したステップでまとめて記録したものなので、読んだときの値は最後に計算したステップ（getSampleIteration()）のものになる
+            \param samplinginterval ポテンシャルエネルギーとビリアルを計算するステップの間隔
+        */
+        void setSamplingInterval(std::int32_t samplinginterval);
+
         //! A public member function.
         /*!
             格子定数のスケールを設定する
@@ -145,6 +434,23 @@ namespace moleculardynamics {
         */
         void setScale(double scale);
 
+        //! A public member function.
+        /*!
+            力の計算に使うSIMD命令セットを設定する
+            CPUが対応していない命令セットが指定されたときは、対応している最も新しい命令セットを使う
+            \param simdtype 力の計算に使うSIMD命令セット
+        */
+        void setSimdType(SimdType simdtype);
+
+        //! A public member function.
+        /*!
+            2体ポテンシャルの数表の区間の数を設定する
+            0でないときは、原子のペアリストの力の計算で、Lennard-Jonesポテンシャルの式の代わりに数表を使う
+            （クラスタペアリストは数表に対応していないので、数表を使うときは原子のペアリストを使う）
+            \param resolution 数表の区間の数（0のときは数表を使わない）
+        */
+        void setTableResolution(std::int32_t resolution);
+
         //! A public member function.
         /*!
             温度制御の方法を設定する
@@ -164,18 +470,95 @@ namespace moleculardynamics {
         // #region privateメンバ関数
 
     private:
+        //! A private member function.
+        /*!
+            ヘルパースレッドで、ペアリストの作成を頼まれるのを待って作ることを、止めるまで繰り返す
+        */
+        void asyncRebuildThread();
+
+        //! A private member function.
+        /*!
+            ヘルパースレッドで、作り始めたときに写した座標から次のペアリストを作る
+            \param full 両方向のペアリストも作るかどうか
+            \param morton 原子を番地の空間充填曲線の順に並べ替えるかどうか
+        */
+        void buildAsyncPairlist(bool full, bool morton);
+
         //! A private member function.
         /*!
             原子に働く力を計算する
         */
         void calcForcePair();
 
+        //! A private member function.
+        /*!
+            クラスタペアリストを使い、スレッドごとの力のバッファを足し合わせて、原子に働く力を並列に計算する
+        */
+        void calcForcePairCluster();
+
+        //! A private member function.
+        /*!
+            メッシュの番地を塗り分け、同じ色の番地を並列に計算して、原子に働く力を計算する
+        */
+        void calcForcePairColoring();
+
+        //! A private member function.
+        /*!
+            両方向のペアリストを使い、スレッド数によらない原子のブロックごとに、原子に働く力を並列に計算する
+            ポテンシャルエネルギーとビリアルはブロックの順に足し合わせるので、結果がスレッド数によらない
+        */
+        void calcForcePairDeterministic();
+
+        //! A private member function.
+        /*!
+            両方向のペアリストを使い、作用・反作用の法則を使わずに、原子に働く力を並列に計算する
+        */
+        void calcForcePairFullList();
+
+        //! A private member function.
+        /*!
+            半分のペアリストを使い、スレッドごとの力のバッファを足し合わせて、原子に働く力を並列に計算する
+        */
+        void calcForcePairReduction();
+
+        //! A private member function (constant).
+        /*!
+            座標を記録してからの変位が最も大きい2つの原子の、変位の和を求める
+            \param rx0 記録した座標のx成分
+            \param ry0 記録した座標のy成分
+            \param rz0 記録した座標のz成分
+            \return 変位が最も大きい2つの原子の変位の和
+        */
+        double calcDisplacementBound(AtomSoA::mydoublevector const & rx0, AtomSoA::mydoublevector const & ry0, AtomSoA::mydoublevector const & rz0) const;
+
         //! A private member function.
         /*!
             ペアリストの寿命をチェックする
+            最後にペアリストを作ってからの変位が最も大きい2つの原子の変位の和が、マージンを超えたら作り直す
+            動的な刈り込みを使うときは、マージンとPRUNEMARGINの差を超えたら作り直し、
+            そうでなくても、最後に刈り込んでからの変位の和がPRUNEMARGINを超えたら刈り込み直す
         */
         void checkPairlist();
 
+        //! A private member function.
+        /*!
+            ヘルパースレッドで作成中のペアリストがあれば、できるまで待って捨てる
+        */
+        void cancelAsyncRebuild();
+
+        //! A private member function.
+        /*!
+            力の計算に使うペアリストから、圧縮したペアリストを作る（圧縮したペアリストを使わないときは何もしない）
+        */
+        void compressPairlist();
+
+        //! A private member function.
+        /*!
+            ペアリストを作り直した回数と間隔を数える
+            \param reason ペアリストを作り直した理由
+        */
+        void countRebuild(RebuildReason reason);
+
         //! A private member function.
         /*!
             エネルギーの単位を無次元単位からHartreeに変換する
@@ -186,282 +569,860 @@ namespace moleculardynamics {
 
         //! A private member function.
         /*!
-            Langevin法
+            ヘルパースレッドで作ったペアリストを待って差し替え、原子を作り始めたときと同じように周期の内側に戻して並べ替える
+        */
+        void finishAsyncRebuild();
+
+        //! A private member function (constant).
+        /*!
+            原子の情報を、互換用のAtomの可変長配列に書き出して返す
+            \return Atomの可変長配列
+        */
+        SystemParam::myatomvector const & getAtomsView() const;
+
+        //! A private member function.
+        /*!
+            ヘルパースレッドで作成中のペアリストができたかどうかを、待たずに調べる
+            \return ペアリストができていればtrue
+        */
+        bool isAsyncRebuildReady();
+
+        //! A private member function.
+        /*!
+            Langevin法
+        */
+        void Langevin();
+
+        //! A private member function.
+        /*!
+            総当たりでペアリストを構築する
+            \param atoms 原子の座標が格納された構造体
+            \param margin ペアリストのマージン（ヘルパースレッドでは、作り始めたときのマージンを渡す）
+            \param pairs 構築したペアリスト
+        */
+        void makePair(AtomSoA const & atoms, double margin, PairList & pairs) const;
+
+        //! A private member function.
+        /*!
+            半分のペアリストから、両方向のペアを含むペアリストを構築する
+            \param pairs 半分のペアリスト
+            \param fullpairs 構築した両方向のペアリスト
+        */
+        void makeFullPairlist(PairList const & pairs, PairList & fullpairs) const;
+
+        //! A private member function.
+        /*!
+            カーネル関数に渡す引数を作る
+            \param pairs ペアリスト
+            \param newton 作用・反作用の法則を使って、相手の原子jにも力を書き込むかどうか
+            \return カーネル関数に渡す引数（計算する原子iの範囲は、すべての原子）
+        */
+        ljkernel::ForceKernelArgs makeKernelArgs(PairList const & pairs, bool newton);
+
+        //! A private member function (constant).
+        /*!
+            ペアリストを作るときに使うマージンを求める
+            ペアの周期的な像はペアリストを作るときに決めるので、カットオフ半径とマージンの和の2倍が周期の長さを超えないように、
+            総当たりでペアリストを作る小さな箱では、マージンを周期の長さの半分とカットオフ半径の差までに削る
+            \return ペアリストを作るときに使うマージン（周期の長さがカットオフ半径の2倍以下なら0）
+        */
+        double pairlistMargin() const;
+
+        //! A private member function.
+        /*!
+            外側のペアリストから、カットオフ半径とPRUNEMARGINの和の中にいる組だけを集めて、力の計算に使うペアリストを作る
+        */
+        void prunePairlist();
+
+        //! A private member function.
+        /*!
+            ペアリストを構築し直す
+            \param reason ペアリストを作り直す理由
+        */
+        void rebuildPairlist(RebuildReason reason);
+
+        //! A private member function.
+        /*!
+            原子の配列を並べ替える（新しいk番目の原子は、元のorder[k]番目の原子になる）
+            元の原子の番号との対応も一緒に並べ替える
+            \param order 並べ替えの順番
+        */
+        void reorderAtoms(std::vector<std::int32_t> const & order);
+
+        //! A private member function.
+        /*!
+            マージンの自動調整で通りうる番地の大きさを一通りたどり、メッシュリストとペアリストの配列の容量を先に確保しておく
+        */
+        void reserveMesh();
+
+        //! A private member function (constant).
+        /*!
+            ペアリストを、スレッドごとに受け持つ行の範囲に、ペアの数がなるべく均等になるように分ける
+            \param offsets ペアリストの、行の始まりを表すインデックス（要素数は行の数 + 1）
+            \param thread スレッドの番号
+            \param nthreads スレッド数
+            \param ibegin 受け持つ行の範囲の始まり
+            \param iend 受け持つ行の範囲の終わり（この行は含まない）
+        */
+        void rowRange(std::vector<std::int32_t> const & offsets, std::int32_t thread, std::int32_t nthreads, std::int32_t & ibegin, std::int32_t & iend) const;
+
+        //! A private member function.
+        /*!
+            命令セット、2体ポテンシャル、数表の有無から、力を計算するカーネル関数を選ぶ
+        */
+        void selectKernel();
+
+        //! A private member function.
+        /*!
+            力の計算を並列化する方法を、原子数とスレッド数から決める
+        */
+        void selectParallelMethod();
+
+        //! A private member function.
+        /*!
+            前にペアリストを作り直してからの1ステップあたりの時間を、前の周期と比べて、マージンを山登り法で動かす
+        */
+        void tuneMargin();
+
+        //! A private member function.
+        /*!
+            今の座標を写して、ヘルパースレッドで次のペアリストを作り始める
+        */
+        void startAsyncRebuild();
+
+        //! A private member function (constant).
+        /*!
+            ペアリストをヘルパースレッドで作るかどうかを求める
+            \return ペアリストをヘルパースレッドで作るならtrue
+        */
+        bool useAsyncRebuild() const;
+
+        //! A private member function (constant).
+        /*!
+            クラスタペアリストを使うかどうかを求める
+            \return クラスタペアリストを使うならtrue
+        */
+        bool useClusterPairlist() const;
+
+        //! A private member function (constant).
+        /*!
+            圧縮したペアリストを使うかどうかを求める
+            \return 圧縮したペアリストを使うならtrue
+        */
+        bool useCompressedPairlist() const;
+
+        //! A private member function (constant).
+        /*!
+            ペアリストの動的な刈り込みを使うかどうかを求める
+            \return 動的な刈り込みを使うならtrue
+        */
+        bool useDynamicPruning() const;
+
+        //! A private member function (constant).
+        /*!
+            両方向のペアリストを使うかどうかを求める
+            \return 両方向のペアリストを使うならtrue
+        */
+        bool useFullPairlist() const;
+
+        //! A private member function (constant).
+        /*!
+            混合精度で力を計算するかどうかを求める
+            \return 混合精度で力を計算するならtrue
+        */
+        bool useMixedPrecision() const;
+
+        //! A private member function.
+        /*!
+            ヘルパースレッドで作成中のペアリストができるまで待つ（作成中に投げられた例外は、ここで投げ直す）
+        */
+        void waitAsyncRebuild();
+
+        //! A private member function.
+        /*!
+            周期の長さとマージンから一辺のメッシュの数を求め、メッシュリストを作る（メッシュの数が変わらないときは、マージンだけを変える）
+            小さな箱では、一辺の番地の数がステンシルの幅より多くなるまで番地を細かくする
+        */
+        void makeMesh();
+
+        //! A private member function.
+        /*!
+            原子の初期位置を決める
+        */
+        void MD_initPos();
+
+        //! A private member function.
+        /*!
+            原子の初期速度を決める
+        */
+        void MD_initVel();
+
+        //! A private member function.
+        /*!
+            格子定数が変更されたときに呼ばれる
+        */
+        void ModLattice();
+
+        //! A privte member function.
+        /*!
+            原子を移動させる
+        */
+        void moveAtoms();
+
+        //! A privte member function.
+        /*!
+            Nose-Hoover法
+        */
+        void NoseHoover();
+
+        //! A private member function.
+        /*!
+            周期境界条件を用いて、原子の位置を補正する
+            ペアリストには相手の原子の周期的な像の番号が記録されているので、ペアリストを作り直すときにだけ呼ぶ
+        */
+        void periodic();
+
+        //! A private member function (constant).
+        /*!
+            周期境界条件を用いて座標をセル内に戻すときに、座標に足す量を求める（periodic()と同じ戻し方）
+            \param r 座標の成分
+            \return 座標に足す量（-周期の長さ、0、周期の長さのいずれか）
+        */
+        double periodicShift(double r) const;
+        
+        //! A private member function.
+        /*!
+            Woodcockの速度スケーリング法
+        */
+        void Woodcock_velocity_scaling();
+
+        // #endregion privateメンバ関数
+
+        // #region プロパティ
+
+    public:
+        //! A property.
+        /*!
+            原子へのプロパティ（読み取り専用の互換ビュー）
+        */
+        Property<SystemParam::myatomvector const &> const Atoms;
+
+        //! A property.
+        /*!
+            MDのステップ数へのプロパティ
+        */
+        Property<std::int32_t> const MD_iter;
+
+        //! A property.
+        /*!
+            スーパーセルの個数へのプロパティ
+        */
+        Property<std::int32_t> const Nc;
+
+        //! A property.
+        /*!
+            原子数へのプロパティ
+        */
+        Property<std::int32_t> const NumAtom;
+
+        //! A property.
+        /*!
+            格子定数へのプロパティ
+        */
+        Property<double> const periodiclen;
+
+        //! A property.
+        /*!
+            運動エネルギーへのプロパティ
+        */
+        Property<double> const Uk;
+
+        //! A property.
+        /*!
+            ポテンシャルエネルギーへのプロパティ
+        */
+        Property<double> const Up;
+
+        //! A property.
+        /*!
+            全エネルギーへのプロパティ
+        */
+        Property<double> const Utot;
+
+        // #endregion プロパティ
+
+        // #region publicメンバ変数
+
+    public:
+        //! A public member variable (static constant).
+        /*!
+            初期のスーパーセルの個数
+        */
+        static auto const FIRSTNC = 11;
+
+        //! A public member variable (static consttant).
+        /*!
+            初期の格子定数のスケール
+        */
+        static double const FIRSTSCALE;
+
+        //! A public member variable (static constant).
+        /*!
+            初期温度（絶対温度）
+        */
+        static double const FIRSTTEMP;
+
+        //! A public member variable (static constant).
+        /*!
+            アルゴン原子に対するσ
+        */
+        static double const SIGMA;
+
+        //! A public member variable (static constant).
+        /*!
+            アルゴン原子のVan der Waals半径
+        */
+        static double const VDW_RADIUS;
+
+        // #endregion publicメンバ変数
+
+        // #region privateメンバ変数
+
+    private:
+        //! A private member variable (static constant).
+        /*!
+            Woodcockの温度スケーリングの係数
+        */
+        static double const ALPHA;
+
+        //! A private member variable (static constant).
+        /*!
+            ヘルパースレッドで次のペアリストを作り始めるときに見込む、前に作るのにかかったステップ数に対する倍率
+        */
+        static double const ASYNCREBUILDLEAD;
+
+        //! A private member variable (static constant).
+        /*!
+            まだヘルパースレッドでペアリストを作ったことがないときに、次のペアリストを作り始める、変位の和のマージンに対する割合
+        */
+        static double const ASYNCREBUILDSTART;
+
+        //! A private member variable (static constant).
+        /*!
+            スレッドごとの力のバッファの合計の大きさの上限（バイト）
+            これを超えるときは、バッファの初期化と足し合わせのメモリ帯域が支配的になるので、両方向のペアリストを使う
+        */
+        static std::size_t const MAXFORCEBUFFERSIZE = 8 * 1024 * 1024;
+
+        //! A private member variable (static constant).
+        /*!
+            ParallelMethod::DETERMINISTICで、ポテンシャルエネルギーとビリアルを求める原子のブロックの大きさ
+        */
+        static std::int32_t const DETERMINISTICBLOCKSIZE = 256;
+
+        //! A private member variable (static constant).
+        /*!
+            一辺に3番地とれない小さな箱で、メッシュの番地を細かくするときの分割数の最大値（これでもとれないときは総当たりでペアリストを作る）
+        */
+        static std::int32_t const SMALLBOXMAXDIVISION = 4;
+
+        //! A private member variable (static constant).
+        /*!
+            標準気圧
+        */
+        static double const ATM;
+
+        //! A private member variable (static constant).
+        /*!
+            アボガドロ定数
+        */
+        static double const AVOGADRO_CONSTANT;
+
+        //! A private member variable (static constant).
+        /*!
+            時間刻みΔt
+        */
+        static double const DT;
+
+        //! A private member variable (static constant).
+        /*!
+            Langevin法の定数
+        */
+        static double const GAMMA;
+
+        //! A private member variable (static constant).
+        /*!
+            1Hartree
+        */
+        static double const HARTREE;
+
+        //! A private member variable (static constant).
+        /*!
+            ボルツマン定数
+        */
+        static double const KB;
+
+        //! A private member variable (static constant).
+        /*!
+            マージンの自動調整で使う、マージンの最大値
+        */
+        static double const MARGINMAX;
+
+        //! A private member variable (static constant).
+        /*!
+            マージンの自動調整で使う、マージンの最小値
+        */
+        static double const MARGINMIN;
+
+        //! A private member variable (static constant).
+        /*!
+            マージンの自動調整で、最初にマージンを動かす幅
+        */
+        static double const MARGINSTEP;
+
+        //! A private member variable (static constant).
+        /*!
+            マージンの自動調整で、マージンを動かす幅の最小値（温度が変わったときに追従できるように、これより小さくしない）
+        */
+        static double const MARGINSTEPMIN;
+
+        //! A private member variable (static constant).
+        /*!
+            ペアリストの動的な刈り込みで、内側のペアリストに集める組の、カットオフ半径の外側の幅（MARGINMINより小さくする）
+        */
+        static double const PRUNEMARGIN;
+
+        //! A private member variable (static constant).
+        /*!
+            2体ポテンシャルの数表の最小のr^2（これより近い原子の組は、最初の区間の値を外挿する）
+        */
+        static double const TABLER2MIN;
+
+        //! A private member variable (static constant).
+        /*!
+            アルゴン原子に対するτ
+        */
+        static double const TAU;
+
+        //! A private member variable (static constant).
+        /*!
+            Nose-Hoover法の自由パラメータ
+        */
+        static double const TAU_NOSE_HOOVER;
+
+        //! A private member variable (static constant).
+        /*!
+            アルゴン原子に対するε
+        */
+        static double const YPSILON;
+
+        //! A private member variable.
+        /*!
+            スーパーセルの個数
+        */
+        std::int32_t Nc_ = Ar_moleculardynamics::FIRSTNC;
+
+        //! A private member variable.
+        /*!
+            並べ替えた後の原子の位置ごとの、元の原子の番号
+        */
+        std::vector<std::int32_t> atomid_;
+
+        //! A private member variable.
+        /*!
+            原子の並び順
+        */
+        AtomOrderType atomordertype_ = AtomOrderType::INITIAL;
+
+        //! A private member variable.
+        /*!
+            原子の情報（Structure of Arrays）
+        */
+        AtomSoA atoms_;
+
+        //! A private member variable.
+        /*!
+            元の原子の番号ごとの、並べ替えた後の原子の位置（atomid_の逆引き）
+        */
+        std::vector<std::int32_t> atomslot_;
+
+        //! A private member variable.
+        /*!
+            最後にペアリストを作ったときの原子の座標のx, y, z成分
+        */
+        AtomSoA::mydoublevector listrx_, listry_, listrz_;
+
+        //! A private member variable.
+        /*!
+            今のペアリストを作ったときのマージン（マージンの自動調整で、次のペアリストを作り始めるときにマージンが変わるため）
+        */
+        double listmargin_ = SystemParam::MARGIN;
+
+        //! A private member variable.
+        /*!
+            今のペアリストを作った座標のステップ
+        */
+        std::int32_t listiter_ = 0;
+
+        //! A private member variable.
+        /*!
+            ペアリストをヘルパースレッドで作るかどうか
+        */
+        bool asyncrebuild_ = false;
+
+        //! A private member variable.
+        /*!
+            ヘルパースレッドでペアリストを作成中かどうか（メインスレッドだけが読み書きする）
+        */
+        bool asyncrunning_ = false;
+
+        //! A private member variable.
+        /*!
+            ヘルパースレッドで作るペアリストの、作り始めたときに写した原子の座標（周期の内側に戻す前、並べ替える前）のx, y, z成分
+        */
+        AtomSoA::mydoublevector asyncrx_, asyncry_, asyncrz_;
+
+        //! A private member variable.
+        /*!
+            ヘルパースレッドでペアリストを作るのに使う、周期の内側に戻して並べ替えた原子の座標
+        */
+        AtomSoA asyncatoms_;
+
+        //! A private member variable.
+        /*!
+            ヘルパースレッドで求めた原子の並べ替えの順番
+        */
+        std::vector<std::int32_t> asyncorder_;
+
+        //! A private member variable.
+        /*!
+            ヘルパースレッドで作ったペアリストと、両方向のペアリスト
+        */
+        PairList asyncpairs_, asyncfullpairs_;
+
+        //! A private member variable.
+        /*!
+            ヘルパースレッドで作るペアリストのマージン
+        */
+        double asyncmargin_;
+
+        //! A private member variable.
+        /*!
+            ヘルパースレッドで次のペアリストを作り始めたステップ
+        */
+        std::int32_t asynciter_ = 0;
+
+        //! A private member variable.
+        /*!
+            前にヘルパースレッドでペアリストを作り始めてから、差し替えるまでのステップ数（まだ作ったことがないときは0）
+        */
+        std::int32_t asynclatency_ = 0;
+
+        //! A private member variable.
+        /*!
+            ヘルパースレッドで作るペアリストに合わせて、原子を並べ替えるかどうか
+        */
+        bool asyncmorton_ = false;
+
+        //! A private member variable.
+        /*!
+            ヘルパースレッドで、両方向のペアリストも作るかどうか
+        */
+        bool asyncfull_ = false;
+
+        //! A private member variable.
+        /*!
+            最後に内側のペアリストを刈り込んだときの原子の座標のx, y, z成分
+        */
+        AtomSoA::mydoublevector prunerx_, prunery_, prunerz_;
+
+        //! A private member variable.
+        /*!
+            クラスタペアリスト
+        */
+        ClusterPairList clusterpairs_;
+
+        //! A private member variable.
+        /*!
+            力の計算に使うペアリストを圧縮したペアリスト
         */
-        void Langevin();
+        CompactPairList compactpairs_;
 
-        //! A private member function.
+        //! A private member variable.
         /*!
-            ペアリストを構築する
+            クラスタペアリスト用の、力を計算するカーネル関数へのポインタ
         */
-        void makePair();
+        ljkernel::clusterkernelfunc clusterkernel_;
 
-        //! A private member function.
+        //! A private member variable.
         /*!
-            原子の初期位置を決める
+            クラスタペアリスト用の、力を混合精度で計算するカーネル関数へのポインタ
         */
-        void MD_initPos();
+        ljkernel::clusterkernelfunc mixedclusterkernel_;
 
-        //! A private member function.
+        //! A private member variable.
         /*!
-            原子の初期速度を決める
+            現在のステップで、力と一緒に計算する量
         */
-        void MD_initVel();
+        ljkernel::ComputeFlags computeflags_ = ljkernel::ComputeFlags::ENERGY_VIRIAL;
 
-        //! A private member function.
+        //! A private member variable.
         /*!
-            格子定数が変更されたときに呼ばれる
+            全エネルギーの相対的なドリフト
         */
-        void ModLattice();
+        double energydrift_ = 0.0;
 
-        //! A privte member function.
+        //! A private member variable (mutable).
         /*!
-            原子を移動させる
+            Atomsプロパティ用の、原子の可変長配列
         */
-        void moveAtoms();
+        mutable SystemParam::myatomvector atomsview_;
 
-        //! A privte member function.
+        //! A private member variable (mutable).
         /*!
-            Nose-Hoover法
+            atomsview_を更新する必要があるかどうか
         */
-        void NoseHoover();
+        mutable bool atomsviewdirty_ = true;
 
-        //! A private member function.
+        //! A private member variable (constant).
         /*!
-            周期境界条件を用いて、原子の位置を補正する
+            時間刻みの二乗
         */
-        void periodic();
-        
-        //! A private member function.
+        double const dt2;
+
+        //! A private member variable.
         /*!
-            Woodcockの速度スケーリング法
+            アンサンブル
         */
-        void Woodcock_velocity_scaling();
-
-        // #endregion privateメンバ関数
-
-        // #region プロパティ
+        EnsembleType ensemble_ = EnsembleType::NVT;
 
-    public:
-        //! A property.
+        //! A private member variable.
         /*!
-            原子へのプロパティ
+            マージンの自動調整で、前にペアリストを作り直してから数えたステップ数
         */
-        Property<SystemParam::myatomvector const &> const Atoms;
+        std::int32_t cyclesteps_ = 0;
 
-        //! A property.
+        //! A private member variable.
         /*!
-            MDのステップ数へのプロパティ
+            マージンの自動調整で、前にペアリストを作り直してから数えたステップの時間の和（秒）
         */
-        Property<std::int32_t> const MD_iter;
+        double cycletime_ = 0.0;
 
-        //! A property.
+        //! A private member variable.
         /*!
-            スーパーセルの個数へのプロパティ
+            マージンの自動調整で、前の周期の1ステップあたりの時間（秒、まだ測っていないときは0）
         */
-        Property<std::int32_t> const Nc;
+        double lastcyclecost_ = 0.0;
 
-        //! A property.
+        //! A private member variable.
         /*!
-            原子数へのプロパティ
+            Langevin法の揺動力に使う、標準正規分布の乱数（ステップごとにメモリを確保しないように使い回す）
         */
-        Property<std::int32_t> const NumAtom;
+        myrandom::MyRand<std::normal_distribution<double> > langevinrand_;
 
-        //! A property.
+        //! A private member variable.
         /*!
-            格子定数へのプロパティ
+            格子定数
         */
-        Property<double> const periodiclen;
+        double lat_;
 
-        //! A property.
+        //! A private member variable.
         /*!
-            運動エネルギーへのプロパティ
+            スレッドごとの力のバッファ（スレッド0は原子の力の配列に直接書き込むので、スレッド数 - 1個）
         */
-        Property<double> const Uk;
+        std::vector<ForceBuffer> forcebuffers_;
 
-        //! A property.
+        //! A private member variable.
         /*!
-            ポテンシャルエネルギーへのプロパティ
+            ParallelMethod::DETERMINISTICでの、原子のブロックごとのポテンシャルエネルギーとビリアル
         */
-        Property<double> const Up;
+        std::vector<double> blockup_, blockvirial_;
 
-        //! A property.
+        //! A private member variable.
         /*!
-            全エネルギーへのプロパティ
+            両方向のペアを含むペアリスト
         */
-        Property<double> const Utot;
-
-        // #endregion プロパティ
+        PairList fullpairs_;
 
-        // #region publicメンバ変数
-
-    public:
-        //! A public member variable (static constant).
+        //! A private member variable.
         /*!
-            初期のスーパーセルの個数
+            力を計算するカーネル関数へのポインタ
         */
-        static auto const FIRSTNC = 11;
-
-        //! A public member variable (static consttant).
+        ljkernel::ljkernelfunc ljkernel_;
+        
+        //! A private member variable.
         /*!
-            初期の格子定数のスケール
+            ペアリストのマージン
         */
-        static double const FIRSTSCALE;
+        double margin_ = SystemParam::MARGIN;
 
-        //! A public member variable (static constant).
+        //! A private member variable.
         /*!
-            初期温度（絶対温度）
+            ペアリストのマージンを自動で調整するかどうか
         */
-        static double const FIRSTTEMP;
+        bool marginautotune_ = false;
 
-        //! A public member variable (static constant).
+        //! A private member variable.
         /*!
-            アルゴン原子に対するσ
+            ペアリストの動的な刈り込みを使うかどうか
         */
-        static double const SIGMA;
+        bool dynamicpruning_ = false;
 
-        //! A public member variable (static constant).
+        //! A private member variable.
         /*!
-            アルゴン原子のVan der Waals半径
+            圧縮したペアリストを使うかどうか
         */
-        static double const VDW_RADIUS;
+        bool compresspairlist_ = false;
 
-        // #endregion publicメンバ変数
+        //! A private member variable.
+        /*!
+            メッシュの番地の一辺を、カットオフ半径とマージンの和の何分の1にするか
+        */
+        std::int32_t meshdivision_ = 1;
 
-        // #region privateメンバ変数
+        //! A private member variable.
+        /*!
+            マージンの自動調整で、次にマージンを動かす幅（符号は向き）
+        */
+        double marginstep_;
 
-    private:
-        //! A private member variable (static constant).
+        //! A private member variable.
         /*!
-            Woodcockの温度スケーリングの係数
+            最後にペアリストを作り直したステップ
         */
-        static double const ALPHA;
+        std::int32_t lastrebuilditer_;
 
-        //! A private member variable (static constant).
+        //! A private member variable.
         /*!
-            標準気圧
+            MDのステップ数
         */
-        static double const ATM;
+        std::int32_t MD_iter_;
 
-        //! A private member variable (static constant).
+        //! A private member variable (constant).
         /*!
-            アボガドロ定数
+            相互作用を計算するセルの個数
         */
-        static double const AVOGADRO_CONSTANT;
+        std::int32_t const ncp_ = 3;
 
-        //! A private member variable (static constant).
+        //! A private member variable.
         /*!
-            時間刻みΔt
+            メッシュのリストへのスマートポインタ
         */
-        static double const DT;
+        std::unique_ptr<MeshList> pmesh_;
 
-        //! A private member variable (static constant).
+        //! A private member variable.
         /*!
-            Langevin法の定数
+            総当たりでペアリストを作っている間、使わずに取っておくメッシュリスト（マージンを変えてメッシュに戻ったときに使い回す）
         */
-        static double const GAMMA;
+        std::unique_ptr<MeshList> sparemesh_;
+        
+        //! A private member variable.
+        /*!
+            原子数
+        */
+        std::int32_t NumAtom_;
 
-        //! A private member variable (static constant).
+        //! A private member variable.
         /*!
-            1Hartree
+            スレッド数
         */
-        static double const HARTREE;
+        std::int32_t numthreads_;
 
-        //! A private member variable (static constant).
+        //! A private member variable (mutable).
         /*!
-            ボルツマン定数
+            前のステップの後に、Up、Utot、getPressure()が読まれたかどうか
         */
-        static double const KB;
+        mutable bool observed_ = true;
 
-        //! A private member variable (static constant).
+        //! A private member variable.
         /*!
-            アルゴン原子に対するτ
+            ペアリスト
         */
-        static double const TAU;
+        PairList pairs_;
 
-        //! A private member variable (static constant).
+        //! A private member variable.
         /*!
-            Nose-Hoover法の自由パラメータ
+            動的な刈り込みで使う、マージンまでの組を集めた外側のペアリスト（力の計算に使うペアリストと同じ向き）
         */
-        static double const TAU_NOSE_HOOVER;
+        PairList outerpairs_;
 
-        //! A private member variable (static constant).
+        //! A private member variable.
         /*!
-            アルゴン原子に対するε
+            内側のペアリストを刈り込むときの、スレッドごとの作業用のペアリスト
         */
-        static double const YPSILON;
+        std::vector<PairList> prunebuffers_;
 
         //! A private member variable.
         /*!
-            スーパーセルの個数
+            外側のペアリストの1行を刈り込む関数へのポインタ
         */
-        std::int32_t Nc_ = Ar_moleculardynamics::FIRSTNC;
+        ljkernel::pairprunefunc pairprune_;
 
         //! A private member variable.
         /*!
-            原子の可変長配列
+            recalc()の後で、内側のペアリストを刈り込んだ回数
         */
-        SystemParam::myatomvector atoms_;
+        std::int32_t prunecount_ = 0;
 
-        //! A private member variable (constant).
+        //! A private member variable.
         /*!
-            時間刻みの二乗
+            ペアリストの種類
         */
-        double const dt2;
+        PairListType pairlisttype_ = PairListType::ATOM;
 
         //! A private member variable.
         /*!
-            アンサンブル
+            設定された、力の計算を並列化する方法
         */
-        EnsembleType ensemble_ = EnsembleType::NVT;
+        ParallelMethod parallelmethod_ = ParallelMethod::AUTO;
 
         //! A private member variable.
         /*!
-            格子定数
+            実際に使っている、力の計算を並列化する方法
         */
-        double lat_;
-        
+        ParallelMethod parallelmethodinuse_ = ParallelMethod::REDUCTION;
+
         //! A private member variable.
         /*!
-            一辺のメッシュの数
+            2体ポテンシャルのエネルギー（カットオフでの打ち切りは含まない）を求める関数（数表を作るときに使う）
         */
-        std::int32_t m_;
+        PairTable::potentialfunc potentialenergy_ = potential::LennardJones::energy;
 
         //! A private member variable.
         /*!
-            ペアリストの寿命の長さ
+            2体ポテンシャルのポリシー構造体で特殊化したカーネル関数へのポインタ（Lennard-Jonesポテンシャルのときはnullptr）
         */
-        double margin_length_;
+        ljkernel::ljkernelfunc potentialkernel_ = nullptr;
 
         //! A private member variable.
         /*!
-            MDのステップ数
+            2体ポテンシャルの微分をrで割った量を求める関数（数表を作るときに使う）
         */
-        std::int32_t MD_iter_;
+        PairTable::potentialfunc potentialforce_ = potential::LennardJones::force_over_r;
 
-        //! A private member variable (constant).
+        //! A private member variable.
         /*!
-            相互作用を計算するセルの個数
+            2体ポテンシャルの数表へのスマートポインタ（数表を使わないときはnullptr）
         */
-        std::int32_t const ncp_ = 3;
+        std::unique_ptr<PairTable> ptable_;
 
         //! A private member variable.
         /*!
-            メッシュのリストへのスマートポインタ
+            力の計算の精度
         */
-        std::unique_ptr<MeshList> pmesh_;
-        
+        PrecisionType precisiontype_ = PrecisionType::DOUBLE;
+
         //! A private member variable.
         /*!
-            原子数
+            全エネルギーのドリフトの基準を取り直すかどうか
         */
-        std::int32_t NumAtom_;
+        bool resetdrift_ = true;
 
         //! A private member variable.
         /*!
-            ペアリスト
+            ポテンシャルエネルギーとビリアルを計算するステップの間隔
         */
-        SystemParam::mypairvector pairs_;
+        std::int32_t samplinginterval_ = 1;
         
         //! A private member variable.
         /*!
@@ -475,23 +1436,47 @@ namespace moleculardynamics {
         */
         double periodiclen_;
 
-        //! A private member variable (constant).
+        //! A private member variable.
         /*!
-            カットオフ半径の2乗
+            recalc()の後でペアリストを作り直した回数
         */
-        double const rc2_;
+        std::int32_t rebuildcount_ = 0;
 
-        //! A private member variable (constant).
+        //! A private member variable.
         /*!
-            カットオフ半径の逆数の6乗
+            原子の変位でペアリストを作り直した回数
         */
-        double const rcm6_;
+        std::int32_t rebuilddisplacementcount_ = 0;
 
-        //! A private member variable (constant).
+        //! A private member variable.
+        /*!
+            原子の変位でペアリストを作り直した間隔のステップ数の和
+        */
+        std::int32_t rebuildintervalsum_ = 0;
+
+        //! A private member variable.
+        /*!
+            最後にペアリストを作り直した理由
+        */
+        RebuildReason rebuildreason_ = RebuildReason::INITIAL;
+
+        //! A private member variable.
+        /*!
+            原子の配列を並べ替えるときの作業用のバッファ
+        */
+        AtomSoA::mydoublevector reorderbuffer_;
+
+        //! A private member variable.
+        /*!
+            元の原子の番号を並べ替えるときの作業用のバッファ
+        */
+        std::vector<std::int32_t> reorderindex_;
+
+        //! A private member variable.
         /*!
-            カットオフ半径の逆数の12乗
+            2体ポテンシャルのカットオフ半径の2乗
         */
-        double const rcm12_;
+        double rc2_;
 
         //! A private member variable.
         /*!
@@ -499,6 +1484,12 @@ namespace moleculardynamics {
         */
         double scale_ = Ar_moleculardynamics::FIRSTSCALE;
 
+        //! A private member variable.
+        /*!
+            力の計算に使うSIMD命令セット（起動時にCPUIDから決める）
+        */
+        SimdType simdtype_ = ljkernel::detect_simd_type();
+
         //! A private member variable.
         /*!
             時間
@@ -511,6 +1502,18 @@ namespace moleculardynamics {
         */
         double Tc_;
 
+        //! A private member variable.
+        /*!
+            ポテンシャルエネルギーとビリアルを計算したステップで記録した温度（圧力の計算に使う）
+        */
+        double sampletc_ = 0.0;
+
+        //! A private member variable.
+        /*!
+            ポテンシャルエネルギーとビリアルを計算した最後のステップの番号
+        */
+        std::int32_t sampleiter_ = -1;
+
         //! A private member variable.
         /*!
             温度制御の方法
@@ -537,21 +1540,70 @@ namespace moleculardynamics {
 
         //! A private member variable (constant).
         /*!
-            全エネルギー
+            全エネルギー（ポテンシャルエネルギーを計算したステップで記録した値）
         */
         double Utot_;
 
+        //! A private member variable.
+        /*!
+            全エネルギーのドリフトの基準にする全エネルギー
+        */
+        double Utot0_;
+
         //! A private member variable (constant).
         /*!
             ビリアル
         */
         double virial_;
 
-        //! A private member variable (constant).
+        //! A private member variable.
+        /*!
+            ポテンシャルエネルギーの打ち切り（カットオフ半径でのエネルギーの符号を変えた値）
+        */
+        double Vrc_;
+
+        //! A private member variable.
+        /*!
+            ヘルパースレッドとやり取りするフラグを守るミューテックス
+        */
+        std::mutex asyncmutex_;
+
+        //! A private member variable.
+        /*!
+            ペアリストの作成を頼んだこと、作り終えたこと、止めることを知らせる条件変数
+        */
+        std::condition_variable asynccond_;
+
+        //! A private member variable.
+        /*!
+            ヘルパースレッドにペアリストの作成を頼んで、まだ作り終えていないかどうか
+        */
+        bool asyncrequested_ = false;
+
+        //! A private member variable.
+        /*!
+            ヘルパースレッドが、頼まれたペアリストを作り終えたかどうか
+        */
+        bool asyncready_ = false;
+
+        //! A private member variable.
+        /*!
+            ヘルパースレッドを止めるかどうか
+        */
+        bool asyncquit_ = false;
+
+        //! A private member variable.
+        /*!
+            ヘルパースレッドでペアリストを作る間に投げられた例外（投げられていなければ空）
+        */
+        std::exception_ptr asyncexception_;
+
+        //! A private member variable.
         /*!
-            ポテンシャルエネルギーの打ち切り
+            ペアリストを作るヘルパースレッド（一度作ったら、破棄するまで使い回す）
+            ヘルパースレッドはメッシュリストとasync*のメンバ変数を使うので、最後に宣言して、破棄するときに最初に止める
         */
-        double const Vrc_;
+        std::thread asyncthread_;
 
         // #endregion privateメンバ変数
 
@@ -573,6 +1625,40 @@ namespace moleculardynamics {
 
         // #endregion 禁止されたコンストラクタ・メンバ関数
     };
+
+    // #region templateメンバ関数の実装
+
+    template <typename Potential>
+    void Ar_moleculardynamics::setPotential()
+    {
+        // ペアリストはSystemParam::RCUTOFFまでの原子の組を集めるので、それより長いカットオフは使えない
+        BOOST_ASSERT(Potential::cutoff() <= SystemParam::RCUTOFF);
+
+        rc2_ = Potential::cutoff() * Potential::cutoff();
+        Vrc_ = -Potential::energy(rc2_);
+        potentialenergy_ = Potential::energy;
+        potentialforce_ = Potential::force_over_r;
+
+        // Lennard-Jonesポテンシャルは、命令セットごとに手で書いたカーネル関数を使う
+        potentialkernel_ = std::is_same<Potential, potential::LennardJones>::value ?
+            nullptr : &ljkernel::calc_force_potential<Potential>;
+
+        if (ptable_) {
+            setTableResolution(ptable_->size());
+        }
+        else {
+            selectKernel();
+            selectParallelMethod();
+            rebuildPairlist(RebuildReason::SETTING);
+        }
+
+        // 新しいポテンシャルでの値を次のステップで計算する
+        observed_ = true;
+        resetdrift_ = true;
+        energydrift_ = 0.0;
+    }
+
+    // #endregion templateメンバ関数の実装
 }
 
 #endif      // _AR_MOLECULARDYNAMICS_H_
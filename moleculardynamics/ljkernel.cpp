@@ -0,0 +1,610 @@
+﻿/*! \file ljkernel.cpp
+    \brief Lennard-Jonesポテンシャルの力を計算するカーネル関数の実装（SIMD命令を使わない版と、命令セットの選択）
+
+    Copyright ©  2017 @dc1394 All Rights Reserved.
+    This software is released under the BSD 2-Clause License.
+*/
+
+#include "ljkernel.h"
+#include <boost/assert.hpp> // for BOOST_ASSERT
+
+#ifdef _MSC_VER
+    #include <intrin.h>     // for __cpuid, __cpuidex, _xgetbv
+#else
+    #include <cpuid.h>      // for __get_cpuid_count
+#endif
+
+namespace moleculardynamics {
+    namespace ljkernel {
+        // #region 内部で使う関数
+
+        //! A function.
+        /*!
+            CPUID命令を実行する
+            \param leaf EAXレジスタに与える値
+            \param subleaf ECXレジスタに与える値
+            \param regs EAX, EBX, ECX, EDXレジスタの値が格納される配列
+        */
+        static void cpuid(std::uint32_t leaf, std::uint32_t subleaf, std::uint32_t regs[4])
+        {
+#ifdef _MSC_VER
+            int r[4];
+            __cpuidex(r, static_cast<int>(leaf), static_cast<int>(subleaf));
+            for (auto i = 0; i < 4; i++) {
+                regs[i] = static_cast<std::uint32_t>(r[i]);
+            }
+#else
+            if (!__get_cpuid_count(leaf, subleaf, &regs[0], &regs[1], &regs[2], &regs[3])) {
+                regs[0] = regs[1] = regs[2] = regs[3] = 0;
+            }
+#endif
+        }
+
+        //! A function.
+        /*!
+            XCR0レジスタ（OSが保存・復元するレジスタの状態）を読み出す
+            \return XCR0レジスタの値
+        */
+        static std::uint64_t xgetbv0()
+        {
+#ifdef _MSC_VER
+            return _xgetbv(0);
+#else
+            std::uint32_t eax, edx;
+            __asm__ volatile ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+            return (static_cast<std::uint64_t>(edx) << 32) | eax;
+#endif
+        }
+
+        template <bool Newton, bool Energy, bool Virial, bool Table, bool Compact>
+        //! A template function.
+        /*!
+            SIMD命令を使わずに、原子に働く力を計算する
+            \tparam Newton 作用・反作用の法則を使って、相手の原子jにも力を書き込むかどうか
+            \tparam Energy ポテンシャルエネルギーを計算するかどうか
+            \tparam Virial ビリアルを計算するかどうか
+            \tparam Table Lennard-Jonesポテンシャルの式の代わりに、2体ポテンシャルの数表を使うかどうか
+            \tparam Compact 圧縮したペアリスト（相手の原子のインデックスを、区間の基準からの16ビットの差で表したもの）を使うかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（Energyがtrueのときだけ加算される）
+            \param virial ビリアル（Virialがtrueのときだけ加算される）
+        */
+        static void calc_force_scalar_impl(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            // 圧縮したペアリストでは、原子iの行を相手の原子のインデックスの基準ごとの区間に分けてあるので、区間を1つの行として扱う
+            auto const rbegin = Compact ? args.segoffsets[args.ibegin] : args.ibegin;
+            auto const rend = Compact ? args.segoffsets[args.iend] : args.iend;
+
+            for (auto r = rbegin; r < rend; r++) {
+                auto const i = Compact ? args.segatom[r] : r;
+                auto const base = Compact ? args.segbase[r] : 0;
+
+                auto const xi = args.rx[i];
+                auto const yi = args.ry[i];
+                auto const zi = args.rz[i];
+
+                // 原子iに働く力は、行の最後にまとめて書き込む
+                auto fxi = 0.0, fyi = 0.0, fzi = 0.0;
+
+                for (auto k = args.offsets[r]; k < args.offsets[r + 1]; k++) {
+                    auto const j = Compact ? base + args.jdelta[k] : args.jindex[k];
+
+                    // 周期的境界条件の補正は、ペアリストに記録した相手の原子の像の番号から求める（分岐しない）
+                    auto const s = args.shift[k];
+                    auto const dx = args.rx[j] - xi + static_cast<double>((s & 3) - 1) * args.periodiclen;
+                    auto const dy = args.ry[j] - yi + static_cast<double>((s >> 2 & 3) - 1) * args.periodiclen;
+                    auto const dz = args.rz[j] - zi + static_cast<double>((s >> 4 & 3) - 1) * args.periodiclen;
+
+                    auto const r2 = dx * dx + dy * dy + dz * dz;
+
+                    if (r2 <= args.rc2) {
+                        double dFdr, e;
+
+                        if (Table) {
+                            // 数表の区間と区間の中の位置を求めて、3次式を計算する
+                            auto const t = (r2 - args.tabler2min) * args.tableinvdr2;
+                            auto n = static_cast<std::int32_t>(t);
+                            n = n < 0 ? 0 : (n >= args.tablesize ? args.tablesize - 1 : n);
+
+                            auto const x = t - static_cast<double>(n);
+                            auto const c = args.table + n * TABLESTRIDE;
+                            dFdr = c[0] + x * (c[1] + x * (c[2] + x * c[3]));
+                            e = Energy ? c[4] + x * (c[5] + x * (c[6] + x * c[7])) : 0.0;
+                        }
+                        else {
+                            auto const r2i = 1.0 / r2;
+                            auto const r6i = r2i * r2i * r2i;
+                            dFdr = (24.0 * r6i - 48.0 * r6i * r6i) * r2i;
+                            e = Energy ? 4.0 * (r6i * r6i - r6i) + args.vrc : 0.0;
+                        }
+
+                        fxi += dFdr * dx;
+                        fyi += dFdr * dy;
+                        fzi += dFdr * dz;
+
+                        if (Newton) {
+                            args.fx[j] -= dFdr * dx;
+                            args.fy[j] -= dFdr * dy;
+                            args.fz[j] -= dFdr * dz;
+                        }
+
+                        if (Energy) {
+                            up += e;
+                        }
+
+                        if (Virial) {
+                            virial += r2 * dFdr;
+                        }
+                    }
+                }
+
+                args.fx[i] += fxi;
+                args.fy[i] += fyi;
+                args.fz[i] += fzi;
+            }
+        }
+
+        template <bool Energy, bool Virial>
+        //! A template function.
+        /*!
+            SIMD命令を使わずに、クラスタペアリストを使って原子に働く力を計算する
+            \tparam Energy ポテンシャルエネルギーを計算するかどうか
+            \tparam Virial ビリアルを計算するかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（Energyがtrueのときだけ加算される）
+            \param virial ビリアル（Virialがtrueのときだけ加算される）
+        */
+        static void calc_cluster_force_scalar_impl(ClusterKernelArgs const & args, double & up, double & virial)
+        {
+            for (auto ic = args.ibegin; ic < args.iend; ic++) {
+                // クラスタiの原子に働く力は、行の最後にまとめて書き込む
+                double fxi[4] = { 0.0 }, fyi[4] = { 0.0 }, fzi[4] = { 0.0 };
+
+                for (auto k = args.offsets[ic]; k < args.offsets[ic + 1]; k++) {
+                    auto const jc = args.jcluster[k];
+                    auto const mask = args.mask[k];
+
+                    // 相手のクラスタの像の位置（クラスタペアごとに1つなので、原子の組ごとの補正は要らない）
+                    auto const s = args.shift[k];
+                    auto const shiftx = static_cast<double>((s & 3) - 1) * args.periodiclen;
+                    auto const shifty = static_cast<double>((s >> 2 & 3) - 1) * args.periodiclen;
+                    auto const shiftz = static_cast<double>((s >> 4 & 3) - 1) * args.periodiclen;
+
+                    for (auto li = 0; li < 4; li++) {
+                        auto const i = ic * 4 + li;
+
+                        for (auto lj = 0; lj < 4; lj++) {
+                            if (!(mask & (1 << (li * 4 + lj)))) {
+                                continue;
+                            }
+
+                            auto const j = jc * 4 + lj;
+                            auto const dx = args.x[j] + shiftx - args.x[i];
+                            auto const dy = args.y[j] + shifty - args.y[i];
+                            auto const dz = args.z[j] + shiftz - args.z[i];
+
+                            auto const r2 = dx * dx + dy * dy + dz * dz;
+
+                            if (r2 <= args.rc2) {
+                                auto const r2i = 1.0 / r2;
+                                auto const r6i = r2i * r2i * r2i;
+                                auto const dFdr = (24.0 * r6i - 48.0 * r6i * r6i) * r2i;
+
+                                fxi[li] += dFdr * dx;
+                                fyi[li] += dFdr * dy;
+                                fzi[li] += dFdr * dz;
+                                args.fx[j] -= dFdr * dx;
+                                args.fy[j] -= dFdr * dy;
+                                args.fz[j] -= dFdr * dz;
+
+                                if (Energy) {
+                                    up += 4.0 * (r6i * r6i - r6i) + args.vrc;
+                                }
+
+                                if (Virial) {
+                                    virial += r2 * dFdr;
+                                }
+                            }
+                        }
+                    }
+                }
+
+                for (auto li = 0; li < 4; li++) {
+                    args.fx[ic * 4 + li] += fxi[li];
+                    args.fy[ic * 4 + li] += fyi[li];
+                    args.fz[ic * 4 + li] += fzi[li];
+                }
+            }
+        }
+
+        template <bool Energy, bool Virial>
+        //! A template function.
+        /*!
+            SIMD命令を使わずに、座標の差と力をfloatで、力とエネルギーの和をdoubleで計算して、クラスタペアリストを使って原子に働く力を計算する
+            \tparam Energy ポテンシャルエネルギーを計算するかどうか
+            \tparam Virial ビリアルを計算するかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（Energyがtrueのときだけ加算される）
+            \param virial ビリアル（Virialがtrueのときだけ加算される）
+        */
+        static void calc_cluster_force_mixed_scalar_impl(ClusterKernelArgs const & args, double & up, double & virial)
+        {
+            auto const rc2 = static_cast<float>(args.rc2);
+            auto const vrc = static_cast<float>(args.vrc);
+
+            for (auto ic = args.ibegin; ic < args.iend; ic++) {
+                // クラスタiの原子に働く力は、行の最後にまとめて書き込む
+                double fxi[4] = { 0.0 }, fyi[4] = { 0.0 }, fzi[4] = { 0.0 };
+
+                for (auto k = args.offsets[ic]; k < args.offsets[ic + 1]; k++) {
+                    auto const jc = args.jcluster[k];
+                    auto const mask = args.mask[k];
+
+                    // 座標は番地の原点からの相対座標なので、相手のクラスタの像の番地の原点を足せば差が求まる
+                    auto const jox = args.joriginx[k];
+                    auto const joy = args.joriginy[k];
+                    auto const joz = args.joriginz[k];
+
+                    for (auto li = 0; li < 4; li++) {
+                        auto const i = ic * 4 + li;
+
+                        for (auto lj = 0; lj < 4; lj++) {
+                            if (!(mask & (1 << (li * 4 + lj)))) {
+                                continue;
+                            }
+
+                            auto const j = jc * 4 + lj;
+                            auto const dx = args.xf[j] + jox - args.xf[i];
+                            auto const dy = args.yf[j] + joy - args.yf[i];
+                            auto const dz = args.zf[j] + joz - args.zf[i];
+
+                            auto const r2 = dx * dx + dy * dy + dz * dz;
+
+                            if (r2 <= rc2) {
+                                auto const r2i = 1.0f / r2;
+                                auto const r6i = r2i * r2i * r2i;
+                                auto const dFdr = (24.0f * r6i - 48.0f * r6i * r6i) * r2i;
+
+                                auto const tx = static_cast<double>(dFdr * dx);
+                                auto const ty = static_cast<double>(dFdr * dy);
+                                auto const tz = static_cast<double>(dFdr * dz);
+
+                                fxi[li] += tx;
+                                fyi[li] += ty;
+                                fzi[li] += tz;
+                                args.fx[j] -= tx;
+                                args.fy[j] -= ty;
+                                args.fz[j] -= tz;
+
+                                if (Energy) {
+                                    up += static_cast<double>(4.0f * (r6i * r6i - r6i) + vrc);
+                                }
+
+                                if (Virial) {
+                                    virial += static_cast<double>(r2 * dFdr);
+                                }
+                            }
+                        }
+                    }
+                }
+
+                for (auto li = 0; li < 4; li++) {
+                    args.fx[ic * 4 + li] += fxi[li];
+                    args.fy[ic * 4 + li] += fyi[li];
+                    args.fz[ic * 4 + li] += fzi[li];
+                }
+            }
+        }
+
+        template <bool Newton, bool Table, bool Compact>
+        //! A template function.
+        /*!
+            SIMD命令を使わずに、原子に働く力を計算する（計算する量はargs.flagsで選ぶ）
+            \tparam Newton 作用・反作用の法則を使って、相手の原子jにも力を書き込むかどうか
+            \tparam Table Lennard-Jonesポテンシャルの式の代わりに、2体ポテンシャルの数表を使うかどうか
+            \tparam Compact 圧縮したペアリスト（相手の原子のインデックスを、区間の基準からの16ビットの差で表したもの）を使うかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（加算される）
+            \param virial ビリアル（加算される）
+        */
+        static void calc_force_scalar_flags(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            switch (args.flags) {
+            case ComputeFlags::FORCE:
+                calc_force_scalar_impl<Newton, false, false, Table, Compact>(args, up, virial);
+                break;
+
+            case ComputeFlags::ENERGY:
+                calc_force_scalar_impl<Newton, true, false, Table, Compact>(args, up, virial);
+                break;
+
+            case ComputeFlags::VIRIAL:
+                calc_force_scalar_impl<Newton, false, true, Table, Compact>(args, up, virial);
+                break;
+
+            default:
+                calc_force_scalar_impl<Newton, true, true, Table, Compact>(args, up, virial);
+                break;
+            }
+        }
+
+        // #endregion 内部で使う関数
+
+        // #region 関数の実装
+
+        void calc_cluster_force_scalar(ClusterKernelArgs const & args, double & up, double & virial)
+        {
+            switch (args.flags) {
+            case ComputeFlags::FORCE:
+                calc_cluster_force_scalar_impl<false, false>(args, up, virial);
+                break;
+
+            case ComputeFlags::ENERGY:
+                calc_cluster_force_scalar_impl<true, false>(args, up, virial);
+                break;
+
+            case ComputeFlags::VIRIAL:
+                calc_cluster_force_scalar_impl<false, true>(args, up, virial);
+                break;
+
+            default:
+                calc_cluster_force_scalar_impl<true, true>(args, up, virial);
+                break;
+            }
+        }
+
+        void calc_cluster_force_mixed_scalar(ClusterKernelArgs const & args, double & up, double & virial)
+        {
+            switch (args.flags) {
+            case ComputeFlags::FORCE:
+                calc_cluster_force_mixed_scalar_impl<false, false>(args, up, virial);
+                break;
+
+            case ComputeFlags::ENERGY:
+                calc_cluster_force_mixed_scalar_impl<true, false>(args, up, virial);
+                break;
+
+            case ComputeFlags::VIRIAL:
+                calc_cluster_force_mixed_scalar_impl<false, true>(args, up, virial);
+                break;
+
+            default:
+                calc_cluster_force_mixed_scalar_impl<true, true>(args, up, virial);
+                break;
+            }
+        }
+
+        template <bool Compact>
+        //! A template function.
+        /*!
+            SIMD命令を使わずに、原子に働く力を計算する（数表と作用・反作用の法則を使うかどうかはargsで選ぶ）
+            \tparam Compact 圧縮したペアリストを使うかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（加算される）
+            \param virial ビリアル（加算される）
+        */
+        static void calc_force_scalar_list(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            if (args.table) {
+                if (args.newton) {
+                    calc_force_scalar_flags<true, true, Compact>(args, up, virial);
+                }
+                else {
+                    calc_force_scalar_flags<false, true, Compact>(args, up, virial);
+                }
+            }
+            else if (args.newton) {
+                calc_force_scalar_flags<true, false, Compact>(args, up, virial);
+            }
+            else {
+                calc_force_scalar_flags<false, false, Compact>(args, up, virial);
+            }
+        }
+
+        void calc_force_scalar(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            if (args.jdelta) {
+                calc_force_scalar_list<true>(args, up, virial);
+            }
+            else {
+                calc_force_scalar_list<false>(args, up, virial);
+            }
+        }
+
+        std::int32_t filter_pairs_scalar(PairFilterArgs const & args, std::int32_t * out)
+        {
+            auto c = 0;
+            for (auto k = 0; k < args.n; k++) {
+                auto const j = args.candidates[k];
+                auto const dx = args.rx[j] - args.xi + args.shiftx;
+                auto const dy = args.ry[j] - args.yi + args.shifty;
+                auto const dz = args.rz[j] - args.zi + args.shiftz;
+
+                // 分岐しないように、いったん書き込んでから、残すときだけ書き込む位置を進める
+                out[c] = j;
+                c += dx * dx + dy * dy + dz * dz <= args.ml2 ? 1 : 0;
+            }
+
+            return c;
+        }
+
+        std::int32_t prune_pairs_scalar(PairPruneArgs const & args, std::int32_t * jout, std::uint8_t * shiftout)
+        {
+            auto c = 0;
+            for (auto k = 0; k < args.n; k++) {
+                auto const j = args.jindex[k];
+                auto const s = args.shift[k];
+                auto const dx = args.rx[j] - args.xi + static_cast<double>((s & 3) - 1) * args.periodiclen;
+                auto const dy = args.ry[j] - args.yi + static_cast<double>((s >> 2 & 3) - 1) * args.periodiclen;
+                auto const dz = args.rz[j] - args.zi + static_cast<double>((s >> 4 & 3) - 1) * args.periodiclen;
+
+                // 分岐しないように、いったん書き込んでから、残すときだけ書き込む位置を進める
+                jout[c] = j;
+                shiftout[c] = s;
+                c += dx * dx + dy * dy + dz * dz <= args.rl2 ? 1 : 0;
+            }
+
+            return c;
+        }
+
+        SimdType detect_simd_type()
+        {
+            std::uint32_t regs[4];
+
+            cpuid(0, 0, regs);
+            auto const maxleaf = regs[0];
+
+            if (maxleaf < 1) {
+                return SimdType::SCALAR;
+            }
+
+            cpuid(1, 0, regs);
+            auto const ecx1 = regs[2];
+
+            auto const sse42 = (ecx1 & (1U << 20)) != 0;
+            auto const osxsave = (ecx1 & (1U << 27)) != 0;
+            auto const avx = (ecx1 & (1U << 28)) != 0;
+            auto const fma = (ecx1 & (1U << 12)) != 0;
+
+            if (!sse42) {
+                return SimdType::SCALAR;
+            }
+
+            // OSがYMM/ZMMレジスタを保存・復元しないなら、AVX系の命令は使えない
+            if (!osxsave || !avx || maxleaf < 7) {
+                return SimdType::SSE42;
+            }
+
+            auto const xcr0 = xgetbv0();
+            if ((xcr0 & 0x6) != 0x6) {
+                return SimdType::SSE42;
+            }
+
+            cpuid(7, 0, regs);
+            auto const ebx7 = regs[1];
+
+            auto const avx2 = (ebx7 & (1U << 5)) != 0;
+            // AVX-512版の翻訳単位は/arch:AVX512でコンパイルするので、コンパイラが出しうるF、DQ、CD、BW、VLの拡張がすべてそろっていなければならない
+            auto const avx512mask = (1U << 16) | (1U << 17) | (1U << 28) | (1U << 30) | (1U << 31);
+            auto const avx512 = (ebx7 & avx512mask) == avx512mask;
+
+            if (!avx2 || !fma) {
+                return SimdType::SSE42;
+            }
+
+            // opmask、ZMMの上位256ビット、ZMM16～31の状態をOSが保存するか
+            if (avx512 && (xcr0 & 0xE0) == 0xE0) {
+                return SimdType::AVX512;
+            }
+
+            return SimdType::AVX2;
+        }
+
+        ljkernelfunc get_kernel(SimdType simdtype)
+        {
+            switch (simdtype) {
+            case SimdType::SCALAR:
+                return calc_force_scalar;
+
+            case SimdType::SSE42:
+                return calc_force_sse42;
+
+            case SimdType::AVX2:
+                return calc_force_avx2;
+
+            case SimdType::AVX512:
+                return calc_force_avx512;
+
+            default:
+                BOOST_ASSERT(!"何かがおかしい！");
+                return calc_force_scalar;
+            }
+        }
+
+        clusterkernelfunc get_cluster_kernel(SimdType simdtype)
+        {
+            switch (simdtype) {
+            case SimdType::SCALAR:
+                return calc_cluster_force_scalar;
+
+            case SimdType::SSE42:
+                return calc_cluster_force_sse42;
+
+            case SimdType::AVX2:
+                return calc_cluster_force_avx2;
+
+            case SimdType::AVX512:
+                return calc_cluster_force_avx512;
+
+            default:
+                BOOST_ASSERT(!"何かがおかしい！");
+                return calc_cluster_force_scalar;
+            }
+        }
+
+        clusterkernelfunc get_mixed_cluster_kernel(SimdType simdtype)
+        {
+            switch (simdtype) {
+            case SimdType::SCALAR:
+                return calc_cluster_force_mixed_scalar;
+
+            case SimdType::SSE42:
+                return calc_cluster_force_mixed_sse42;
+
+            case SimdType::AVX2:
+                return calc_cluster_force_mixed_avx2;
+
+            case SimdType::AVX512:
+                return calc_cluster_force_mixed_avx512;
+
+            default:
+                BOOST_ASSERT(!"何かがおかしい！");
+                return calc_cluster_force_mixed_scalar;
+            }
+        }
+
+        pairfilterfunc get_pair_filter(SimdType simdtype)
+        {
+            switch (simdtype) {
+            case SimdType::SCALAR:
+                return filter_pairs_scalar;
+
+            case SimdType::SSE42:
+                return filter_pairs_sse42;
+
+            case SimdType::AVX2:
+                return filter_pairs_avx2;
+
+            case SimdType::AVX512:
+                return filter_pairs_avx512;
+
+            default:
+                BOOST_ASSERT(!"何かがおかしい！");
+                return filter_pairs_scalar;
+            }
+        }
+
+        pairprunefunc get_pair_prune(SimdType simdtype)
+        {
+            switch (simdtype) {
+            case SimdType::SCALAR:
+                return prune_pairs_scalar;
+
+            case SimdType::SSE42:
+                return prune_pairs_sse42;
+
+            case SimdType::AVX2:
+                return prune_pairs_avx2;
+
+            case SimdType::AVX512:
+                return prune_pairs_avx512;
+
+            default:
+                BOOST_ASSERT(!"何かがおかしい！");
+                return prune_pairs_scalar;
+            }
+        }
+
+        // #endregion 関数の実装
+    }
+}
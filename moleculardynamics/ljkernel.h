@@ -0,0 +1,630 @@
+﻿/*! \file ljkernel.h
+    \brief Lennard-Jonesポテンシャルの力を計算するカーネル関数の宣言
+
+    Copyright ©  2017 @dc1394 All Rights Reserved.
+    This software is released under the BSD 2-Clause License.
+*/
+
+#ifndef _LJKERNEL_H_
+#define _LJKERNEL_H_
+
+#pragma once
+
+#include <cstdint>      // for std::int32_t, std::uint8_t, std::uint16_t
+
+namespace moleculardynamics {
+    //! A enum.
+    /*!
+        力の計算に使うSIMD命令セットの列挙型
+    */
+    enum class SimdType : std::int32_t {
+        // SIMD命令を使わない
+        SCALAR = 0,
+
+        // SSE4.2
+        SSE42 = 1,
+
+        // AVX2
+        AVX2 = 2,
+
+        // AVX-512
+        AVX512 = 3
+    };
+
+    namespace ljkernel {
+        //! A enum.
+        /*!
+            カーネル関数が、力と一緒に計算する量の列挙型（ビットの論理和）
+            観測量を読まないステップでは、FORCEを指定すればエネルギーとビリアルの計算を省ける
+        */
+        enum class ComputeFlags : std::int32_t {
+            // 力だけを計算する
+            FORCE = 0,
+
+            // ポテンシャルエネルギーも計算する
+            ENERGY = 1,
+
+            // ビリアルも計算する
+            VIRIAL = 2,
+
+            // ポテンシャルエネルギーとビリアルも計算する
+            ENERGY_VIRIAL = 3
+        };
+
+        //! A global variable (constant).
+        /*!
+            2体ポテンシャルの数表の、1区間あたりの係数の数（力の係数4個とエネルギーの係数4個）
+        */
+        static std::int32_t const TABLESTRIDE = 8;
+
+        //! A struct.
+        /*!
+            カーネル関数に渡す引数をまとめた構造体
+            命令セットごとの翻訳単位でstd::vectorなどのテンプレートを実体化させないように、生のポインタだけを持つ
+        */
+        struct ForceKernelArgs {
+            //! A public member variable.
+            /*!
+                原子の座標のx, y, z成分
+            */
+            double const * rx, * ry, * rz;
+
+            //! A public member variable.
+            /*!
+                原子に働く力のx, y, z成分（加算される）
+            */
+            double * fx, * fy, * fz;
+
+            //! A public member variable.
+            /*!
+                ペアリストの相手の原子のインデックス
+            */
+            std::int32_t const * jindex;
+
+            //! A public member variable.
+            /*!
+                ペアリストの、原子iの行の始まりを表すインデックス（圧縮したペアリストでは、区間rの始まりを表すインデックス）
+            */
+            std::int32_t const * offsets;
+
+            //! A public member variable.
+            /*!
+                ペアごとの、相手の原子の周期的な像の番号（ビット0～1、2～3、4～5が、x, y, z方向の周期の長さの倍数 + 1）
+                SIMDのカーネル関数が行の端数をまとめて読み込むので、ペアの数より8要素以上長くなければならない
+            */
+            std::uint8_t const * shift;
+
+            //! A public member variable.
+            /*!
+                圧縮したペアリストの、相手の原子のインデックスの区間の基準からの差（nullptrのときは、jindexを使う）
+                SIMDのカーネル関数が区間の端数をまとめて読み込むので、ペアの数より8要素以上長くなければならない
+            */
+            std::int16_t const * jdelta;
+
+            //! A public member variable.
+            /*!
+                圧縮したペアリストの、原子iの区間の始まりを表すインデックス（原子iの行は、区間segoffsets[i]からsegoffsets[i + 1] - 1まで）
+            */
+            std::int32_t const * segoffsets;
+
+            //! A public member variable.
+            /*!
+                圧縮したペアリストの、区間ごとの原子iのインデックス
+            */
+            std::int32_t const * segatom;
+
+            //! A public member variable.
+            /*!
+                圧縮したペアリストの、区間ごとの相手の原子のインデックスの基準
+            */
+            std::int32_t const * segbase;
+
+            //! A public member variable.
+            /*!
+                計算する原子iの範囲の始まり
+            */
+            std::int32_t ibegin;
+
+            //! A public member variable.
+            /*!
+                計算する原子iの範囲の終わり（この原子は含まない）
+            */
+            std::int32_t iend;
+
+            //! A public member variable.
+            /*!
+                作用・反作用の法則を使って、相手の原子jにも力を書き込むかどうか
+                （falseのときは、ペアリストは両方向のペアを含む完全なリストでなければならない）
+            */
+            bool newton;
+
+            //! A public member variable.
+            /*!
+                力と一緒に計算する量
+            */
+            ComputeFlags flags;
+
+            //! A public member variable.
+            /*!
+                周期の長さ
+            */
+            double periodiclen;
+
+            //! A public member variable.
+            /*!
+                カットオフ半径の2乗
+            */
+            double rc2;
+
+            //! A public member variable.
+            /*!
+                ポテンシャルエネルギーの打ち切り
+            */
+            double vrc;
+
+            //! A public member variable.
+            /*!
+                2体ポテンシャルの数表の係数（区間ごとにTABLESTRIDE個、32バイト境界に揃っていなければならない）
+                nullptrのときは、Lennard-Jonesポテンシャルの式をそのまま計算する
+            */
+            double const * table;
+
+            //! A public member variable.
+            /*!
+                数表の最小のr^2
+            */
+            double tabler2min;
+
+            //! A public member variable.
+            /*!
+                数表の区間の幅（r^2）の逆数
+            */
+            double tableinvdr2;
+
+            //! A public member variable.
+            /*!
+                数表の区間の数
+            */
+            std::int32_t tablesize;
+        };
+
+        //! A struct.
+        /*!
+            クラスタペアリスト用のカーネル関数に渡す引数をまとめた構造体
+            座標と力は、クラスタの順に並べ替えた配列（1クラスタあたりClusterPairList::CLUSTERSIZE個）を指す
+        */
+        struct ClusterKernelArgs {
+            //! A public member variable.
+            /*!
+                クラスタの順に並べ替えた、原子の座標のx, y, z成分
+            */
+            double const * x, * y, * z;
+
+            //! A public member variable.
+            /*!
+                クラスタの順に並べ替えた、クラスタがいる番地の原点から見た原子の座標のx, y, z成分（混合精度のカーネル関数だけが使う）
+            */
+            float const * xf, * yf, * zf;
+
+            //! A public member variable.
+            /*!
+                クラスタペアごとの、クラスタiの番地の原点から見た、相手のクラスタの像の番地の原点のx, y, z成分（混合精度のカーネル関数だけが使う）
+            */
+            float const * joriginx, * joriginy, * joriginz;
+
+            //! A public member variable.
+            /*!
+                クラスタの順に並べ替えた、原子に働く力のx, y, z成分（加算される）
+            */
+            double * fx, * fy, * fz;
+
+            //! A public member variable.
+            /*!
+                クラスタペアリストの相手のクラスタのインデックス
+            */
+            std::int32_t const * jcluster;
+
+            //! A public member variable.
+            /*!
+                クラスタペアごとの、相互作用を計算する原子の組のビットマスク（ビット(li * 4 + lj)が、i側のli番目とj側のlj番目の組）
+            */
+            std::uint16_t const * mask;
+
+            //! A public member variable.
+            /*!
+                力と一緒に計算する量
+            */
+            ComputeFlags flags;
+
+            //! A public member variable.
+            /*!
+                クラスタペアリストの、クラスタiの行の始まりを表すインデックス
+            */
+            std::int32_t const * offsets;
+
+            //! A public member variable.
+            /*!
+                クラスタペアごとの、相手のクラスタの周期的な像の番号（ビット0～1、2～3、4～5が、x, y, z方向の周期の長さの倍数 + 1）
+            */
+            std::uint8_t const * shift;
+
+            //! A public member variable.
+            /*!
+                計算するクラスタiの範囲の始まり
+            */
+            std::int32_t ibegin;
+
+            //! A public member variable.
+            /*!
+                計算するクラスタiの範囲の終わり（このクラスタは含まない）
+            */
+            std::int32_t iend;
+
+            //! A public member variable.
+            /*!
+                周期の長さ
+            */
+            double periodiclen;
+
+            //! A public member variable.
+            /*!
+                カットオフ半径の2乗
+            */
+            double rc2;
+
+            //! A public member variable.
+            /*!
+                ポテンシャルエネルギーの打ち切り
+            */
+            double vrc;
+        };
+
+        //! A struct.
+        /*!
+            ペアリストを作るときに、相手の原子の候補を距離でふるい分ける関数に渡す引数をまとめた構造体
+        */
+        struct PairFilterArgs {
+            //! A public member variable.
+            /*!
+                原子の座標のx, y, z成分
+            */
+            double const * rx, * ry, * rz;
+
+            //! A public member variable.
+            /*!
+                相手の原子の候補のインデックス
+            */
+            std::int32_t const * candidates;
+
+            //! A public member variable.
+            /*!
+                相手の原子の候補の数
+            */
+            std::int32_t n;
+
+            //! A public member variable.
+            /*!
+                原子iの座標のx, y, z成分
+            */
+            double xi, yi, zi;
+
+            //! A public member variable.
+            /*!
+                相手の原子の周期的な像の、座標のずれのx, y, z成分
+            */
+            double shiftx, shifty, shiftz;
+
+            //! A public member variable.
+            /*!
+                ペアリストに登録する距離の2乗の上限（カットオフ半径とマージンの和の2乗）
+            */
+            double ml2;
+        };
+
+        //! A struct.
+        /*!
+            外側のペアリストの1行を刈り込む関数に渡す引数をまとめた構造体
+        */
+        struct PairPruneArgs {
+            //! A public member variable.
+            /*!
+                原子の座標のx, y, z成分
+            */
+            double const * rx, * ry, * rz;
+
+            //! A public member variable.
+            /*!
+                外側のペアリストの行の、相手の原子のインデックス
+            */
+            std::int32_t const * jindex;
+
+            //! A public member variable.
+            /*!
+                外側のペアリストの行の、相手の原子の周期的な像の番号（ペアリストの末尾に余分な要素があるので、行の端数でも8個まとめて読み込める）
+            */
+            std::uint8_t const * shift;
+
+            //! A public member variable.
+            /*!
+                外側のペアリストの行の組の数
+            */
+            std::int32_t n;
+
+            //! A public member variable.
+            /*!
+                原子iの座標のx, y, z成分
+            */
+            double xi, yi, zi;
+
+            //! A public member variable.
+            /*!
+                周期の長さ
+            */
+            double periodiclen;
+
+            //! A public member variable.
+            /*!
+                内側のペアリストに残す距離の2乗の上限（カットオフ半径とPRUNEMARGINの和の2乗）
+            */
+            double rl2;
+        };
+
+        //! A typedef.
+        /*!
+            カーネル関数へのポインタの型
+        */
+        using ljkernelfunc = void (*)(ForceKernelArgs const & args, double & up, double & virial);
+
+        //! A typedef.
+        /*!
+            クラスタペアリスト用のカーネル関数へのポインタの型
+        */
+        using clusterkernelfunc = void (*)(ClusterKernelArgs const & args, double & up, double & virial);
+
+        //! A typedef.
+        /*!
+            相手の原子の候補を距離でふるい分ける関数へのポインタの型
+        */
+        using pairfilterfunc = std::int32_t (*)(PairFilterArgs const & args, std::int32_t * out);
+
+        //! A typedef.
+        /*!
+            外側のペアリストの1行を刈り込む関数へのポインタの型
+        */
+        using pairprunefunc = std::int32_t (*)(PairPruneArgs const & args, std::int32_t * jout, std::uint8_t * shiftout);
+
+        //! A function.
+        /*!
+            SIMD命令を使わずに、原子に働く力を計算する
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（args.flagsにENERGYが含まれるときだけ加算される）
+            \param virial ビリアル（args.flagsにVIRIALが含まれるときだけ加算される）
+        */
+        void calc_force_scalar(ForceKernelArgs const & args, double & up, double & virial);
+
+        //! A function.
+        /*!
+            SSE4.2を使って、原子iの相手の原子を2個ずつ処理して、原子に働く力を計算する
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（args.flagsにENERGYが含まれるときだけ加算される）
+            \param virial ビリアル（args.flagsにVIRIALが含まれるときだけ加算される）
+        */
+        void calc_force_sse42(ForceKernelArgs const & args, double & up, double & virial);
+
+        //! A function.
+        /*!
+            AVX2を使って、原子iの相手の原子を4個ずつ処理して、原子に働く力を計算する
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（args.flagsにENERGYが含まれるときだけ加算される）
+            \param virial ビリアル（args.flagsにVIRIALが含まれるときだけ加算される）
+        */
+        void calc_force_avx2(ForceKernelArgs const & args, double & up, double & virial);
+
+        //! A function.
+        /*!
+            AVX-512を使って、原子iの相手の原子を8個ずつ処理して、原子に働く力を計算する
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（args.flagsにENERGYが含まれるときだけ加算される）
+            \param virial ビリアル（args.flagsにVIRIALが含まれるときだけ加算される）
+        */
+        void calc_force_avx512(ForceKernelArgs const & args, double & up, double & virial);
+
+        //! A function.
+        /*!
+            SIMD命令を使わずに、クラスタペアリストを使って原子に働く力を計算する
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（args.flagsにENERGYが含まれるときだけ加算される）
+            \param virial ビリアル（args.flagsにVIRIALが含まれるときだけ加算される）
+        */
+        void calc_cluster_force_scalar(ClusterKernelArgs const & args, double & up, double & virial);
+
+        //! A function.
+        /*!
+            SSE4.2を使って、相手のクラスタの原子を2個ずつ処理して、クラスタペアリストを使って原子に働く力を計算する
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（args.flagsにENERGYが含まれるときだけ加算される）
+            \param virial ビリアル（args.flagsにVIRIALが含まれるときだけ加算される）
+        */
+        void calc_cluster_force_sse42(ClusterKernelArgs const & args, double & up, double & virial);
+
+        //! A function.
+        /*!
+            AVX2を使って、相手のクラスタの原子4個を一度に処理して、クラスタペアリストを使って原子に働く力を計算する
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（args.flagsにENERGYが含まれるときだけ加算される）
+            \param virial ビリアル（args.flagsにVIRIALが含まれるときだけ加算される）
+        */
+        void calc_cluster_force_avx2(ClusterKernelArgs const & args, double & up, double & virial);
+
+        //! A function.
+        /*!
+            AVX-512を使って、i側の原子2個と相手のクラスタの原子4個の組を一度に処理して、クラスタペアリストを使って原子に働く力を計算する
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（args.flagsにENERGYが含まれるときだけ加算される）
+            \param virial ビリアル（args.flagsにVIRIALが含まれるときだけ加算される）
+        */
+        void calc_cluster_force_avx512(ClusterKernelArgs const & args, double & up, double & virial);
+
+        //! A function.
+        /*!
+            SIMD命令を使わずに、クラスタペアリストを使って原子に働く力を混合精度で計算する
+            座標の差とLennard-Jonesポテンシャルの項はfloatで、力とエネルギーの和はdoubleで計算する
+            \param args カーネル関数に渡す引数（座標はxf, yf, zfとjoriginx, joriginy, joriginzを使う）
+            \param up ポテンシャルエネルギー（args.flagsにENERGYが含まれるときだけ加算される）
+            \param virial ビリアル（args.flagsにVIRIALが含まれるときだけ加算される）
+        */
+        void calc_cluster_force_mixed_scalar(ClusterKernelArgs const & args, double & up, double & virial);
+
+        //! A function.
+        /*!
+            SSE4.2を使って、相手のクラスタの原子4個を一度に処理して、クラスタペアリストを使って原子に働く力を混合精度で計算する
+            \param args カーネル関数に渡す引数（座標はxf, yf, zfとjoriginx, joriginy, joriginzを使う）
+            \param up ポテンシャルエネルギー（args.flagsにENERGYが含まれるときだけ加算される）
+            \param virial ビリアル（args.flagsにVIRIALが含まれるときだけ加算される）
+        */
+        void calc_cluster_force_mixed_sse42(ClusterKernelArgs const & args, double & up, double & virial);
+
+        //! A function.
+        /*!
+            AVX2を使って、i側の原子2個と相手のクラスタの原子4個の組を一度に処理して、クラスタペアリストを使って原子に働く力を混合精度で計算する
+            \param args カーネル関数に渡す引数（座標はxf, yf, zfとjoriginx, joriginy, joriginzを使う）
+            \param up ポテンシャルエネルギー（args.flagsにENERGYが含まれるときだけ加算される）
+            \param virial ビリアル（args.flagsにVIRIALが含まれるときだけ加算される）
+        */
+        void calc_cluster_force_mixed_avx2(ClusterKernelArgs const & args, double & up, double & virial);
+
+        //! A function.
+        /*!
+            AVX-512を使って、クラスタペアの原子4×4個の組を一度に処理して、クラスタペアリストを使って原子に働く力を混合精度で計算する
+            \param args カーネル関数に渡す引数（座標はxf, yf, zfとjoriginx, joriginy, joriginzを使う）
+            \param up ポテンシャルエネルギー（args.flagsにENERGYが含まれるときだけ加算される）
+            \param virial ビリアル（args.flagsにVIRIALが含まれるときだけ加算される）
+        */
+        void calc_cluster_force_mixed_avx512(ClusterKernelArgs const & args, double & up, double & virial);
+
+        //! A function.
+        /*!
+            SIMD命令を使わずに、相手の原子の候補のうち、距離の2乗がargs.ml2以下のものを候補の順に集める
+            \param args ふるい分ける関数に渡す引数
+            \param out 集めた相手の原子のインデックス（args.n要素の領域が要る）
+            \return 集めた相手の原子の数
+        */
+        std::int32_t filter_pairs_scalar(PairFilterArgs const & args, std::int32_t * out);
+
+        //! A function.
+        /*!
+            SSE4.2を使って、相手の原子の候補を2個ずつ調べ、距離の2乗がargs.ml2以下のものを候補の順に集める
+            \param args ふるい分ける関数に渡す引数
+            \param out 集めた相手の原子のインデックス（args.n要素の領域が要る）
+            \return 集めた相手の原子の数
+        */
+        std::int32_t filter_pairs_sse42(PairFilterArgs const & args, std::int32_t * out);
+
+        //! A function.
+        /*!
+            AVX2を使って、相手の原子の候補を4個ずつ調べ、距離の2乗がargs.ml2以下のものを、並べ替えの表で詰めて候補の順に集める
+            \param args ふるい分ける関数に渡す引数
+            \param out 集めた相手の原子のインデックス（args.n要素の領域が要る）
+            \return 集めた相手の原子の数
+        */
+        std::int32_t filter_pairs_avx2(PairFilterArgs const & args, std::int32_t * out);
+
+        //! A function.
+        /*!
+            AVX-512を使って、相手の原子の候補を16個ずつ調べ、距離の2乗がargs.ml2以下のものを、圧縮ストアで候補の順に集める
+            \param args ふるい分ける関数に渡す引数
+            \param out 集めた相手の原子のインデックス（args.n要素の領域が要る）
+            \return 集めた相手の原子の数
+        */
+        std::int32_t filter_pairs_avx512(PairFilterArgs const & args, std::int32_t * out);
+
+        //! A function.
+        /*!
+            SIMD命令を使わずに、外側のペアリストの1行から、距離の2乗がargs.rl2以下の組を行の順に集める
+            \param args 刈り込む関数に渡す引数
+            \param jout 集めた相手の原子のインデックス（args.n要素の領域が要る）
+            \param shiftout 集めた相手の原子の周期的な像の番号（args.n要素の領域が要る）
+            \return 集めた組の数
+        */
+        std::int32_t prune_pairs_scalar(PairPruneArgs const & args, std::int32_t * jout, std::uint8_t * shiftout);
+
+        //! A function.
+        /*!
+            SSE4.2を使って、外側のペアリストの1行の組を2個ずつ調べ、距離の2乗がargs.rl2以下の組を行の順に集める
+            \param args 刈り込む関数に渡す引数
+            \param jout 集めた相手の原子のインデックス（args.n要素の領域が要る）
+            \param shiftout 集めた相手の原子の周期的な像の番号（args.n要素の領域が要る）
+            \return 集めた組の数
+        */
+        std::int32_t prune_pairs_sse42(PairPruneArgs const & args, std::int32_t * jout, std::uint8_t * shiftout);
+
+        //! A function.
+        /*!
+            AVX2を使って、外側のペアリストの1行の組を4個ずつ調べ、距離の2乗がargs.rl2以下の組を、並べ替えの表で詰めて行の順に集める
+            \param args 刈り込む関数に渡す引数
+            \param jout 集めた相手の原子のインデックス（args.n要素の領域が要る）
+            \param shiftout 集めた相手の原子の周期的な像の番号（args.n要素の領域が要る）
+            \return 集めた組の数
+        */
+        std::int32_t prune_pairs_avx2(PairPruneArgs const & args, std::int32_t * jout, std::uint8_t * shiftout);
+
+        //! A function.
+        /*!
+            AVX-512を使って、外側のペアリストの1行の組を8個ずつ調べ、距離の2乗がargs.rl2以下の組を、圧縮ストアで行の順に集める
+            \param args 刈り込む関数に渡す引数
+            \param jout 集めた相手の原子のインデックス（args.n要素の領域が要る）
+            \param shiftout 集めた相手の原子の周期的な像の番号（args.n要素の領域が要る）
+            \return 集めた組の数
+        */
+        std::int32_t prune_pairs_avx512(PairPruneArgs const & args, std::int32_t * jout, std::uint8_t * shiftout);
+
+        //! A function.
+        /*!
+            CPUIDを調べて、このCPUとOSで使える最も新しいSIMD命令セットを求める
+            \return 使えるSIMD命令セット
+        */
+        SimdType detect_simd_type();
+
+        //! A function.
+        /*!
+            SIMD命令セットに対応するカーネル関数を返す
+            \param simdtype SIMD命令セット
+            \return カーネル関数へのポインタ
+        */
+        ljkernelfunc get_kernel(SimdType simdtype);
+
+        //! A function.
+        /*!
+            SIMD命令セットに対応する、クラスタペアリスト用のカーネル関数を返す
+            \param simdtype SIMD命令セット
+            \return カーネル関数へのポインタ
+        */
+        clusterkernelfunc get_cluster_kernel(SimdType simdtype);
+
+        //! A function.
+        /*!
+            SIMD命令セットに対応する、クラスタペアリスト用の混合精度のカーネル関数を返す
+            \param simdtype SIMD命令セット
+            \return カーネル関数へのポインタ
+        */
+        clusterkernelfunc get_mixed_cluster_kernel(SimdType simdtype);
+
+        //! A function.
+        /*!
+            SIMD命令セットに対応する、相手の原子の候補を距離でふるい分ける関数を返す
+            \param simdtype SIMD命令セット
+            \return ふるい分ける関数へのポインタ
+        */
+        pairfilterfunc get_pair_filter(SimdType simdtype);
+
+        //! A function.
+        /*!
+            SIMD命令セットに対応する、外側のペアリストの1行を刈り込む関数を返す
+            \param simdtype SIMD命令セット
+            \return 刈り込む関数へのポインタ
+        */
+        pairprunefunc get_pair_prune(SimdType simdtype);
+    }
+}
+
+#endif      // _LJKERNEL_H_
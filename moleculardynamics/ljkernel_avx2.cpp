@@ -0,0 +1,705 @@
+﻿/*! \file ljkernel_avx2.cpp
+    \brief Lennard-Jonesポテンシャルの力を計算するカーネル関数の実装（AVX2版）
+
+    Copyright ©  2017 @dc1394 All Rights Reserved.
+    This software is released under the BSD 2-Clause License.
+*/
+
+#include "ljkernel.h"
+#include <cstring>          // for std::memcpy
+#include <immintrin.h>      // for AVX2 intrinsics
+
+namespace moleculardynamics {
+    namespace ljkernel {
+        //! A function.
+        /*!
+            比較結果のマスクで残すレーンを、並べ替えの表で前に詰める
+            \param v 4個の32ビット整数
+            \param mask 残すレーンのマスク（4ビット）
+            \return 残すレーンを前に詰めた4個の32ビット整数（詰めた後ろのレーンの値は不定）
+        */
+        static inline __m128i compact_lanes(__m128i v, std::int32_t mask)
+        {
+            // 比較結果のマスク（4ビット）ごとに、残すレーンを前に詰める並べ替えの表
+            static std::int32_t const compact[16][4] = {
+                { 0, 0, 0, 0 }, { 0, 0, 0, 0 }, { 1, 0, 0, 0 }, { 0, 1, 0, 0 },
+                { 2, 0, 0, 0 }, { 0, 2, 0, 0 }, { 1, 2, 0, 0 }, { 0, 1, 2, 0 },
+                { 3, 0, 0, 0 }, { 0, 3, 0, 0 }, { 1, 3, 0, 0 }, { 0, 1, 3, 0 },
+                { 2, 3, 0, 0 }, { 0, 2, 3, 0 }, { 1, 2, 3, 0 }, { 0, 1, 2, 3 }
+            };
+
+            auto const perm = _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<__m128i const *>(compact[mask])));
+            return _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(_mm256_castsi128_si256(v), perm));
+        }
+
+        //! A function.
+        /*!
+            4個のレーンの数表の係数を並べ替えて（4×4の転置）、3次式c0 + x * (c1 + x * (c2 + x * c3))を計算する
+            \param table 数表の係数の先頭へのポインタ
+            \param nn 各レーンの区間の係数の、tableからの位置
+            \param x 区間の中の位置
+            \return 3次式の値
+        */
+        static inline __m256d horner(double const * table, std::int32_t const nn[4], __m256d x)
+        {
+            auto const r0 = _mm256_load_pd(table + nn[0]);
+            auto const r1 = _mm256_load_pd(table + nn[1]);
+            auto const r2 = _mm256_load_pd(table + nn[2]);
+            auto const r3 = _mm256_load_pd(table + nn[3]);
+
+            auto const t0 = _mm256_unpacklo_pd(r0, r1);
+            auto const t1 = _mm256_unpackhi_pd(r0, r1);
+            auto const t2 = _mm256_unpacklo_pd(r2, r3);
+            auto const t3 = _mm256_unpackhi_pd(r2, r3);
+
+            auto const c0 = _mm256_permute2f128_pd(t0, t2, 0x20);
+            auto const c1 = _mm256_permute2f128_pd(t1, t3, 0x20);
+            auto const c2 = _mm256_permute2f128_pd(t0, t2, 0x31);
+            auto const c3 = _mm256_permute2f128_pd(t1, t3, 0x31);
+
+            return _mm256_fmadd_pd(x, _mm256_fmadd_pd(x, _mm256_fmadd_pd(x, c3, c2), c1), c0);
+        }
+
+        //! A function.
+        /*!
+            レーン0～3、4～7にi側の原子li = 0、1（t01）とli = 2、3（t23）の値が並んだベクトルから、
+            liごとの4レーンの和を[li = 0, 1, 2, 3]の順に並べて返す
+            \param t01 i側の原子li = 0、1の値
+            \param t23 i側の原子li = 2、3の値
+            \return liごとの和
+        */
+        static inline __m128 sum_rows(__m256 t01, __m256 t23)
+        {
+            // [0, 0, 2, 2 | 1, 1, 3, 3]の部分和から、[0, 2, 0, 2 | 1, 3, 1, 3]の和を作って並べ替える
+            auto const u = _mm256_hadd_ps(t01, t23);
+            auto const v = _mm256_hadd_ps(u, u);
+
+            return _mm_unpacklo_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        }
+
+        template <bool Newton, bool Energy, bool Virial, bool Table, bool Compact>
+        //! A template function.
+        /*!
+            AVX2を使って、原子iの相手の原子を4個ずつ処理して、原子に働く力を計算する
+            \tparam Newton 作用・反作用の法則を使って、相手の原子jにも力を書き込むかどうか
+            \tparam Energy ポテンシャルエネルギーを計算するかどうか
+            \tparam Virial ビリアルを計算するかどうか
+            \tparam Table Lennard-Jonesポテンシャルの式の代わりに、2体ポテンシャルの数表を使うかどうか
+            \tparam Compact 圧縮したペアリスト（相手の原子のインデックスを、区間の基準からの16ビットの差で表したもの）を使うかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（Energyがtrueのときだけ加算される）
+            \param virial ビリアル（Virialがtrueのときだけ加算される）
+        */
+        static void calc_force_avx2_impl(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            auto const vl = _mm256_set1_pd(args.periodiclen);
+            auto const v1i = _mm_set1_epi32(1);
+            auto const v3i = _mm_set1_epi32(3);
+            auto const vrc2 = _mm256_set1_pd(args.rc2);
+            auto const vvrc = _mm256_set1_pd(args.vrc);
+            auto const vone = _mm256_set1_pd(1.0);
+            auto const v4 = _mm256_set1_pd(4.0);
+            auto const v24 = _mm256_set1_pd(24.0);
+            auto const v48 = _mm256_set1_pd(48.0);
+            auto const lane = _mm_setr_epi32(0, 1, 2, 3);
+            auto const vr2min = _mm256_set1_pd(args.tabler2min);
+            auto const vinvdr2 = _mm256_set1_pd(args.tableinvdr2);
+            auto const vnmax = _mm_set1_epi32(args.tablesize - 1);
+
+            auto vup = _mm256_setzero_pd();
+            auto vvirial = _mm256_setzero_pd();
+
+            // 圧縮したペアリストでは、原子iの行を相手の原子のインデックスの基準ごとの区間に分けてあるので、区間を1つの行として扱う
+            auto const rbegin = Compact ? args.segoffsets[args.ibegin] : args.ibegin;
+            auto const rend = Compact ? args.segoffsets[args.iend] : args.iend;
+
+            for (auto r = rbegin; r < rend; r++) {
+                auto const i = Compact ? args.segatom[r] : r;
+                auto const base = Compact ? args.segbase[r] : 0;
+
+                auto const xi = _mm256_set1_pd(args.rx[i]);
+                auto const yi = _mm256_set1_pd(args.ry[i]);
+                auto const zi = _mm256_set1_pd(args.rz[i]);
+
+                // 原子iに働く力は、レジスタに溜めておいて行の最後にまとめて書き込む
+                auto vfxi = _mm256_setzero_pd();
+                auto vfyi = _mm256_setzero_pd();
+                auto vfzi = _mm256_setzero_pd();
+
+                auto const kend = args.offsets[r + 1];
+
+                for (auto k = args.offsets[r]; k < kend; k += 4) {
+                    // 行の端数のレーンはマスクで無効にする
+                    auto const n = kend - k;
+                    auto const lanes32 = _mm_cmpgt_epi32(_mm_set1_epi32(n), lane);
+                    auto const lanes = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(lanes32));
+
+                    // 圧縮したペアリストでは、16ビットの差を32ビットに広げて区間の基準に足す（jdeltaも末尾に余分な要素があるので、4個まとめて読み込める）
+                    auto const vj = Compact ?
+                        _mm_and_si128(_mm_add_epi32(_mm_set1_epi32(base), _mm_cvtepi16_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(args.jdelta + k)))), lanes32) :
+                        _mm_maskload_epi32(args.jindex + k, lanes32);
+
+                    auto dx = _mm256_sub_pd(_mm256_mask_i32gather_pd(_mm256_setzero_pd(), args.rx, vj, lanes, 8), xi);
+                    auto dy = _mm256_sub_pd(_mm256_mask_i32gather_pd(_mm256_setzero_pd(), args.ry, vj, lanes, 8), yi);
+                    auto dz = _mm256_sub_pd(_mm256_mask_i32gather_pd(_mm256_setzero_pd(), args.rz, vj, lanes, 8), zi);
+
+                    // 周期的境界条件の補正は、ペアリストに記録した相手の原子の像の番号から求める
+                    // （shiftは末尾に余分な要素があるので、行の端数でも4個まとめて読み込める）
+                    std::int32_t bits;
+                    std::memcpy(&bits, args.shift + k, sizeof(bits));
+                    auto const vs = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bits));
+                    dx = _mm256_add_pd(dx, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_sub_epi32(_mm_and_si128(vs, v3i), v1i)), vl));
+                    dy = _mm256_add_pd(dy, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(vs, 2), v3i), v1i)), vl));
+                    dz = _mm256_add_pd(dz, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(vs, 4), v3i), v1i)), vl));
+
+                    auto const r2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz));
+                    auto const mask = _mm256_and_pd(_mm256_cmp_pd(r2, vrc2, _CMP_LE_OQ), lanes);
+
+                    // 4ペアともカットオフの外なら何もしない
+                    if (!_mm256_movemask_pd(mask)) {
+                        continue;
+                    }
+
+                    auto dfdr = _mm256_setzero_pd();
+                    auto e = _mm256_setzero_pd();
+
+                    if (Table) {
+                        // 数表の区間と区間の中の位置を求めて、4レーン分の係数を並べ替えてから3次式を計算する
+                        auto const t = _mm256_mul_pd(_mm256_sub_pd(r2, vr2min), vinvdr2);
+                        auto const n = _mm_min_epi32(_mm_max_epi32(_mm256_cvttpd_epi32(t), _mm_setzero_si128()), vnmax);
+                        auto const x = _mm256_sub_pd(t, _mm256_cvtepi32_pd(n));
+
+                        alignas(16) std::int32_t nn[4];
+                        _mm_store_si128(reinterpret_cast<__m128i *>(nn), _mm_mullo_epi32(n, _mm_set1_epi32(TABLESTRIDE)));
+
+                        dfdr = _mm256_and_pd(mask, horner(args.table, nn, x));
+                        if (Energy) {
+                            e = horner(args.table + 4, nn, x);
+                        }
+                    }
+                    else {
+                        auto const r2i = _mm256_div_pd(vone, r2);
+                        auto const r6i = _mm256_mul_pd(_mm256_mul_pd(r2i, r2i), r2i);
+                        dfdr = _mm256_and_pd(
+                            mask,
+                            _mm256_mul_pd(_mm256_sub_pd(_mm256_mul_pd(v24, r6i), _mm256_mul_pd(v48, _mm256_mul_pd(r6i, r6i))), r2i));
+
+                        if (Energy) {
+                            e = _mm256_add_pd(_mm256_mul_pd(v4, _mm256_sub_pd(_mm256_mul_pd(r6i, r6i), r6i)), vvrc);
+                        }
+                    }
+
+                    if (Energy) {
+                        vup = _mm256_add_pd(vup, _mm256_and_pd(mask, e));
+                    }
+
+                    if (Virial) {
+                        vvirial = _mm256_add_pd(vvirial, _mm256_mul_pd(r2, dfdr));
+                    }
+
+                    auto const tx = _mm256_mul_pd(dfdr, dx);
+                    auto const ty = _mm256_mul_pd(dfdr, dy);
+                    auto const tz = _mm256_mul_pd(dfdr, dz);
+
+                    vfxi = _mm256_add_pd(vfxi, tx);
+                    vfyi = _mm256_add_pd(vfyi, ty);
+                    vfzi = _mm256_add_pd(vfzi, tz);
+
+                    if (Newton) {
+                        // AVX2にはscatter命令がないので、1レーンずつ書き戻す
+                        alignas(32) double sx[4], sy[4], sz[4];
+                        _mm256_store_pd(sx, tx);
+                        _mm256_store_pd(sy, ty);
+                        _mm256_store_pd(sz, tz);
+
+                        auto const nl = n < 4 ? n : 4;
+                        for (auto l = 0; l < nl; l++) {
+                            auto const j = Compact ? base + args.jdelta[k + l] : args.jindex[k + l];
+
+                            args.fx[j] -= sx[l];
+                            args.fy[j] -= sy[l];
+                            args.fz[j] -= sz[l];
+                        }
+                    }
+                }
+
+                alignas(32) double sum[4];
+                _mm256_store_pd(sum, vfxi);
+                args.fx[i] += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+                _mm256_store_pd(sum, vfyi);
+                args.fy[i] += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+                _mm256_store_pd(sum, vfzi);
+                args.fz[i] += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+            }
+
+            alignas(32) double sum[4];
+
+            if (Energy) {
+                _mm256_store_pd(sum, vup);
+                up += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+            }
+
+            if (Virial) {
+                _mm256_store_pd(sum, vvirial);
+                virial += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+            }
+        }
+
+        template <bool Newton, bool Table, bool Compact>
+        //! A template function.
+        /*!
+            AVX2を使って、原子iの相手の原子を4個ずつ処理して、原子に働く力を計算する（計算する量はargs.flagsで選ぶ）
+            \tparam Newton 作用・反作用の法則を使って、相手の原子jにも力を書き込むかどうか
+            \tparam Table Lennard-Jonesポテンシャルの式の代わりに、2体ポテンシャルの数表を使うかどうか
+            \tparam Compact 圧縮したペアリスト（相手の原子のインデックスを、区間の基準からの16ビットの差で表したもの）を使うかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（加算される）
+            \param virial ビリアル（加算される）
+        */
+        static void calc_force_avx2_flags(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            switch (args.flags) {
+            case ComputeFlags::FORCE:
+                calc_force_avx2_impl<Newton, false, false, Table, Compact>(args, up, virial);
+                break;
+
+            case ComputeFlags::ENERGY:
+                calc_force_avx2_impl<Newton, true, false, Table, Compact>(args, up, virial);
+                break;
+
+            case ComputeFlags::VIRIAL:
+                calc_force_avx2_impl<Newton, false, true, Table, Compact>(args, up, virial);
+                break;
+
+            default:
+                calc_force_avx2_impl<Newton, true, true, Table, Compact>(args, up, virial);
+                break;
+            }
+        }
+
+        template <bool Compact>
+        //! A template function.
+        /*!
+            AVX2を使って、原子iの相手の原子を4個ずつ処理して、原子に働く力を計算する（数表と作用・反作用の法則を使うかどうかはargsで選ぶ）
+            \tparam Compact 圧縮したペアリストを使うかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（加算される）
+            \param virial ビリアル（加算される）
+        */
+        static void calc_force_avx2_list(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            if (args.table) {
+                if (args.newton) {
+                    calc_force_avx2_flags<true, true, Compact>(args, up, virial);
+                }
+                else {
+                    calc_force_avx2_flags<false, true, Compact>(args, up, virial);
+                }
+            }
+            else if (args.newton) {
+                calc_force_avx2_flags<true, false, Compact>(args, up, virial);
+            }
+            else {
+                calc_force_avx2_flags<false, false, Compact>(args, up, virial);
+            }
+        }
+
+        void calc_force_avx2(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            if (args.jdelta) {
+                calc_force_avx2_list<true>(args, up, virial);
+            }
+            else {
+                calc_force_avx2_list<false>(args, up, virial);
+            }
+        }
+
+        template <bool Energy, bool Virial>
+        //! A template function.
+        /*!
+            AVX2を使って、相手のクラスタの原子4個を一度に処理して、クラスタペアリストを使って原子に働く力を計算する
+            \tparam Energy ポテンシャルエネルギーを計算するかどうか
+            \tparam Virial ビリアルを計算するかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（Energyがtrueのときだけ加算される）
+            \param virial ビリアル（Virialがtrueのときだけ加算される）
+        */
+        static void calc_cluster_force_avx2_impl(ClusterKernelArgs const & args, double & up, double & virial)
+        {
+            auto const vrc2 = _mm256_set1_pd(args.rc2);
+            auto const vvrc = _mm256_set1_pd(args.vrc);
+            auto const vone = _mm256_set1_pd(1.0);
+            auto const v4 = _mm256_set1_pd(4.0);
+            auto const v24 = _mm256_set1_pd(24.0);
+            auto const v48 = _mm256_set1_pd(48.0);
+            auto const lanebit = _mm256_setr_epi64x(1, 2, 4, 8);
+
+            auto vup = _mm256_setzero_pd();
+            auto vvirial = _mm256_setzero_pd();
+
+            for (auto ic = args.ibegin; ic < args.iend; ic++) {
+                // クラスタiの原子に働く力は、レジスタに溜めておいて行の最後にまとめて書き込む
+                __m256d vfxi[4], vfyi[4], vfzi[4];
+                for (auto li = 0; li < 4; li++) {
+                    vfxi[li] = vfyi[li] = vfzi[li] = _mm256_setzero_pd();
+                }
+
+                for (auto k = args.offsets[ic]; k < args.offsets[ic + 1]; k++) {
+                    auto const jc = args.jcluster[k];
+                    auto const mask = args.mask[k];
+
+                    // 相手のクラスタの像の位置（クラスタペアごとに1つなので、原子の組ごとの補正は要らない）
+                    auto const s = args.shift[k];
+                    auto const shiftx = static_cast<double>((s & 3) - 1) * args.periodiclen;
+                    auto const shifty = static_cast<double>((s >> 2 & 3) - 1) * args.periodiclen;
+                    auto const shiftz = static_cast<double>((s >> 4 & 3) - 1) * args.periodiclen;
+
+                    auto const j = jc * 4;
+                    auto const xj = _mm256_add_pd(_mm256_load_pd(args.x + j), _mm256_set1_pd(shiftx));
+                    auto const yj = _mm256_add_pd(_mm256_load_pd(args.y + j), _mm256_set1_pd(shifty));
+                    auto const zj = _mm256_add_pd(_mm256_load_pd(args.z + j), _mm256_set1_pd(shiftz));
+
+                    auto vfxj = _mm256_setzero_pd();
+                    auto vfyj = _mm256_setzero_pd();
+                    auto vfzj = _mm256_setzero_pd();
+
+                    for (auto li = 0; li < 4; li++) {
+                        auto const bits = (mask >> (li * 4)) & 0xF;
+                        if (!bits) {
+                            continue;
+                        }
+
+                        auto const i = ic * 4 + li;
+                        auto const dx = _mm256_sub_pd(xj, _mm256_set1_pd(args.x[i]));
+                        auto const dy = _mm256_sub_pd(yj, _mm256_set1_pd(args.y[i]));
+                        auto const dz = _mm256_sub_pd(zj, _mm256_set1_pd(args.z[i]));
+
+                        auto const r2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz));
+
+                        // ビットマスクで無効な組（パディングや、同じクラスタ内の重複）は、ビット演算で0にする
+                        auto const lanes = _mm256_castsi256_pd(
+                            _mm256_cmpeq_epi64(_mm256_and_si256(_mm256_set1_epi64x(bits), lanebit), lanebit));
+                        auto const m = _mm256_and_pd(_mm256_cmp_pd(r2, vrc2, _CMP_LE_OQ), lanes);
+
+                        if (!_mm256_movemask_pd(m)) {
+                            continue;
+                        }
+
+                        auto const r2i = _mm256_div_pd(vone, r2);
+                        auto const r6i = _mm256_mul_pd(_mm256_mul_pd(r2i, r2i), r2i);
+                        auto const dfdr = _mm256_and_pd(
+                            m,
+                            _mm256_mul_pd(_mm256_sub_pd(_mm256_mul_pd(v24, r6i), _mm256_mul_pd(v48, _mm256_mul_pd(r6i, r6i))), r2i));
+
+                        if (Energy) {
+                            auto const e = _mm256_add_pd(_mm256_mul_pd(v4, _mm256_sub_pd(_mm256_mul_pd(r6i, r6i), r6i)), vvrc);
+                            vup = _mm256_add_pd(vup, _mm256_and_pd(m, e));
+                        }
+
+                        if (Virial) {
+                            vvirial = _mm256_add_pd(vvirial, _mm256_mul_pd(r2, dfdr));
+                        }
+
+                        auto const tx = _mm256_mul_pd(dfdr, dx);
+                        auto const ty = _mm256_mul_pd(dfdr, dy);
+                        auto const tz = _mm256_mul_pd(dfdr, dz);
+
+                        vfxi[li] = _mm256_add_pd(vfxi[li], tx);
+                        vfyi[li] = _mm256_add_pd(vfyi[li], ty);
+                        vfzi[li] = _mm256_add_pd(vfzi[li], tz);
+                        vfxj = _mm256_add_pd(vfxj, tx);
+                        vfyj = _mm256_add_pd(vfyj, ty);
+                        vfzj = _mm256_add_pd(vfzj, tz);
+                    }
+
+                    // 相手のクラスタの原子は連続しているので、gatherやscatterなしで書き戻せる
+                    _mm256_store_pd(args.fx + j, _mm256_sub_pd(_mm256_load_pd(args.fx + j), vfxj));
+                    _mm256_store_pd(args.fy + j, _mm256_sub_pd(_mm256_load_pd(args.fy + j), vfyj));
+                    _mm256_store_pd(args.fz + j, _mm256_sub_pd(_mm256_load_pd(args.fz + j), vfzj));
+                }
+
+                for (auto li = 0; li < 4; li++) {
+                    alignas(32) double sum[4];
+                    _mm256_store_pd(sum, vfxi[li]);
+                    args.fx[ic * 4 + li] += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+                    _mm256_store_pd(sum, vfyi[li]);
+                    args.fy[ic * 4 + li] += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+                    _mm256_store_pd(sum, vfzi[li]);
+                    args.fz[ic * 4 + li] += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+                }
+            }
+
+            alignas(32) double sum[4];
+
+            if (Energy) {
+                _mm256_store_pd(sum, vup);
+                up += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+            }
+
+            if (Virial) {
+                _mm256_store_pd(sum, vvirial);
+                virial += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+            }
+        }
+
+        void calc_cluster_force_avx2(ClusterKernelArgs const & args, double & up, double & virial)
+        {
+            switch (args.flags) {
+            case ComputeFlags::FORCE:
+                calc_cluster_force_avx2_impl<false, false>(args, up, virial);
+                break;
+
+            case ComputeFlags::ENERGY:
+                calc_cluster_force_avx2_impl<true, false>(args, up, virial);
+                break;
+
+            case ComputeFlags::VIRIAL:
+                calc_cluster_force_avx2_impl<false, true>(args, up, virial);
+                break;
+
+            default:
+                calc_cluster_force_avx2_impl<true, true>(args, up, virial);
+                break;
+            }
+        }
+
+        template <bool Energy, bool Virial>
+        //! A template function.
+        /*!
+            AVX2を使って、i側の原子2個と相手のクラスタの原子4個の組をfloatで一度に処理し、力とエネルギーの和をdoubleで計算して、クラスタペアリストを使って原子に働く力を計算する
+            \tparam Energy ポテンシャルエネルギーを計算するかどうか
+            \tparam Virial ビリアルを計算するかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（Energyがtrueのときだけ加算される）
+            \param virial ビリアル（Virialがtrueのときだけ加算される）
+        */
+        static void calc_cluster_force_mixed_avx2_impl(ClusterKernelArgs const & args, double & up, double & virial)
+        {
+            auto const vrc2 = _mm256_set1_ps(static_cast<float>(args.rc2));
+            auto const vvrc = _mm256_set1_ps(static_cast<float>(args.vrc));
+            auto const vone = _mm256_set1_ps(1.0f);
+            auto const v4 = _mm256_set1_ps(4.0f);
+            auto const v24 = _mm256_set1_ps(24.0f);
+            auto const v48 = _mm256_set1_ps(48.0f);
+            auto const lanebit = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+
+            // レーン0～3にi側の原子2h個目、レーン4～7に2h + 1個目を並べる
+            __m256i const spread[2] = { _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1), _mm256_setr_epi32(2, 2, 2, 2, 3, 3, 3, 3) };
+
+            auto vup = _mm256_setzero_pd();
+            auto vvirial = _mm256_setzero_pd();
+
+            for (auto ic = args.ibegin; ic < args.iend; ic++) {
+                auto const i = ic * 4;
+                __m256 xi[2], yi[2], zi[2];
+                for (auto h = 0; h < 2; h++) {
+                    xi[h] = _mm256_permutevar8x32_ps(_mm256_castps128_ps256(_mm_load_ps(args.xf + i)), spread[h]);
+                    yi[h] = _mm256_permutevar8x32_ps(_mm256_castps128_ps256(_mm_load_ps(args.yf + i)), spread[h]);
+                    zi[h] = _mm256_permutevar8x32_ps(_mm256_castps128_ps256(_mm_load_ps(args.zf + i)), spread[h]);
+                }
+
+                // クラスタiの原子に働く力は、doubleのレジスタに溜めておいて行の最後にまとめて書き込む
+                auto vfxi = _mm256_setzero_pd();
+                auto vfyi = _mm256_setzero_pd();
+                auto vfzi = _mm256_setzero_pd();
+
+                for (auto k = args.offsets[ic]; k < args.offsets[ic + 1]; k++) {
+                    auto const jc = args.jcluster[k];
+                    auto const mask = args.mask[k];
+
+                    // 座標は番地の原点からの相対座標なので、相手のクラスタの像の番地の原点を足せば差が求まる
+                    auto const j = jc * 4;
+                    auto const xj4 = _mm_add_ps(_mm_load_ps(args.xf + j), _mm_set1_ps(args.joriginx[k]));
+                    auto const yj4 = _mm_add_ps(_mm_load_ps(args.yf + j), _mm_set1_ps(args.joriginy[k]));
+                    auto const zj4 = _mm_add_ps(_mm_load_ps(args.zf + j), _mm_set1_ps(args.joriginz[k]));
+                    auto const xj = _mm256_insertf128_ps(_mm256_castps128_ps256(xj4), xj4, 1);
+                    auto const yj = _mm256_insertf128_ps(_mm256_castps128_ps256(yj4), yj4, 1);
+                    auto const zj = _mm256_insertf128_ps(_mm256_castps128_ps256(zj4), zj4, 1);
+
+                    __m256 tx[2], ty[2], tz[2];
+
+                    for (auto h = 0; h < 2; h++) {
+                        tx[h] = ty[h] = tz[h] = _mm256_setzero_ps();
+
+                        auto const bits = (mask >> (h * 8)) & 0xFF;
+                        if (!bits) {
+                            continue;
+                        }
+
+                        auto const dx = _mm256_sub_ps(xj, xi[h]);
+                        auto const dy = _mm256_sub_ps(yj, yi[h]);
+                        auto const dz = _mm256_sub_ps(zj, zi[h]);
+
+                        auto const r2 = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+
+                        // ビットマスクで無効な組（パディングや、同じクラスタ内の重複）は、ビット演算で0にする
+                        auto const lanes = _mm256_castsi256_ps(
+                            _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(bits), lanebit), lanebit));
+                        auto const m = _mm256_and_ps(_mm256_cmp_ps(r2, vrc2, _CMP_LE_OQ), lanes);
+
+                        if (!_mm256_movemask_ps(m)) {
+                            continue;
+                        }
+
+                        auto const r2i = _mm256_div_ps(vone, r2);
+                        auto const r6i = _mm256_mul_ps(_mm256_mul_ps(r2i, r2i), r2i);
+                        auto const dfdr = _mm256_and_ps(
+                            m,
+                            _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(v24, r6i), _mm256_mul_ps(v48, _mm256_mul_ps(r6i, r6i))), r2i));
+
+                        if (Energy) {
+                            auto const e = _mm256_and_ps(m, _mm256_add_ps(_mm256_mul_ps(v4, _mm256_sub_ps(_mm256_mul_ps(r6i, r6i), r6i)), vvrc));
+                            vup = _mm256_add_pd(vup, _mm256_add_pd(
+                                _mm256_cvtps_pd(_mm256_castps256_ps128(e)), _mm256_cvtps_pd(_mm256_extractf128_ps(e, 1))));
+                        }
+
+                        if (Virial) {
+                            auto const w = _mm256_mul_ps(r2, dfdr);
+                            vvirial = _mm256_add_pd(vvirial, _mm256_add_pd(
+                                _mm256_cvtps_pd(_mm256_castps256_ps128(w)), _mm256_cvtps_pd(_mm256_extractf128_ps(w, 1))));
+                        }
+
+                        tx[h] = _mm256_mul_ps(dfdr, dx);
+                        ty[h] = _mm256_mul_ps(dfdr, dy);
+                        tz[h] = _mm256_mul_ps(dfdr, dz);
+                    }
+
+                    // 相手のクラスタの原子に働く力（i側の4個の和）は、doubleに直して書き戻す
+                    auto const fxj = _mm256_add_ps(tx[0], tx[1]);
+                    auto const fyj = _mm256_add_ps(ty[0], ty[1]);
+                    auto const fzj = _mm256_add_ps(tz[0], tz[1]);
+                    _mm256_store_pd(args.fx + j, _mm256_sub_pd(_mm256_load_pd(args.fx + j), _mm256_cvtps_pd(
+                        _mm_add_ps(_mm256_castps256_ps128(fxj), _mm256_extractf128_ps(fxj, 1)))));
+                    _mm256_store_pd(args.fy + j, _mm256_sub_pd(_mm256_load_pd(args.fy + j), _mm256_cvtps_pd(
+                        _mm_add_ps(_mm256_castps256_ps128(fyj), _mm256_extractf128_ps(fyj, 1)))));
+                    _mm256_store_pd(args.fz + j, _mm256_sub_pd(_mm256_load_pd(args.fz + j), _mm256_cvtps_pd(
+                        _mm_add_ps(_mm256_castps256_ps128(fzj), _mm256_extractf128_ps(fzj, 1)))));
+
+                    // クラスタiの原子に働く力（j側の4個の和）は、水平加算で[li = 0, 1, 2, 3]に並べてからdoubleで溜める
+                    vfxi = _mm256_add_pd(vfxi, _mm256_cvtps_pd(sum_rows(tx[0], tx[1])));
+                    vfyi = _mm256_add_pd(vfyi, _mm256_cvtps_pd(sum_rows(ty[0], ty[1])));
+                    vfzi = _mm256_add_pd(vfzi, _mm256_cvtps_pd(sum_rows(tz[0], tz[1])));
+                }
+
+                _mm256_store_pd(args.fx + i, _mm256_add_pd(_mm256_load_pd(args.fx + i), vfxi));
+                _mm256_store_pd(args.fy + i, _mm256_add_pd(_mm256_load_pd(args.fy + i), vfyi));
+                _mm256_store_pd(args.fz + i, _mm256_add_pd(_mm256_load_pd(args.fz + i), vfzi));
+            }
+
+            alignas(32) double sum[4];
+
+            if (Energy) {
+                _mm256_store_pd(sum, vup);
+                up += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+            }
+
+            if (Virial) {
+                _mm256_store_pd(sum, vvirial);
+                virial += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+            }
+        }
+
+        void calc_cluster_force_mixed_avx2(ClusterKernelArgs const & args, double & up, double & virial)
+        {
+            switch (args.flags) {
+            case ComputeFlags::FORCE:
+                calc_cluster_force_mixed_avx2_impl<false, false>(args, up, virial);
+                break;
+
+            case ComputeFlags::ENERGY:
+                calc_cluster_force_mixed_avx2_impl<true, false>(args, up, virial);
+                break;
+
+            case ComputeFlags::VIRIAL:
+                calc_cluster_force_mixed_avx2_impl<false, true>(args, up, virial);
+                break;
+
+            default:
+                calc_cluster_force_mixed_avx2_impl<true, true>(args, up, virial);
+                break;
+            }
+        }
+
+        std::int32_t filter_pairs_avx2(PairFilterArgs const & args, std::int32_t * out)
+        {
+            auto const xi = _mm256_set1_pd(args.xi);
+            auto const yi = _mm256_set1_pd(args.yi);
+            auto const zi = _mm256_set1_pd(args.zi);
+            auto const shiftx = _mm256_set1_pd(args.shiftx);
+            auto const shifty = _mm256_set1_pd(args.shifty);
+            auto const shiftz = _mm256_set1_pd(args.shiftz);
+            auto const ml2 = _mm256_set1_pd(args.ml2);
+
+            auto c = 0;
+            auto k = 0;
+            for (; k + 4 <= args.n; k += 4) {
+                auto const vj = _mm_loadu_si128(reinterpret_cast<__m128i const *>(args.candidates + k));
+
+                auto const dx = _mm256_add_pd(_mm256_sub_pd(_mm256_i32gather_pd(args.rx, vj, 8), xi), shiftx);
+                auto const dy = _mm256_add_pd(_mm256_sub_pd(_mm256_i32gather_pd(args.ry, vj, 8), yi), shifty);
+                auto const dz = _mm256_add_pd(_mm256_sub_pd(_mm256_i32gather_pd(args.rz, vj, 8), zi), shiftz);
+                auto const r2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz));
+                auto const mask = _mm256_movemask_pd(_mm256_cmp_pd(r2, ml2, _CMP_LE_OQ));
+
+                // 残すインデックスを前に詰めて4個まとめて書き込む（c <= kなので、outの範囲を超えない）
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + c), compact_lanes(vj, mask));
+                c += _mm_popcnt_u32(static_cast<std::uint32_t>(mask));
+            }
+
+            // 端数の候補
+            auto rest = args;
+            rest.candidates += k;
+            rest.n -= k;
+
+            return c + filter_pairs_scalar(rest, out + c);
+        }
+
+        std::int32_t prune_pairs_avx2(PairPruneArgs const & args, std::int32_t * jout, std::uint8_t * shiftout)
+        {
+            auto const xi = _mm256_set1_pd(args.xi);
+            auto const yi = _mm256_set1_pd(args.yi);
+            auto const zi = _mm256_set1_pd(args.zi);
+            auto const vl = _mm256_set1_pd(args.periodiclen);
+            auto const rl2 = _mm256_set1_pd(args.rl2);
+            auto const v1i = _mm_set1_epi32(1);
+            auto const v3i = _mm_set1_epi32(3);
+
+            // 4個の32ビット整数の下位8ビットを、先頭の4バイトに集める
+            auto const lowbytes = _mm_set1_epi32(0x0C080400);
+
+            auto c = 0;
+            auto k = 0;
+            for (; k + 4 <= args.n; k += 4) {
+                auto const vj = _mm_loadu_si128(reinterpret_cast<__m128i const *>(args.jindex + k));
+
+                // 周期的境界条件の補正は、ペアリストに記録した相手の原子の像の番号から求める
+                std::int32_t bits;
+                std::memcpy(&bits, args.shift + k, sizeof(bits));
+                auto const vs = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bits));
+
+                auto const dx = _mm256_add_pd(_mm256_sub_pd(_mm256_i32gather_pd(args.rx, vj, 8), xi),
+                    _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_sub_epi32(_mm_and_si128(vs, v3i), v1i)), vl));
+                auto const dy = _mm256_add_pd(_mm256_sub_pd(_mm256_i32gather_pd(args.ry, vj, 8), yi),
+                    _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(vs, 2), v3i), v1i)), vl));
+                auto const dz = _mm256_add_pd(_mm256_sub_pd(_mm256_i32gather_pd(args.rz, vj, 8), zi),
+                    _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(vs, 4), v3i), v1i)), vl));
+                auto const r2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz));
+                auto const mask = _mm256_movemask_pd(_mm256_cmp_pd(r2, rl2, _CMP_LE_OQ));
+
+                // 残す組のインデックスと像の番号を、同じ並べ替えで前に詰めて4個まとめて書き込む（c <= kなので、範囲を超えない）
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(jout + c), compact_lanes(vj, mask));
+                bits = _mm_cvtsi128_si32(_mm_shuffle_epi8(compact_lanes(vs, mask), lowbytes));
+                std::memcpy(shiftout + c, &bits, sizeof(bits));
+                c += _mm_popcnt_u32(static_cast<std::uint32_t>(mask));
+            }
+
+            // 行の端数の組
+            auto rest = args;
+            rest.jindex += k;
+            rest.shift += k;
+            rest.n -= k;
+
+            return c + prune_pairs_scalar(rest, jout + c, shiftout + c);
+        }
+    }
+}
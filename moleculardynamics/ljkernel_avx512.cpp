@@ -0,0 +1,622 @@
+﻿/*! \file ljkernel_avx512.cpp
+    \brief Lennard-Jonesポテンシャルの力を計算するカーネル関数の実装（AVX-512版）
+
+    Copyright ©  2017 @dc1394 All Rights Reserved.
+    This software is released under the BSD 2-Clause License.
+*/
+
+#include "ljkernel.h"
+#include <immintrin.h>      // for AVX-512 intrinsics
+
+namespace moleculardynamics {
+    namespace ljkernel {
+        //! A function.
+        /*!
+            16個のfloatのうち、上位8個を返す
+            \param v 16個のfloat
+            \return 上位8個のfloat
+        */
+        static inline __m256 upper_half(__m512 v)
+        {
+            return _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+        }
+
+        //! A function.
+        /*!
+            レーン(li * 4 + lj)に並んだ値の、liについての和をljの順に並べて返す
+            \param v レーン(li * 4 + lj)に並んだ値
+            \return ljごとの和
+        */
+        static inline __m128 sum_columns(__m512 v)
+        {
+            auto const t = _mm512_add_ps(v, _mm512_shuffle_f32x4(v, v, 0x4E));
+
+            return _mm512_castps512_ps128(_mm512_add_ps(t, _mm512_shuffle_f32x4(t, t, 0xB1)));
+        }
+
+        //! A function.
+        /*!
+            レーン(li * 4 + lj)に並んだ値の、ljについての和を、liごとの4レーンのすべてに入れて返す
+            \param v レーン(li * 4 + lj)に並んだ値
+            \return liごとの和
+        */
+        static inline __m512 sum_rows(__m512 v)
+        {
+            auto const t = _mm512_add_ps(v, _mm512_permute_ps(v, 0x4E));
+
+            return _mm512_add_ps(t, _mm512_permute_ps(t, 0xB1));
+        }
+
+        template <bool Newton, bool Energy, bool Virial, bool Table, bool Compact>
+        //! A template function.
+        /*!
+            AVX-512を使って、原子iの相手の原子を8個ずつ処理して、原子に働く力を計算する
+            \tparam Newton 作用・反作用の法則を使って、相手の原子jにも力を書き込むかどうか
+            \tparam Energy ポテンシャルエネルギーを計算するかどうか
+            \tparam Virial ビリアルを計算するかどうか
+            \tparam Table Lennard-Jonesポテンシャルの式の代わりに、2体ポテンシャルの数表を使うかどうか
+            \tparam Compact 圧縮したペアリスト（相手の原子のインデックスを、区間の基準からの16ビットの差で表したもの）を使うかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（Energyがtrueのときだけ加算される）
+            \param virial ビリアル（Virialがtrueのときだけ加算される）
+        */
+        static void calc_force_avx512_impl(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            auto const vl = _mm512_set1_pd(args.periodiclen);
+            auto const v1i = _mm256_set1_epi32(1);
+            auto const v3i = _mm256_set1_epi32(3);
+            auto const vrc2 = _mm512_set1_pd(args.rc2);
+            auto const vvrc = _mm512_set1_pd(args.vrc);
+            auto const vone = _mm512_set1_pd(1.0);
+            auto const v4 = _mm512_set1_pd(4.0);
+            auto const v24 = _mm512_set1_pd(24.0);
+            auto const v48 = _mm512_set1_pd(48.0);
+            auto const vr2min = _mm512_set1_pd(args.tabler2min);
+            auto const vinvdr2 = _mm512_set1_pd(args.tableinvdr2);
+            auto const vnmax = _mm256_set1_epi32(args.tablesize - 1);
+
+            auto vup = _mm512_setzero_pd();
+            auto vvirial = _mm512_setzero_pd();
+
+            // 圧縮したペアリストでは、原子iの行を相手の原子のインデックスの基準ごとの区間に分けてあるので、区間を1つの行として扱う
+            auto const rbegin = Compact ? args.segoffsets[args.ibegin] : args.ibegin;
+            auto const rend = Compact ? args.segoffsets[args.iend] : args.iend;
+
+            for (auto r = rbegin; r < rend; r++) {
+                auto const i = Compact ? args.segatom[r] : r;
+                auto const base = Compact ? args.segbase[r] : 0;
+
+                auto const xi = _mm512_set1_pd(args.rx[i]);
+                auto const yi = _mm512_set1_pd(args.ry[i]);
+                auto const zi = _mm512_set1_pd(args.rz[i]);
+
+                // 原子iに働く力は、レジスタに溜めておいて行の最後にまとめて書き込む
+                auto vfxi = _mm512_setzero_pd();
+                auto vfyi = _mm512_setzero_pd();
+                auto vfzi = _mm512_setzero_pd();
+
+                auto const kend = args.offsets[r + 1];
+
+                for (auto k = args.offsets[r]; k < kend; k += 8) {
+                    // 行の端数のレーンはマスクで無効にする
+                    auto const n = kend - k;
+                    auto const lanes = static_cast<__mmask8>(n >= 8 ? 0xFF : (1 << n) - 1);
+
+                    // 圧縮したペアリストでは、16ビットの差を32ビットに広げて区間の基準に足す（jdeltaも末尾に余分な要素があるので、8個まとめて読み込める）
+                    auto const vj = Compact ?
+                        _mm256_add_epi32(_mm256_set1_epi32(base), _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const *>(args.jdelta + k)))) :
+                        _mm512_castsi512_si256(_mm512_maskz_loadu_epi32(lanes, args.jindex + k));
+
+                    auto dx = _mm512_sub_pd(_mm512_mask_i32gather_pd(_mm512_setzero_pd(), lanes, vj, args.rx, 8), xi);
+                    auto dy = _mm512_sub_pd(_mm512_mask_i32gather_pd(_mm512_setzero_pd(), lanes, vj, args.ry, 8), yi);
+                    auto dz = _mm512_sub_pd(_mm512_mask_i32gather_pd(_mm512_setzero_pd(), lanes, vj, args.rz, 8), zi);
+
+                    // 周期的境界条件の補正は、ペアリストに記録した相手の原子の像の番号から求める
+                    // （shiftは末尾に余分な要素があるので、行の端数でも8個まとめて読み込める）
+                    auto const vs = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(args.shift + k)));
+                    dx = _mm512_add_pd(dx, _mm512_mul_pd(_mm512_cvtepi32_pd(_mm256_sub_epi32(_mm256_and_si256(vs, v3i), v1i)), vl));
+                    dy = _mm512_add_pd(dy, _mm512_mul_pd(_mm512_cvtepi32_pd(_mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(vs, 2), v3i), v1i)), vl));
+                    dz = _mm512_add_pd(dz, _mm512_mul_pd(_mm512_cvtepi32_pd(_mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(vs, 4), v3i), v1i)), vl));
+
+                    auto const r2 = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy)), _mm512_mul_pd(dz, dz));
+                    auto const mask = _mm512_mask_cmp_pd_mask(lanes, r2, vrc2, _CMP_LE_OQ);
+
+                    // 8ペアともカットオフの外なら何もしない
+                    if (!mask) {
+                        continue;
+                    }
+
+                    auto dfdr = _mm512_setzero_pd();
+                    auto e = _mm512_setzero_pd();
+
+                    if (Table) {
+                        // 数表の区間と区間の中の位置を求めて、係数をgatherしてから3次式を計算する
+                        auto const t = _mm512_mul_pd(_mm512_sub_pd(r2, vr2min), vinvdr2);
+                        auto const n = _mm256_min_epi32(_mm256_max_epi32(_mm512_cvttpd_epi32(t), _mm256_setzero_si256()), vnmax);
+                        auto const x = _mm512_sub_pd(t, _mm512_cvtepi32_pd(n));
+                        auto const idx = _mm256_slli_epi32(n, 3);
+
+                        auto const c0 = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), mask, idx, args.table, 8);
+                        auto const c1 = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), mask, idx, args.table + 1, 8);
+                        auto const c2 = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), mask, idx, args.table + 2, 8);
+                        auto const c3 = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), mask, idx, args.table + 3, 8);
+                        dfdr = _mm512_fmadd_pd(x, _mm512_fmadd_pd(x, _mm512_fmadd_pd(x, c3, c2), c1), c0);
+
+                        if (Energy) {
+                            auto const c4 = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), mask, idx, args.table + 4, 8);
+                            auto const c5 = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), mask, idx, args.table + 5, 8);
+                            auto const c6 = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), mask, idx, args.table + 6, 8);
+                            auto const c7 = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), mask, idx, args.table + 7, 8);
+                            e = _mm512_fmadd_pd(x, _mm512_fmadd_pd(x, _mm512_fmadd_pd(x, c7, c6), c5), c4);
+                        }
+                    }
+                    else {
+                        auto const r2i = _mm512_maskz_div_pd(mask, vone, r2);
+                        auto const r6i = _mm512_mul_pd(_mm512_mul_pd(r2i, r2i), r2i);
+                        dfdr = _mm512_mul_pd(_mm512_sub_pd(_mm512_mul_pd(v24, r6i), _mm512_mul_pd(v48, _mm512_mul_pd(r6i, r6i))), r2i);
+
+                        if (Energy) {
+                            e = _mm512_add_pd(_mm512_mul_pd(v4, _mm512_sub_pd(_mm512_mul_pd(r6i, r6i), r6i)), vvrc);
+                        }
+                    }
+
+                    if (Energy) {
+                        vup = _mm512_mask_add_pd(vup, mask, vup, e);
+                    }
+
+                    if (Virial) {
+                        vvirial = _mm512_add_pd(vvirial, _mm512_mul_pd(r2, dfdr));
+                    }
+
+                    auto const tx = _mm512_mul_pd(dfdr, dx);
+                    auto const ty = _mm512_mul_pd(dfdr, dy);
+                    auto const tz = _mm512_mul_pd(dfdr, dz);
+
+                    vfxi = _mm512_add_pd(vfxi, tx);
+                    vfyi = _mm512_add_pd(vfyi, ty);
+                    vfzi = _mm512_add_pd(vfzi, tz);
+
+                    if (Newton) {
+                        // 1つの行の中では相手の原子はすべて異なるので、gatherとscatterで書き戻しても衝突しない
+                        auto const fxj = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), mask, vj, args.fx, 8);
+                        auto const fyj = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), mask, vj, args.fy, 8);
+                        auto const fzj = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), mask, vj, args.fz, 8);
+                        _mm512_mask_i32scatter_pd(args.fx, mask, vj, _mm512_sub_pd(fxj, tx), 8);
+                        _mm512_mask_i32scatter_pd(args.fy, mask, vj, _mm512_sub_pd(fyj, ty), 8);
+                        _mm512_mask_i32scatter_pd(args.fz, mask, vj, _mm512_sub_pd(fzj, tz), 8);
+                    }
+                }
+
+                args.fx[i] += _mm512_reduce_add_pd(vfxi);
+                args.fy[i] += _mm512_reduce_add_pd(vfyi);
+                args.fz[i] += _mm512_reduce_add_pd(vfzi);
+            }
+
+            if (Energy) {
+                up += _mm512_reduce_add_pd(vup);
+            }
+
+            if (Virial) {
+                virial += _mm512_reduce_add_pd(vvirial);
+            }
+        }
+
+        template <bool Newton, bool Table, bool Compact>
+        //! A template function.
+        /*!
+            AVX-512を使って、原子iの相手の原子を8個ずつ処理して、原子に働く力を計算する（計算する量はargs.flagsで選ぶ）
+            \tparam Newton 作用・反作用の法則を使って、相手の原子jにも力を書き込むかどうか
+            \tparam Table Lennard-Jonesポテンシャルの式の代わりに、2体ポテンシャルの数表を使うかどうか
+            \tparam Compact 圧縮したペアリスト（相手の原子のインデックスを、区間の基準からの16ビットの差で表したもの）を使うかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（加算される）
+            \param virial ビリアル（加算される）
+        */
+        static void calc_force_avx512_flags(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            switch (args.flags) {
+            case ComputeFlags::FORCE:
+                calc_force_avx512_impl<Newton, false, false, Table, Compact>(args, up, virial);
+                break;
+
+            case ComputeFlags::ENERGY:
+                calc_force_avx512_impl<Newton, true, false, Table, Compact>(args, up, virial);
+                break;
+
+            case ComputeFlags::VIRIAL:
+                calc_force_avx512_impl<Newton, false, true, Table, Compact>(args, up, virial);
+                break;
+
+            default:
+                calc_force_avx512_impl<Newton, true, true, Table, Compact>(args, up, virial);
+                break;
+            }
+        }
+
+        template <bool Compact>
+        //! A template function.
+        /*!
+            AVX-512を使って、原子iの相手の原子を8個ずつ処理して、原子に働く力を計算する（数表と作用・反作用の法則を使うかどうかはargsで選ぶ）
+            \tparam Compact 圧縮したペアリストを使うかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（加算される）
+            \param virial ビリアル（加算される）
+        */
+        static void calc_force_avx512_list(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            if (args.table) {
+                if (args.newton) {
+                    calc_force_avx512_flags<true, true, Compact>(args, up, virial);
+                }
+                else {
+                    calc_force_avx512_flags<false, true, Compact>(args, up, virial);
+                }
+            }
+            else if (args.newton) {
+                calc_force_avx512_flags<true, false, Compact>(args, up, virial);
+            }
+            else {
+                calc_force_avx512_flags<false, false, Compact>(args, up, virial);
+            }
+        }
+
+        void calc_force_avx512(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            if (args.jdelta) {
+                calc_force_avx512_list<true>(args, up, virial);
+            }
+            else {
+                calc_force_avx512_list<false>(args, up, virial);
+            }
+        }
+
+        template <bool Energy, bool Virial>
+        //! A template function.
+        /*!
+            AVX-512を使って、i側の原子2個と相手のクラスタの原子4個の組を一度に処理して、クラスタペアリストを使って原子に働く力を計算する
+            \tparam Energy ポテンシャルエネルギーを計算するかどうか
+            \tparam Virial ビリアルを計算するかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（Energyがtrueのときだけ加算される）
+            \param virial ビリアル（Virialがtrueのときだけ加算される）
+        */
+        static void calc_cluster_force_avx512_impl(ClusterKernelArgs const & args, double & up, double & virial)
+        {
+            auto const vrc2 = _mm512_set1_pd(args.rc2);
+            auto const vvrc = _mm512_set1_pd(args.vrc);
+            auto const vone = _mm512_set1_pd(1.0);
+            auto const v4 = _mm512_set1_pd(4.0);
+            auto const v24 = _mm512_set1_pd(24.0);
+            auto const v48 = _mm512_set1_pd(48.0);
+
+            auto vup = _mm512_setzero_pd();
+            auto vvirial = _mm512_setzero_pd();
+
+            for (auto ic = args.ibegin; ic < args.iend; ic++) {
+                // i側の原子2個（下位4レーンと上位4レーン）をまとめて1本のレジスタに入れておく
+                __m512d xi[2], yi[2], zi[2];
+                __m512d vfxi[2], vfyi[2], vfzi[2];
+                for (auto h = 0; h < 2; h++) {
+                    auto const i = ic * 4 + h * 2;
+                    xi[h] = _mm512_insertf64x4(_mm512_set1_pd(args.x[i]), _mm256_set1_pd(args.x[i + 1]), 1);
+                    yi[h] = _mm512_insertf64x4(_mm512_set1_pd(args.y[i]), _mm256_set1_pd(args.y[i + 1]), 1);
+                    zi[h] = _mm512_insertf64x4(_mm512_set1_pd(args.z[i]), _mm256_set1_pd(args.z[i + 1]), 1);
+                    vfxi[h] = vfyi[h] = vfzi[h] = _mm512_setzero_pd();
+                }
+
+                for (auto k = args.offsets[ic]; k < args.offsets[ic + 1]; k++) {
+                    auto const jc = args.jcluster[k];
+                    auto const mask = args.mask[k];
+
+                    // 相手のクラスタの像の位置（クラスタペアごとに1つなので、原子の組ごとの補正は要らない）
+                    auto const s = args.shift[k];
+                    auto const shiftx = static_cast<double>((s & 3) - 1) * args.periodiclen;
+                    auto const shifty = static_cast<double>((s >> 2 & 3) - 1) * args.periodiclen;
+                    auto const shiftz = static_cast<double>((s >> 4 & 3) - 1) * args.periodiclen;
+
+                    auto const j = jc * 4;
+                    auto const xj = _mm512_add_pd(_mm512_broadcast_f64x4(_mm256_load_pd(args.x + j)), _mm512_set1_pd(shiftx));
+                    auto const yj = _mm512_add_pd(_mm512_broadcast_f64x4(_mm256_load_pd(args.y + j)), _mm512_set1_pd(shifty));
+                    auto const zj = _mm512_add_pd(_mm512_broadcast_f64x4(_mm256_load_pd(args.z + j)), _mm512_set1_pd(shiftz));
+
+                    auto vfxj = _mm512_setzero_pd();
+                    auto vfyj = _mm512_setzero_pd();
+                    auto vfzj = _mm512_setzero_pd();
+
+                    for (auto h = 0; h < 2; h++) {
+                        // ビットマスクの8ビットが、そのままi側の原子2個と相手のクラスタの原子4個の組のレーンマスクになる
+                        auto const lanes = static_cast<__mmask8>(mask >> (h * 8));
+                        if (!lanes) {
+                            continue;
+                        }
+
+                        auto const dx = _mm512_sub_pd(xj, xi[h]);
+                        auto const dy = _mm512_sub_pd(yj, yi[h]);
+                        auto const dz = _mm512_sub_pd(zj, zi[h]);
+
+                        auto const r2 = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy)), _mm512_mul_pd(dz, dz));
+                        auto const m = _mm512_mask_cmp_pd_mask(lanes, r2, vrc2, _CMP_LE_OQ);
+
+                        if (!m) {
+                            continue;
+                        }
+
+                        auto const r2i = _mm512_maskz_div_pd(m, vone, r2);
+                        auto const r6i = _mm512_mul_pd(_mm512_mul_pd(r2i, r2i), r2i);
+                        auto const dfdr = _mm512_mul_pd(_mm512_sub_pd(_mm512_mul_pd(v24, r6i), _mm512_mul_pd(v48, _mm512_mul_pd(r6i, r6i))), r2i);
+
+                        if (Energy) {
+                            auto const e = _mm512_add_pd(_mm512_mul_pd(v4, _mm512_sub_pd(_mm512_mul_pd(r6i, r6i), r6i)), vvrc);
+                            vup = _mm512_mask_add_pd(vup, m, vup, e);
+                        }
+
+                        if (Virial) {
+                            vvirial = _mm512_add_pd(vvirial, _mm512_mul_pd(r2, dfdr));
+                        }
+
+                        auto const tx = _mm512_mul_pd(dfdr, dx);
+                        auto const ty = _mm512_mul_pd(dfdr, dy);
+                        auto const tz = _mm512_mul_pd(dfdr, dz);
+
+                        vfxi[h] = _mm512_add_pd(vfxi[h], tx);
+                        vfyi[h] = _mm512_add_pd(vfyi[h], ty);
+                        vfzi[h] = _mm512_add_pd(vfzi[h], tz);
+                        vfxj = _mm512_add_pd(vfxj, tx);
+                        vfyj = _mm512_add_pd(vfyj, ty);
+                        vfzj = _mm512_add_pd(vfzj, tz);
+                    }
+
+                    // 下位4レーンと上位4レーンを足して、相手のクラスタの原子4個にgatherやscatterなしで書き戻す
+                    auto const fxj = _mm256_add_pd(_mm512_castpd512_pd256(vfxj), _mm512_extractf64x4_pd(vfxj, 1));
+                    auto const fyj = _mm256_add_pd(_mm512_castpd512_pd256(vfyj), _mm512_extractf64x4_pd(vfyj, 1));
+                    auto const fzj = _mm256_add_pd(_mm512_castpd512_pd256(vfzj), _mm512_extractf64x4_pd(vfzj, 1));
+                    _mm256_store_pd(args.fx + j, _mm256_sub_pd(_mm256_load_pd(args.fx + j), fxj));
+                    _mm256_store_pd(args.fy + j, _mm256_sub_pd(_mm256_load_pd(args.fy + j), fyj));
+                    _mm256_store_pd(args.fz + j, _mm256_sub_pd(_mm256_load_pd(args.fz + j), fzj));
+                }
+
+                for (auto h = 0; h < 2; h++) {
+                    auto const i = ic * 4 + h * 2;
+                    args.fx[i] += _mm512_mask_reduce_add_pd(0x0F, vfxi[h]);
+                    args.fy[i] += _mm512_mask_reduce_add_pd(0x0F, vfyi[h]);
+                    args.fz[i] += _mm512_mask_reduce_add_pd(0x0F, vfzi[h]);
+                    args.fx[i + 1] += _mm512_mask_reduce_add_pd(0xF0, vfxi[h]);
+                    args.fy[i + 1] += _mm512_mask_reduce_add_pd(0xF0, vfyi[h]);
+                    args.fz[i + 1] += _mm512_mask_reduce_add_pd(0xF0, vfzi[h]);
+                }
+            }
+
+            if (Energy) {
+                up += _mm512_reduce_add_pd(vup);
+            }
+
+            if (Virial) {
+                virial += _mm512_reduce_add_pd(vvirial);
+            }
+        }
+
+        void calc_cluster_force_avx512(ClusterKernelArgs const & args, double & up, double & virial)
+        {
+            switch (args.flags) {
+            case ComputeFlags::FORCE:
+                calc_cluster_force_avx512_impl<false, false>(args, up, virial);
+                break;
+
+            case ComputeFlags::ENERGY:
+                calc_cluster_force_avx512_impl<true, false>(args, up, virial);
+                break;
+
+            case ComputeFlags::VIRIAL:
+                calc_cluster_force_avx512_impl<false, true>(args, up, virial);
+                break;
+
+            default:
+                calc_cluster_force_avx512_impl<true, true>(args, up, virial);
+                break;
+            }
+        }
+
+        template <bool Energy, bool Virial>
+        //! A template function.
+        /*!
+            AVX-512を使って、クラスタペアの原子4×4個の組をfloatで一度に処理し、力とエネルギーの和をdoubleで計算して、クラスタペアリストを使って原子に働く力を計算する
+            \tparam Energy ポテンシャルエネルギーを計算するかどうか
+            \tparam Virial ビリアルを計算するかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（Energyがtrueのときだけ加算される）
+            \param virial ビリアル（Virialがtrueのときだけ加算される）
+        */
+        static void calc_cluster_force_mixed_avx512_impl(ClusterKernelArgs const & args, double & up, double & virial)
+        {
+            auto const vrc2 = _mm512_set1_ps(static_cast<float>(args.rc2));
+            auto const vvrc = _mm512_set1_ps(static_cast<float>(args.vrc));
+            auto const vone = _mm512_set1_ps(1.0f);
+            auto const v4 = _mm512_set1_ps(4.0f);
+            auto const v24 = _mm512_set1_ps(24.0f);
+            auto const v48 = _mm512_set1_ps(48.0f);
+
+            // レーン(li * 4 + lj)にi側のli番目の原子を並べる（ビットマスクのビットの並びと同じ）
+            auto const spread = _mm512_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3);
+
+            // liごとの和が入ったレーン0、4、8、12を、先頭に集める
+            auto const gather = _mm512_setr_epi32(0, 4, 8, 12, 0, 4, 8, 12, 0, 4, 8, 12, 0, 4, 8, 12);
+
+            auto vup = _mm512_setzero_pd();
+            auto vvirial = _mm512_setzero_pd();
+
+            for (auto ic = args.ibegin; ic < args.iend; ic++) {
+                auto const i = ic * 4;
+                auto const xi = _mm512_permutexvar_ps(spread, _mm512_castps128_ps512(_mm_load_ps(args.xf + i)));
+                auto const yi = _mm512_permutexvar_ps(spread, _mm512_castps128_ps512(_mm_load_ps(args.yf + i)));
+                auto const zi = _mm512_permutexvar_ps(spread, _mm512_castps128_ps512(_mm_load_ps(args.zf + i)));
+
+                // クラスタiの原子に働く力は、doubleのレジスタに溜めておいて行の最後にまとめて書き込む
+                auto vfxi = _mm256_setzero_pd();
+                auto vfyi = _mm256_setzero_pd();
+                auto vfzi = _mm256_setzero_pd();
+
+                for (auto k = args.offsets[ic]; k < args.offsets[ic + 1]; k++) {
+                    auto const jc = args.jcluster[k];
+
+                    // 座標は番地の原点からの相対座標なので、相手のクラスタの像の番地の原点を足せば差が求まる
+                    auto const j = jc * 4;
+                    auto const xj = _mm512_broadcast_f32x4(_mm_add_ps(_mm_load_ps(args.xf + j), _mm_set1_ps(args.joriginx[k])));
+                    auto const yj = _mm512_broadcast_f32x4(_mm_add_ps(_mm_load_ps(args.yf + j), _mm_set1_ps(args.joriginy[k])));
+                    auto const zj = _mm512_broadcast_f32x4(_mm_add_ps(_mm_load_ps(args.zf + j), _mm_set1_ps(args.joriginz[k])));
+
+                    auto const dx = _mm512_sub_ps(xj, xi);
+                    auto const dy = _mm512_sub_ps(yj, yi);
+                    auto const dz = _mm512_sub_ps(zj, zi);
+
+                    auto const r2 = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+
+                    // クラスタペアのビットマスクは、そのままレーンのマスクとして使える
+                    auto const m = _mm512_mask_cmp_ps_mask(static_cast<__mmask16>(args.mask[k]), r2, vrc2, _CMP_LE_OQ);
+
+                    if (!m) {
+                        continue;
+                    }
+
+                    auto const r2i = _mm512_maskz_div_ps(m, vone, r2);
+                    auto const r6i = _mm512_mul_ps(_mm512_mul_ps(r2i, r2i), r2i);
+                    auto const dfdr = _mm512_mul_ps(_mm512_sub_ps(_mm512_mul_ps(v24, r6i), _mm512_mul_ps(v48, _mm512_mul_ps(r6i, r6i))), r2i);
+
+                    if (Energy) {
+                        auto const e = _mm512_maskz_add_ps(m, _mm512_mul_ps(v4, _mm512_sub_ps(_mm512_mul_ps(r6i, r6i), r6i)), vvrc);
+                        vup = _mm512_add_pd(vup, _mm512_add_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(e)), _mm512_cvtps_pd(upper_half(e))));
+                    }
+
+                    if (Virial) {
+                        auto const w = _mm512_mul_ps(r2, dfdr);
+                        vvirial = _mm512_add_pd(vvirial, _mm512_add_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(w)), _mm512_cvtps_pd(upper_half(w))));
+                    }
+
+                    auto const tx = _mm512_mul_ps(dfdr, dx);
+                    auto const ty = _mm512_mul_ps(dfdr, dy);
+                    auto const tz = _mm512_mul_ps(dfdr, dz);
+
+                    // 相手のクラスタの原子に働く力（i側の4個の和）は、doubleに直して書き戻す
+                    _mm256_store_pd(args.fx + j, _mm256_sub_pd(_mm256_load_pd(args.fx + j), _mm256_cvtps_pd(sum_columns(tx))));
+                    _mm256_store_pd(args.fy + j, _mm256_sub_pd(_mm256_load_pd(args.fy + j), _mm256_cvtps_pd(sum_columns(ty))));
+                    _mm256_store_pd(args.fz + j, _mm256_sub_pd(_mm256_load_pd(args.fz + j), _mm256_cvtps_pd(sum_columns(tz))));
+
+                    // クラスタiの原子に働く力（j側の4個の和）は、[li = 0, 1, 2, 3]に並べてからdoubleで溜める
+                    vfxi = _mm256_add_pd(vfxi, _mm256_cvtps_pd(_mm512_castps512_ps128(_mm512_permutexvar_ps(gather, sum_rows(tx)))));
+                    vfyi = _mm256_add_pd(vfyi, _mm256_cvtps_pd(_mm512_castps512_ps128(_mm512_permutexvar_ps(gather, sum_rows(ty)))));
+                    vfzi = _mm256_add_pd(vfzi, _mm256_cvtps_pd(_mm512_castps512_ps128(_mm512_permutexvar_ps(gather, sum_rows(tz)))));
+                }
+
+                _mm256_store_pd(args.fx + i, _mm256_add_pd(_mm256_load_pd(args.fx + i), vfxi));
+                _mm256_store_pd(args.fy + i, _mm256_add_pd(_mm256_load_pd(args.fy + i), vfyi));
+                _mm256_store_pd(args.fz + i, _mm256_add_pd(_mm256_load_pd(args.fz + i), vfzi));
+            }
+
+            if (Energy) {
+                up += _mm512_reduce_add_pd(vup);
+            }
+
+            if (Virial) {
+                virial += _mm512_reduce_add_pd(vvirial);
+            }
+        }
+
+        void calc_cluster_force_mixed_avx512(ClusterKernelArgs const & args, double & up, double & virial)
+        {
+            switch (args.flags) {
+            case ComputeFlags::FORCE:
+                calc_cluster_force_mixed_avx512_impl<false, false>(args, up, virial);
+                break;
+
+            case ComputeFlags::ENERGY:
+                calc_cluster_force_mixed_avx512_impl<true, false>(args, up, virial);
+                break;
+
+            case ComputeFlags::VIRIAL:
+                calc_cluster_force_mixed_avx512_impl<false, true>(args, up, virial);
+                break;
+
+            default:
+                calc_cluster_force_mixed_avx512_impl<true, true>(args, up, virial);
+                break;
+            }
+        }
+
+        std::int32_t filter_pairs_avx512(PairFilterArgs const & args, std::int32_t * out)
+        {
+            auto const xi = _mm512_set1_pd(args.xi);
+            auto const yi = _mm512_set1_pd(args.yi);
+            auto const zi = _mm512_set1_pd(args.zi);
+            auto const shiftx = _mm512_set1_pd(args.shiftx);
+            auto const shifty = _mm512_set1_pd(args.shifty);
+            auto const shiftz = _mm512_set1_pd(args.shiftz);
+            auto const ml2 = _mm512_set1_pd(args.ml2);
+
+            auto c = 0;
+            for (auto k = 0; k < args.n; k += 16) {
+                // 端数のときは、候補の数を超えるレーンを読まない
+                auto const rest = args.n - k;
+                auto const lanes = rest >= 16 ? static_cast<__mmask16>(0xFFFF) : static_cast<__mmask16>((1U << rest) - 1U);
+                auto const vj = _mm512_maskz_loadu_epi32(lanes, args.candidates + k);
+
+                // 8個ずつ2回に分けて距離の2乗を求め、比較結果のマスクを16ビットにまとめる
+                __mmask16 mask = 0;
+                for (auto h = 0; h < 2; h++) {
+                    auto const half = static_cast<__mmask8>(lanes >> (8 * h));
+                    auto const vjh = h == 0 ? _mm512_castsi512_si256(vj) : _mm512_extracti64x4_epi64(vj, 1);
+
+                    auto const dx = _mm512_add_pd(_mm512_sub_pd(_mm512_mask_i32gather_pd(_mm512_setzero_pd(), half, vjh, args.rx, 8), xi), shiftx);
+                    auto const dy = _mm512_add_pd(_mm512_sub_pd(_mm512_mask_i32gather_pd(_mm512_setzero_pd(), half, vjh, args.ry, 8), yi), shifty);
+                    auto const dz = _mm512_add_pd(_mm512_sub_pd(_mm512_mask_i32gather_pd(_mm512_setzero_pd(), half, vjh, args.rz, 8), zi), shiftz);
+                    auto const r2 = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy)), _mm512_mul_pd(dz, dz));
+
+                    mask |= static_cast<__mmask16>(_mm512_mask_cmp_pd_mask(half, r2, ml2, _CMP_LE_OQ)) << (8 * h);
+                }
+
+                // 残すインデックスだけを前に詰めて書き込む
+                _mm512_mask_compressstoreu_epi32(out + c, mask, vj);
+                c += _mm_popcnt_u32(mask);
+            }
+
+            return c;
+        }
+
+        std::int32_t prune_pairs_avx512(PairPruneArgs const & args, std::int32_t * jout, std::uint8_t * shiftout)
+        {
+            auto const xi = _mm512_set1_pd(args.xi);
+            auto const yi = _mm512_set1_pd(args.yi);
+            auto const zi = _mm512_set1_pd(args.zi);
+            auto const vl = _mm512_set1_pd(args.periodiclen);
+            auto const rl2 = _mm512_set1_pd(args.rl2);
+            auto const v1i = _mm256_set1_epi32(1);
+            auto const v3i = _mm256_set1_epi32(3);
+
+            auto c = 0;
+            for (auto k = 0; k < args.n; k += 8) {
+                // 行の端数のレーンはマスクで無効にする
+                auto const n = args.n - k;
+                auto const lanes = static_cast<__mmask8>(n >= 8 ? 0xFF : (1 << n) - 1);
+                auto const vj = _mm512_castsi512_si256(_mm512_maskz_loadu_epi32(lanes, args.jindex + k));
+
+                // 周期的境界条件の補正は、ペアリストに記録した相手の原子の像の番号から求める
+                // （shiftは末尾に余分な要素があるので、行の端数でも8個まとめて読み込める）
+                auto const vs = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(args.shift + k)));
+                auto const dx = _mm512_add_pd(_mm512_sub_pd(_mm512_mask_i32gather_pd(_mm512_setzero_pd(), lanes, vj, args.rx, 8), xi),
+                    _mm512_mul_pd(_mm512_cvtepi32_pd(_mm256_sub_epi32(_mm256_and_si256(vs, v3i), v1i)), vl));
+                auto const dy = _mm512_add_pd(_mm512_sub_pd(_mm512_mask_i32gather_pd(_mm512_setzero_pd(), lanes, vj, args.ry, 8), yi),
+                    _mm512_mul_pd(_mm512_cvtepi32_pd(_mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(vs, 2), v3i), v1i)), vl));
+                auto const dz = _mm512_add_pd(_mm512_sub_pd(_mm512_mask_i32gather_pd(_mm512_setzero_pd(), lanes, vj, args.rz, 8), zi),
+                    _mm512_mul_pd(_mm512_cvtepi32_pd(_mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(vs, 4), v3i), v1i)), vl));
+                auto const r2 = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy)), _mm512_mul_pd(dz, dz));
+                auto const mask = _mm512_mask_cmp_pd_mask(lanes, r2, rl2, _CMP_LE_OQ);
+                auto const kept = static_cast<std::int32_t>(_mm_popcnt_u32(mask));
+
+                // 残す組のインデックスは圧縮ストアで、像の番号は前に詰めてから8ビットに縮めて、残す数だけ書き込む
+                _mm512_mask_compressstoreu_epi32(jout + c, mask, _mm512_castsi256_si512(vj));
+                _mm512_mask_cvtepi32_storeu_epi8(shiftout + c, static_cast<__mmask16>((1 << kept) - 1), _mm512_maskz_compress_epi32(mask, _mm512_castsi256_si512(vs)));
+                c += kept;
+            }
+
+            return c;
+        }
+    }
+}
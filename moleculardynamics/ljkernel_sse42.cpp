@@ -0,0 +1,653 @@
+﻿/*! \file ljkernel_sse42.cpp
+    \brief Lennard-Jonesポテンシャルの力を計算するカーネル関数の実装（SSE4.2版）
+
+    Copyright ©  2017 @dc1394 All Rights Reserved.
+    This software is released under the BSD 2-Clause License.
+*/
+
+#include "ljkernel.h"
+#include <nmmintrin.h>      // for SSE4.2 intrinsics
+
+namespace moleculardynamics {
+    namespace ljkernel {
+        //! A function.
+        /*!
+            2個のレーンの数表の係数を並べ替えて、3次式c0 + x * (c1 + x * (c2 + x * c3))を計算する
+            \param p0 1レーン目の区間の係数c0～c3へのポインタ
+            \param p1 2レーン目の区間の係数c0～c3へのポインタ
+            \param x 区間の中の位置
+            \return 3次式の値
+        */
+        static inline __m128d horner(double const * p0, double const * p1, __m128d x)
+        {
+            auto const a01 = _mm_load_pd(p0);
+            auto const a23 = _mm_load_pd(p0 + 2);
+            auto const b01 = _mm_load_pd(p1);
+            auto const b23 = _mm_load_pd(p1 + 2);
+
+            auto const c0 = _mm_unpacklo_pd(a01, b01);
+            auto const c1 = _mm_unpackhi_pd(a01, b01);
+            auto const c2 = _mm_unpacklo_pd(a23, b23);
+            auto const c3 = _mm_unpackhi_pd(a23, b23);
+
+            return _mm_add_pd(c0, _mm_mul_pd(x, _mm_add_pd(c1, _mm_mul_pd(x, _mm_add_pd(c2, _mm_mul_pd(x, c3))))));
+        }
+
+        template <bool Newton, bool Energy, bool Virial, bool Table, bool Compact>
+        //! A template function.
+        /*!
+            SSE4.2を使って、原子iの相手の原子を2個ずつ処理して、原子に働く力を計算する
+            \tparam Newton 作用・反作用の法則を使って、相手の原子jにも力を書き込むかどうか
+            \tparam Energy ポテンシャルエネルギーを計算するかどうか
+            \tparam Virial ビリアルを計算するかどうか
+            \tparam Table Lennard-Jonesポテンシャルの式の代わりに、2体ポテンシャルの数表を使うかどうか
+            \tparam Compact 圧縮したペアリスト（相手の原子のインデックスを、区間の基準からの16ビットの差で表したもの）を使うかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（Energyがtrueのときだけ加算される）
+            \param virial ビリアル（Virialがtrueのときだけ加算される）
+        */
+        static void calc_force_sse42_impl(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            auto const vl = _mm_set1_pd(args.periodiclen);
+            auto const v1i = _mm_set1_epi32(1);
+            auto const v3i = _mm_set1_epi32(3);
+            auto const vrc2 = _mm_set1_pd(args.rc2);
+            auto const vvrc = _mm_set1_pd(args.vrc);
+            auto const vone = _mm_set1_pd(1.0);
+            auto const v4 = _mm_set1_pd(4.0);
+            auto const v24 = _mm_set1_pd(24.0);
+            auto const v48 = _mm_set1_pd(48.0);
+            auto const vr2min = _mm_set1_pd(args.tabler2min);
+            auto const vinvdr2 = _mm_set1_pd(args.tableinvdr2);
+            auto const vnmax = _mm_set1_epi32(args.tablesize - 1);
+
+            auto vup = _mm_setzero_pd();
+            auto vvirial = _mm_setzero_pd();
+
+            // 圧縮したペアリストでは、原子iの行を相手の原子のインデックスの基準ごとの区間に分けてあるので、区間を1つの行として扱う
+            auto const rbegin = Compact ? args.segoffsets[args.ibegin] : args.ibegin;
+            auto const rend = Compact ? args.segoffsets[args.iend] : args.iend;
+
+            for (auto r = rbegin; r < rend; r++) {
+                auto const i = Compact ? args.segatom[r] : r;
+                auto const base = Compact ? args.segbase[r] : 0;
+
+                auto const xi = _mm_set1_pd(args.rx[i]);
+                auto const yi = _mm_set1_pd(args.ry[i]);
+                auto const zi = _mm_set1_pd(args.rz[i]);
+
+                // 原子iに働く力は、レジスタに溜めておいて行の最後にまとめて書き込む
+                auto vfxi = _mm_setzero_pd();
+                auto vfyi = _mm_setzero_pd();
+                auto vfzi = _mm_setzero_pd();
+
+                auto const kend = args.offsets[r + 1];
+
+                for (auto k = args.offsets[r]; k < kend; k += 2) {
+                    // 行の端数は、2レーン目を1レーン目と同じ原子にして、マスクで無効にする
+                    auto const j0 = Compact ? base + args.jdelta[k] : args.jindex[k];
+                    auto const valid1 = k + 1 < kend;
+                    auto const j1 = valid1 ? (Compact ? base + args.jdelta[k + 1] : args.jindex[k + 1]) : j0;
+
+                    auto dx = _mm_sub_pd(_mm_set_pd(args.rx[j1], args.rx[j0]), xi);
+                    auto dy = _mm_sub_pd(_mm_set_pd(args.ry[j1], args.ry[j0]), yi);
+                    auto dz = _mm_sub_pd(_mm_set_pd(args.rz[j1], args.rz[j0]), zi);
+
+                    // 周期的境界条件の補正は、ペアリストに記録した相手の原子の像の番号から求める
+                    // （shiftは末尾に余分な要素があるので、行の端数でも2個まとめて読み込める）
+                    auto const vs = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(args.shift[k] | args.shift[k + 1] << 8));
+                    dx = _mm_add_pd(dx, _mm_mul_pd(_mm_cvtepi32_pd(_mm_sub_epi32(_mm_and_si128(vs, v3i), v1i)), vl));
+                    dy = _mm_add_pd(dy, _mm_mul_pd(_mm_cvtepi32_pd(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(vs, 2), v3i), v1i)), vl));
+                    dz = _mm_add_pd(dz, _mm_mul_pd(_mm_cvtepi32_pd(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(vs, 4), v3i), v1i)), vl));
+
+                    auto const r2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz));
+                    auto const lanes = _mm_castsi128_pd(_mm_set_epi64x(valid1 ? -1 : 0, -1));
+                    auto const mask = _mm_and_pd(_mm_cmple_pd(r2, vrc2), lanes);
+
+                    // 2ペアともカットオフの外なら何もしない
+                    if (!_mm_movemask_pd(mask)) {
+                        continue;
+                    }
+
+                    auto dfdr = _mm_setzero_pd();
+                    auto e = _mm_setzero_pd();
+
+                    if (Table) {
+                        // 数表の区間と区間の中の位置を求めて、2レーン分の係数を並べ替えてから3次式を計算する
+                        auto const t = _mm_mul_pd(_mm_sub_pd(r2, vr2min), vinvdr2);
+                        auto const n = _mm_min_epi32(_mm_max_epi32(_mm_cvttpd_epi32(t), _mm_setzero_si128()), vnmax);
+                        auto const x = _mm_sub_pd(t, _mm_cvtepi32_pd(n));
+                        auto const c0 = args.table + _mm_cvtsi128_si32(n) * TABLESTRIDE;
+                        auto const c1 = args.table + _mm_extract_epi32(n, 1) * TABLESTRIDE;
+
+                        dfdr = _mm_and_pd(mask, horner(c0, c1, x));
+                        if (Energy) {
+                            e = horner(c0 + 4, c1 + 4, x);
+                        }
+                    }
+                    else {
+                        auto const r2i = _mm_div_pd(vone, r2);
+                        auto const r6i = _mm_mul_pd(_mm_mul_pd(r2i, r2i), r2i);
+                        dfdr = _mm_blendv_pd(
+                            _mm_setzero_pd(),
+                            _mm_mul_pd(_mm_sub_pd(_mm_mul_pd(v24, r6i), _mm_mul_pd(v48, _mm_mul_pd(r6i, r6i))), r2i),
+                            mask);
+
+                        if (Energy) {
+                            e = _mm_add_pd(_mm_mul_pd(v4, _mm_sub_pd(_mm_mul_pd(r6i, r6i), r6i)), vvrc);
+                        }
+                    }
+
+                    if (Energy) {
+                        vup = _mm_add_pd(vup, _mm_and_pd(mask, e));
+                    }
+
+                    if (Virial) {
+                        vvirial = _mm_add_pd(vvirial, _mm_mul_pd(r2, dfdr));
+                    }
+
+                    auto const tx = _mm_mul_pd(dfdr, dx);
+                    auto const ty = _mm_mul_pd(dfdr, dy);
+                    auto const tz = _mm_mul_pd(dfdr, dz);
+
+                    vfxi = _mm_add_pd(vfxi, tx);
+                    vfyi = _mm_add_pd(vfyi, ty);
+                    vfzi = _mm_add_pd(vfzi, tz);
+
+                    if (Newton) {
+                        alignas(16) double sx[2], sy[2], sz[2];
+                        _mm_store_pd(sx, tx);
+                        _mm_store_pd(sy, ty);
+                        _mm_store_pd(sz, tz);
+
+                        args.fx[j0] -= sx[0];
+                        args.fy[j0] -= sy[0];
+                        args.fz[j0] -= sz[0];
+
+                        if (valid1) {
+                            args.fx[j1] -= sx[1];
+                            args.fy[j1] -= sy[1];
+                            args.fz[j1] -= sz[1];
+                        }
+                    }
+                }
+
+                alignas(16) double sum[2];
+                _mm_store_pd(sum, vfxi);
+                args.fx[i] += sum[0] + sum[1];
+                _mm_store_pd(sum, vfyi);
+                args.fy[i] += sum[0] + sum[1];
+                _mm_store_pd(sum, vfzi);
+                args.fz[i] += sum[0] + sum[1];
+            }
+
+            alignas(16) double sum[2];
+
+            if (Energy) {
+                _mm_store_pd(sum, vup);
+                up += sum[0] + sum[1];
+            }
+
+            if (Virial) {
+                _mm_store_pd(sum, vvirial);
+                virial += sum[0] + sum[1];
+            }
+        }
+
+        template <bool Newton, bool Table, bool Compact>
+        //! A template function.
+        /*!
+            SSE4.2を使って、原子iの相手の原子を2個ずつ処理して、原子に働く力を計算する（計算する量はargs.flagsで選ぶ）
+            \tparam Newton 作用・反作用の法則を使って、相手の原子jにも力を書き込むかどうか
+            \tparam Table Lennard-Jonesポテンシャルの式の代わりに、2体ポテンシャルの数表を使うかどうか
+            \tparam Compact 圧縮したペアリスト（相手の原子のインデックスを、区間の基準からの16ビットの差で表したもの）を使うかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（加算される）
+            \param virial ビリアル（加算される）
+        */
+        static void calc_force_sse42_flags(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            switch (args.flags) {
+            case ComputeFlags::FORCE:
+                calc_force_sse42_impl<Newton, false, false, Table, Compact>(args, up, virial);
+                break;
+
+            case ComputeFlags::ENERGY:
+                calc_force_sse42_impl<Newton, true, false, Table, Compact>(args, up, virial);
+                break;
+
+            case ComputeFlags::VIRIAL:
+                calc_force_sse42_impl<Newton, false, true, Table, Compact>(args, up, virial);
+                break;
+
+            default:
+                calc_force_sse42_impl<Newton, true, true, Table, Compact>(args, up, virial);
+                break;
+            }
+        }
+
+        template <bool Compact>
+        //! A template function.
+        /*!
+            SSE4.2を使って、原子iの相手の原子を2個ずつ処理して、原子に働く力を計算する（数表と作用・反作用の法則を使うかどうかはargsで選ぶ）
+            \tparam Compact 圧縮したペアリストを使うかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（加算される）
+            \param virial ビリアル（加算される）
+        */
+        static void calc_force_sse42_list(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            if (args.table) {
+                if (args.newton) {
+                    calc_force_sse42_flags<true, true, Compact>(args, up, virial);
+                }
+                else {
+                    calc_force_sse42_flags<false, true, Compact>(args, up, virial);
+                }
+            }
+            else if (args.newton) {
+                calc_force_sse42_flags<true, false, Compact>(args, up, virial);
+            }
+            else {
+                calc_force_sse42_flags<false, false, Compact>(args, up, virial);
+            }
+        }
+
+        void calc_force_sse42(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            if (args.jdelta) {
+                calc_force_sse42_list<true>(args, up, virial);
+            }
+            else {
+                calc_force_sse42_list<false>(args, up, virial);
+            }
+        }
+
+        template <bool Energy, bool Virial>
+        //! A template function.
+        /*!
+            SSE4.2を使って、相手のクラスタの原子を2個ずつ処理して、クラスタペアリストを使って原子に働く力を計算する
+            \tparam Energy ポテンシャルエネルギーを計算するかどうか
+            \tparam Virial ビリアルを計算するかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（Energyがtrueのときだけ加算される）
+            \param virial ビリアル（Virialがtrueのときだけ加算される）
+        */
+        static void calc_cluster_force_sse42_impl(ClusterKernelArgs const & args, double & up, double & virial)
+        {
+            auto const vrc2 = _mm_set1_pd(args.rc2);
+            auto const vvrc = _mm_set1_pd(args.vrc);
+            auto const vone = _mm_set1_pd(1.0);
+            auto const v4 = _mm_set1_pd(4.0);
+            auto const v24 = _mm_set1_pd(24.0);
+            auto const v48 = _mm_set1_pd(48.0);
+            auto const lanebit = _mm_set_epi64x(2, 1);
+
+            auto vup = _mm_setzero_pd();
+            auto vvirial = _mm_setzero_pd();
+
+            for (auto ic = args.ibegin; ic < args.iend; ic++) {
+                // クラスタiの原子に働く力は、レジスタに溜めておいて行の最後にまとめて書き込む
+                __m128d vfxi[4], vfyi[4], vfzi[4];
+                for (auto li = 0; li < 4; li++) {
+                    vfxi[li] = vfyi[li] = vfzi[li] = _mm_setzero_pd();
+                }
+
+                for (auto k = args.offsets[ic]; k < args.offsets[ic + 1]; k++) {
+                    auto const jc = args.jcluster[k];
+                    auto const mask = args.mask[k];
+
+                    // 相手のクラスタの像の位置（クラスタペアごとに1つなので、原子の組ごとの補正は要らない）
+                    auto const s = args.shift[k];
+                    auto const shiftx = static_cast<double>((s & 3) - 1) * args.periodiclen;
+                    auto const shifty = static_cast<double>((s >> 2 & 3) - 1) * args.periodiclen;
+                    auto const shiftz = static_cast<double>((s >> 4 & 3) - 1) * args.periodiclen;
+
+                    // 相手のクラスタの原子を、前半と後半の2個ずつ処理する
+                    for (auto h = 0; h < 2; h++) {
+                        auto const j = jc * 4 + h * 2;
+                        auto const xj = _mm_add_pd(_mm_load_pd(args.x + j), _mm_set1_pd(shiftx));
+                        auto const yj = _mm_add_pd(_mm_load_pd(args.y + j), _mm_set1_pd(shifty));
+                        auto const zj = _mm_add_pd(_mm_load_pd(args.z + j), _mm_set1_pd(shiftz));
+
+                        auto vfxj = _mm_setzero_pd();
+                        auto vfyj = _mm_setzero_pd();
+                        auto vfzj = _mm_setzero_pd();
+
+                        for (auto li = 0; li < 4; li++) {
+                            auto const bits = (mask >> (li * 4 + h * 2)) & 0x3;
+                            if (!bits) {
+                                continue;
+                            }
+
+                            auto const i = ic * 4 + li;
+                            auto const dx = _mm_sub_pd(xj, _mm_set1_pd(args.x[i]));
+                            auto const dy = _mm_sub_pd(yj, _mm_set1_pd(args.y[i]));
+                            auto const dz = _mm_sub_pd(zj, _mm_set1_pd(args.z[i]));
+
+                            auto const r2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz));
+
+                            // ビットマスクで無効な組（パディングや、同じクラスタ内の重複）は、ビット演算で0にする
+                            auto const lanes = _mm_castsi128_pd(
+                                _mm_cmpeq_epi64(_mm_and_si128(_mm_set1_epi64x(bits), lanebit), lanebit));
+                            auto const m = _mm_and_pd(_mm_cmple_pd(r2, vrc2), lanes);
+
+                            if (!_mm_movemask_pd(m)) {
+                                continue;
+                            }
+
+                            auto const r2i = _mm_div_pd(vone, r2);
+                            auto const r6i = _mm_mul_pd(_mm_mul_pd(r2i, r2i), r2i);
+                            auto const dfdr = _mm_and_pd(
+                                m,
+                                _mm_mul_pd(_mm_sub_pd(_mm_mul_pd(v24, r6i), _mm_mul_pd(v48, _mm_mul_pd(r6i, r6i))), r2i));
+
+                            if (Energy) {
+                                auto const e = _mm_add_pd(_mm_mul_pd(v4, _mm_sub_pd(_mm_mul_pd(r6i, r6i), r6i)), vvrc);
+                                vup = _mm_add_pd(vup, _mm_and_pd(m, e));
+                            }
+
+                            if (Virial) {
+                                vvirial = _mm_add_pd(vvirial, _mm_mul_pd(r2, dfdr));
+                            }
+
+                            auto const tx = _mm_mul_pd(dfdr, dx);
+                            auto const ty = _mm_mul_pd(dfdr, dy);
+                            auto const tz = _mm_mul_pd(dfdr, dz);
+
+                            vfxi[li] = _mm_add_pd(vfxi[li], tx);
+                            vfyi[li] = _mm_add_pd(vfyi[li], ty);
+                            vfzi[li] = _mm_add_pd(vfzi[li], tz);
+                            vfxj = _mm_add_pd(vfxj, tx);
+                            vfyj = _mm_add_pd(vfyj, ty);
+                            vfzj = _mm_add_pd(vfzj, tz);
+                        }
+
+                        // 相手のクラスタの原子は連続しているので、gatherやscatterなしで書き戻せる
+                        _mm_store_pd(args.fx + j, _mm_sub_pd(_mm_load_pd(args.fx + j), vfxj));
+                        _mm_store_pd(args.fy + j, _mm_sub_pd(_mm_load_pd(args.fy + j), vfyj));
+                        _mm_store_pd(args.fz + j, _mm_sub_pd(_mm_load_pd(args.fz + j), vfzj));
+                    }
+                }
+
+                for (auto li = 0; li < 4; li++) {
+                    alignas(16) double sum[2];
+                    _mm_store_pd(sum, vfxi[li]);
+                    args.fx[ic * 4 + li] += sum[0] + sum[1];
+                    _mm_store_pd(sum, vfyi[li]);
+                    args.fy[ic * 4 + li] += sum[0] + sum[1];
+                    _mm_store_pd(sum, vfzi[li]);
+                    args.fz[ic * 4 + li] += sum[0] + sum[1];
+                }
+            }
+
+            alignas(16) double sum[2];
+
+            if (Energy) {
+                _mm_store_pd(sum, vup);
+                up += sum[0] + sum[1];
+            }
+
+            if (Virial) {
+                _mm_store_pd(sum, vvirial);
+                virial += sum[0] + sum[1];
+            }
+        }
+
+        void calc_cluster_force_sse42(ClusterKernelArgs const & args, double & up, double & virial)
+        {
+            switch (args.flags) {
+            case ComputeFlags::FORCE:
+                calc_cluster_force_sse42_impl<false, false>(args, up, virial);
+                break;
+
+            case ComputeFlags::ENERGY:
+                calc_cluster_force_sse42_impl<true, false>(args, up, virial);
+                break;
+
+            case ComputeFlags::VIRIAL:
+                calc_cluster_force_sse42_impl<false, true>(args, up, virial);
+                break;
+
+            default:
+                calc_cluster_force_sse42_impl<true, true>(args, up, virial);
+                break;
+            }
+        }
+
+        template <bool Energy, bool Virial>
+        //! A template function.
+        /*!
+            SSE4.2を使って、相手のクラスタの原子4個をfloatで一度に処理し、力とエネルギーの和をdoubleで計算して、クラスタペアリストを使って原子に働く力を計算する
+            \tparam Energy ポテンシャルエネルギーを計算するかどうか
+            \tparam Virial ビリアルを計算するかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（Energyがtrueのときだけ加算される）
+            \param virial ビリアル（Virialがtrueのときだけ加算される）
+        */
+        static void calc_cluster_force_mixed_sse42_impl(ClusterKernelArgs const & args, double & up, double & virial)
+        {
+            auto const vrc2 = _mm_set1_ps(static_cast<float>(args.rc2));
+            auto const vvrc = _mm_set1_ps(static_cast<float>(args.vrc));
+            auto const vone = _mm_set1_ps(1.0f);
+            auto const v4 = _mm_set1_ps(4.0f);
+            auto const v24 = _mm_set1_ps(24.0f);
+            auto const v48 = _mm_set1_ps(48.0f);
+            auto const lanebit = _mm_setr_epi32(1, 2, 4, 8);
+
+            auto vup = _mm_setzero_pd();
+            auto vvirial = _mm_setzero_pd();
+
+            for (auto ic = args.ibegin; ic < args.iend; ic++) {
+                // クラスタiの原子に働く力は、doubleのレジスタに溜めておいて行の最後にまとめて書き込む
+                auto vfxi01 = _mm_setzero_pd(), vfxi23 = _mm_setzero_pd();
+                auto vfyi01 = _mm_setzero_pd(), vfyi23 = _mm_setzero_pd();
+                auto vfzi01 = _mm_setzero_pd(), vfzi23 = _mm_setzero_pd();
+
+                for (auto k = args.offsets[ic]; k < args.offsets[ic + 1]; k++) {
+                    auto const jc = args.jcluster[k];
+                    auto const mask = args.mask[k];
+
+                    // 座標は番地の原点からの相対座標なので、相手のクラスタの像の番地の原点を足せば差が求まる
+                    auto const j = jc * 4;
+                    auto const xj = _mm_add_ps(_mm_load_ps(args.xf + j), _mm_set1_ps(args.joriginx[k]));
+                    auto const yj = _mm_add_ps(_mm_load_ps(args.yf + j), _mm_set1_ps(args.joriginy[k]));
+                    auto const zj = _mm_add_ps(_mm_load_ps(args.zf + j), _mm_set1_ps(args.joriginz[k]));
+
+                    __m128 tx[4], ty[4], tz[4];
+
+                    for (auto li = 0; li < 4; li++) {
+                        tx[li] = ty[li] = tz[li] = _mm_setzero_ps();
+
+                        auto const bits = (mask >> (li * 4)) & 0xF;
+                        if (!bits) {
+                            continue;
+                        }
+
+                        auto const i = ic * 4 + li;
+                        auto const dx = _mm_sub_ps(xj, _mm_set1_ps(args.xf[i]));
+                        auto const dy = _mm_sub_ps(yj, _mm_set1_ps(args.yf[i]));
+                        auto const dz = _mm_sub_ps(zj, _mm_set1_ps(args.zf[i]));
+
+                        auto const r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+                        // ビットマスクで無効な組（パディングや、同じクラスタ内の重複）は、ビット演算で0にする
+                        auto const lanes = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(bits), lanebit), lanebit));
+                        auto const m = _mm_and_ps(_mm_cmple_ps(r2, vrc2), lanes);
+
+                        if (!_mm_movemask_ps(m)) {
+                            continue;
+                        }
+
+                        auto const r2i = _mm_div_ps(vone, r2);
+                        auto const r6i = _mm_mul_ps(_mm_mul_ps(r2i, r2i), r2i);
+                        auto const dfdr = _mm_and_ps(
+                            m,
+                            _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(v24, r6i), _mm_mul_ps(v48, _mm_mul_ps(r6i, r6i))), r2i));
+
+                        if (Energy) {
+                            auto const e = _mm_and_ps(m, _mm_add_ps(_mm_mul_ps(v4, _mm_sub_ps(_mm_mul_ps(r6i, r6i), r6i)), vvrc));
+                            vup = _mm_add_pd(vup, _mm_add_pd(_mm_cvtps_pd(e), _mm_cvtps_pd(_mm_movehl_ps(e, e))));
+                        }
+
+                        if (Virial) {
+                            auto const w = _mm_mul_ps(r2, dfdr);
+                            vvirial = _mm_add_pd(vvirial, _mm_add_pd(_mm_cvtps_pd(w), _mm_cvtps_pd(_mm_movehl_ps(w, w))));
+                        }
+
+                        tx[li] = _mm_mul_ps(dfdr, dx);
+                        ty[li] = _mm_mul_ps(dfdr, dy);
+                        tz[li] = _mm_mul_ps(dfdr, dz);
+                    }
+
+                    // 相手のクラスタの原子に働く力（i側の4個の和）は、doubleに直して書き戻す
+                    auto const fxj = _mm_add_ps(_mm_add_ps(tx[0], tx[1]), _mm_add_ps(tx[2], tx[3]));
+                    auto const fyj = _mm_add_ps(_mm_add_ps(ty[0], ty[1]), _mm_add_ps(ty[2], ty[3]));
+                    auto const fzj = _mm_add_ps(_mm_add_ps(tz[0], tz[1]), _mm_add_ps(tz[2], tz[3]));
+                    _mm_store_pd(args.fx + j, _mm_sub_pd(_mm_load_pd(args.fx + j), _mm_cvtps_pd(fxj)));
+                    _mm_store_pd(args.fx + j + 2, _mm_sub_pd(_mm_load_pd(args.fx + j + 2), _mm_cvtps_pd(_mm_movehl_ps(fxj, fxj))));
+                    _mm_store_pd(args.fy + j, _mm_sub_pd(_mm_load_pd(args.fy + j), _mm_cvtps_pd(fyj)));
+                    _mm_store_pd(args.fy + j + 2, _mm_sub_pd(_mm_load_pd(args.fy + j + 2), _mm_cvtps_pd(_mm_movehl_ps(fyj, fyj))));
+                    _mm_store_pd(args.fz + j, _mm_sub_pd(_mm_load_pd(args.fz + j), _mm_cvtps_pd(fzj)));
+                    _mm_store_pd(args.fz + j + 2, _mm_sub_pd(_mm_load_pd(args.fz + j + 2), _mm_cvtps_pd(_mm_movehl_ps(fzj, fzj))));
+
+                    // クラスタiの原子に働く力（j側の4個の和）は、水平加算で[li = 0, 1, 2, 3]に並べてからdoubleで溜める
+                    auto const fxi = _mm_hadd_ps(_mm_hadd_ps(tx[0], tx[1]), _mm_hadd_ps(tx[2], tx[3]));
+                    auto const fyi = _mm_hadd_ps(_mm_hadd_ps(ty[0], ty[1]), _mm_hadd_ps(ty[2], ty[3]));
+                    auto const fzi = _mm_hadd_ps(_mm_hadd_ps(tz[0], tz[1]), _mm_hadd_ps(tz[2], tz[3]));
+                    vfxi01 = _mm_add_pd(vfxi01, _mm_cvtps_pd(fxi));
+                    vfxi23 = _mm_add_pd(vfxi23, _mm_cvtps_pd(_mm_movehl_ps(fxi, fxi)));
+                    vfyi01 = _mm_add_pd(vfyi01, _mm_cvtps_pd(fyi));
+                    vfyi23 = _mm_add_pd(vfyi23, _mm_cvtps_pd(_mm_movehl_ps(fyi, fyi)));
+                    vfzi01 = _mm_add_pd(vfzi01, _mm_cvtps_pd(fzi));
+                    vfzi23 = _mm_add_pd(vfzi23, _mm_cvtps_pd(_mm_movehl_ps(fzi, fzi)));
+                }
+
+                auto const i = ic * 4;
+                _mm_store_pd(args.fx + i, _mm_add_pd(_mm_load_pd(args.fx + i), vfxi01));
+                _mm_store_pd(args.fx + i + 2, _mm_add_pd(_mm_load_pd(args.fx + i + 2), vfxi23));
+                _mm_store_pd(args.fy + i, _mm_add_pd(_mm_load_pd(args.fy + i), vfyi01));
+                _mm_store_pd(args.fy + i + 2, _mm_add_pd(_mm_load_pd(args.fy + i + 2), vfyi23));
+                _mm_store_pd(args.fz + i, _mm_add_pd(_mm_load_pd(args.fz + i), vfzi01));
+                _mm_store_pd(args.fz + i + 2, _mm_add_pd(_mm_load_pd(args.fz + i + 2), vfzi23));
+            }
+
+            alignas(16) double sum[2];
+
+            if (Energy) {
+                _mm_store_pd(sum, vup);
+                up += sum[0] + sum[1];
+            }
+
+            if (Virial) {
+                _mm_store_pd(sum, vvirial);
+                virial += sum[0] + sum[1];
+            }
+        }
+
+        void calc_cluster_force_mixed_sse42(ClusterKernelArgs const & args, double & up, double & virial)
+        {
+            switch (args.flags) {
+            case ComputeFlags::FORCE:
+                calc_cluster_force_mixed_sse42_impl<false, false>(args, up, virial);
+                break;
+
+            case ComputeFlags::ENERGY:
+                calc_cluster_force_mixed_sse42_impl<true, false>(args, up, virial);
+                break;
+
+            case ComputeFlags::VIRIAL:
+                calc_cluster_force_mixed_sse42_impl<false, true>(args, up, virial);
+                break;
+
+            default:
+                calc_cluster_force_mixed_sse42_impl<true, true>(args, up, virial);
+                break;
+            }
+        }
+
+        std::int32_t filter_pairs_sse42(PairFilterArgs const & args, std::int32_t * out)
+        {
+            auto const xi = _mm_set1_pd(args.xi);
+            auto const yi = _mm_set1_pd(args.yi);
+            auto const zi = _mm_set1_pd(args.zi);
+            auto const shiftx = _mm_set1_pd(args.shiftx);
+            auto const shifty = _mm_set1_pd(args.shifty);
+            auto const shiftz = _mm_set1_pd(args.shiftz);
+            auto const ml2 = _mm_set1_pd(args.ml2);
+
+            auto c = 0;
+            auto k = 0;
+            for (; k + 2 <= args.n; k += 2) {
+                auto const j0 = args.candidates[k];
+                auto const j1 = args.candidates[k + 1];
+
+                auto const dx = _mm_add_pd(_mm_sub_pd(_mm_set_pd(args.rx[j1], args.rx[j0]), xi), shiftx);
+                auto const dy = _mm_add_pd(_mm_sub_pd(_mm_set_pd(args.ry[j1], args.ry[j0]), yi), shifty);
+                auto const dz = _mm_add_pd(_mm_sub_pd(_mm_set_pd(args.rz[j1], args.rz[j0]), zi), shiftz);
+                auto const r2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz));
+                auto const mask = _mm_movemask_pd(_mm_cmple_pd(r2, ml2));
+
+                // 分岐しないように、いったん書き込んでから、残すときだけ書き込む位置を進める
+                out[c] = j0;
+                c += mask & 1;
+                out[c] = j1;
+                c += mask >> 1;
+            }
+
+            // 端数の候補
+            auto rest = args;
+            rest.candidates += k;
+            rest.n -= k;
+
+            return c + filter_pairs_scalar(rest, out + c);
+        }
+
+        std::int32_t prune_pairs_sse42(PairPruneArgs const & args, std::int32_t * jout, std::uint8_t * shiftout)
+        {
+            auto const xi = _mm_set1_pd(args.xi);
+            auto const yi = _mm_set1_pd(args.yi);
+            auto const zi = _mm_set1_pd(args.zi);
+            auto const vl = _mm_set1_pd(args.periodiclen);
+            auto const rl2 = _mm_set1_pd(args.rl2);
+            auto const v1i = _mm_set1_epi32(1);
+            auto const v3i = _mm_set1_epi32(3);
+
+            auto c = 0;
+            auto k = 0;
+            for (; k + 2 <= args.n; k += 2) {
+                auto const j0 = args.jindex[k];
+                auto const j1 = args.jindex[k + 1];
+                auto const s0 = args.shift[k];
+                auto const s1 = args.shift[k + 1];
+
+                // 周期的境界条件の補正は、ペアリストに記録した相手の原子の像の番号から求める
+                auto const vs = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(s0 | s1 << 8));
+                auto const dx = _mm_add_pd(_mm_sub_pd(_mm_set_pd(args.rx[j1], args.rx[j0]), xi),
+                    _mm_mul_pd(_mm_cvtepi32_pd(_mm_sub_epi32(_mm_and_si128(vs, v3i), v1i)), vl));
+                auto const dy = _mm_add_pd(_mm_sub_pd(_mm_set_pd(args.ry[j1], args.ry[j0]), yi),
+                    _mm_mul_pd(_mm_cvtepi32_pd(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(vs, 2), v3i), v1i)), vl));
+                auto const dz = _mm_add_pd(_mm_sub_pd(_mm_set_pd(args.rz[j1], args.rz[j0]), zi),
+                    _mm_mul_pd(_mm_cvtepi32_pd(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(vs, 4), v3i), v1i)), vl));
+                auto const r2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz));
+                auto const mask = _mm_movemask_pd(_mm_cmple_pd(r2, rl2));
+
+                // 分岐しないように、いったん書き込んでから、残すときだけ書き込む位置を進める
+                jout[c] = j0;
+                shiftout[c] = s0;
+                c += mask & 1;
+                jout[c] = j1;
+                shiftout[c] = s1;
+                c += mask >> 1;
+            }
+
+            // 行の端数の組
+            auto rest = args;
+            rest.jindex += k;
+            rest.shift += k;
+            rest.n -= k;
+
+            return c + prune_pairs_scalar(rest, jout + c, shiftout + c);
+        }
+    }
+}
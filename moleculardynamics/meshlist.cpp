@@ -6,172 +6,742 @@
 */
 
 #include "meshlist.h"
-#include <algorithm>        // for std::fill
+#include <algorithm>        // for std::copy, std::fill, std::is_sorted, std::max, std::min, std::sort, std::upper_bound
+#include <cmath>            // for std::cbrt
+#include <numeric>          // for std::iota
 #include <boost/assert.hpp> // for BOOST_ASSERT
 
+#ifdef _OPENMP
+    #include <omp.h>        // for omp_get_max_threads, omp_get_num_threads, omp_get_thread_num
+#endif
+
 namespace moleculardynamics {
-    MeshList::MeshList(double periodiclen) : periodiclen_(periodiclen)
-    {
-        auto const SL = SystemParam::RCUTOFF + SystemParam::MARGIN;
-        
-        m_ = static_cast<std::int32_t>(periodiclen / SL) - 1;
-        mesh_size_ = static_cast<double>(periodiclen) / m_;
-        
-        BOOST_ASSERT(m_ > 2);
-        BOOST_ASSERT(mesh_size_ > SL);
-        
-        number_of_mesh_ = m_ * m_ * m_;
-        count_.resize(number_of_mesh_);
-        indexes_.resize(number_of_mesh_);
+    double const MeshList::SPARSEOCCUPANCY = 1.0 / 64.0;
+
+    MeshList::MeshList(double periodiclen, double margin, std::int32_t division) : periodiclen_(periodiclen)
+    {
+#ifdef _OPENMP
+        auto const maxthreads = omp_get_max_threads();
+#else
+        auto const maxthreads = 1;
+#endif
+        threadoffsets_.resize(maxthreads + 1);
+        threadpairs_.resize(maxthreads);
+
+        // 番地ごとの配列は、密な住所録を使うと決まったとき（set_number_of_atoms()）に確保する
+        set_mesh(margin, division);
     }
 
-    void MeshList::make_pair(SystemParam::myatomvector & atoms, SystemParam::mypairvector & pairs)
+    std::int32_t MeshList::calc_mesh_number(double periodiclen, double margin, std::int32_t division)
     {
-        pairs.clear();
-        
-        auto const pn = atoms.size();
+        return static_cast<std::int32_t>(periodiclen * static_cast<double>(division) / (SystemParam::RCUTOFF + margin)) - 1;
+    }
 
-        std::vector<std::int32_t> particle_position(pn, 0);
-        std::vector<std::int32_t> pointer(number_of_mesh_, 0);
+    void MeshList::make_cluster_pair(AtomSoA const & atoms, ClusterPairList & clusters)
+    {
+        auto const CS = ClusterPairList::CLUSTERSIZE;
 
-        std::fill(count_.begin(), count_.end(), 0);
+        sort_atoms(atoms);
 
+        // クラスタがなるべく立方体に近くなるように、番地をxy平面でs×s本の柱に分け、
+        // 柱の順（蛇行順）、柱の中ではz座標の順（柱ごとに向きを反転）に原子を並べて、CLUSTERSIZE個ずつクラスタにまとめる
+        // （番地の端数のクラスタは、足りない分をパディングにする）
+        // クラスタの番号は、番地を空間充填曲線の順にたどって振る（cluster_indexes_は曲線の順の添字で引く）
+        // 疎な住所録では、原子がいる番地だけを空間充填曲線の順にたどる
         auto const im = 1.0 / mesh_size_;
-        for (auto i = 0; i < pn; i++) {
-            auto ix = static_cast<std::int32_t>(atoms[i].r[0] * im);
-            auto iy = static_cast<std::int32_t>(atoms[i].r[1] * im);
-            auto iz = static_cast<std::int32_t>(atoms[i].r[2] * im);
-            
-            if (ix < 0) {
-                ix += m_;
+        auto const ncells = sparse_ ? static_cast<std::int32_t>(occupiedcell_.size()) : number_of_mesh_;
+        cluster_indexes_.resize(ncells + 1);
+        cluster_indexes_[0] = 0;
+        for (auto k = 0; k < ncells; k++) {
+            auto const slot = sparse_ ? k : cellorder_[k];
+            auto const id = sparse_ ? occupiedcell_[k] : cellorder_[k];
+            auto const n = count_[slot];
+            auto const s = std::max(1, static_cast<std::int32_t>(std::cbrt(static_cast<double>(n) / CS) + 0.5));
+            auto const ix = id % m_;
+            auto const iy = (id / m_) % m_;
+
+            // 各原子がいる柱の番号は、ソートの比較のたびに計算しないように先に求めておく
+            auto const first = sorted_buffer.begin() + indexes_[slot];
+            for (auto l = 0; l < n; l++) {
+                auto const a = first[l];
+                auto cx = static_cast<std::int32_t>((atoms.rx[a] * im - ix) * s);
+                auto cy = static_cast<std::int32_t>((atoms.ry[a] * im - iy) * s);
+                cx = std::min(std::max(cx, 0), s - 1);
+                cy = std::min(std::max(cy, 0), s - 1);
+
+                column_[a] = cy * s + (cy % 2 ? s - 1 - cx : cx);
             }
-            else if (ix >= m_) {
-                ix -= m_;
+
+            std::sort(first, first + n, [&](std::int32_t a, std::int32_t b)
+            {
+                if (column_[a] != column_[b]) {
+                    return column_[a] < column_[b];
+                }
+
+                return column_[a] % 2 ? atoms.rz[a] > atoms.rz[b] : atoms.rz[a] < atoms.rz[b];
+            });
+
+            cluster_indexes_[k + 1] = cluster_indexes_[k] + (n + CS - 1) / CS;
+        }
+
+        // クラスタペアを登録する間にメモリを確保し直さないように、前回のクラスタペアの数に余裕を持たせた容量を先に確保しておく
+        auto const nc = cluster_indexes_[ncells];
+        auto const npairs = clusters.jcluster.size();
+        clusters.reserve(nc, npairs + npairs / 8);
+        clusters.atomindex.assign(nc * CS, -1);
+        clusters.originx.resize(nc);
+        clusters.originy.resize(nc);
+        clusters.originz.resize(nc);
+        for (auto k = 0; k < ncells; k++) {
+            auto const slot = sparse_ ? k : cellorder_[k];
+            auto const id = sparse_ ? occupiedcell_[k] : cellorder_[k];
+            for (auto l = 0; l < count_[slot]; l++) {
+                clusters.atomindex[cluster_indexes_[k] * CS + l] = sorted_buffer[indexes_[slot] + l];
+            }
+
+            for (auto ic = cluster_indexes_[k]; ic < cluster_indexes_[k + 1]; ic++) {
+                clusters.originx[ic] = static_cast<double>(id % m_) * mesh_size_;
+                clusters.originy[ic] = static_cast<double>((id / m_) % m_) * mesh_size_;
+                clusters.originz[ic] = static_cast<double>(id / m_ / m_) * mesh_size_;
             }
+        }
+
+        clusters.x.resize(nc * CS);
+        clusters.y.resize(nc * CS);
+        clusters.z.resize(nc * CS);
+        clusters.xf.resize(nc * CS);
+        clusters.yf.resize(nc * CS);
+        clusters.zf.resize(nc * CS);
+        clusters.fx.resize(nc * CS);
+        clusters.fy.resize(nc * CS);
+        clusters.fz.resize(nc * CS);
 
-            if (iy < 0) {
-                iy += m_;
+        // クラスタicの相手を、クラスタicの行にまとめて登録する
+        clusters.jcluster.clear();
+        clusters.mask.clear();
+        clusters.shift.clear();
+        clusters.joriginx.clear();
+        clusters.joriginy.clear();
+        clusters.joriginz.clear();
+        clusters.offsets.resize(nc + 1);
+
+        for (auto k = 0; k < ncells; k++) {
+            auto const id = sparse_ ? occupiedcell_[k] : cellorder_[k];
+            for (auto ic = cluster_indexes_[k]; ic < cluster_indexes_[k + 1]; ic++) {
+                clusters.offsets[ic] = static_cast<std::int32_t>(clusters.jcluster.size());
+                search_cluster(ic, id, atoms, clusters);
             }
-            else if (iy >= m_) {
-                iy -= m_;
+        }
+
+        clusters.offsets[nc] = static_cast<std::int32_t>(clusters.jcluster.size());
+    }
+
+    void MeshList::set_margin(double margin)
+    {
+        auto const SL = SystemParam::RCUTOFF + margin;
+
+        // 番地の大きさは変えないので、番地の一辺の分割数倍がカットオフ半径とマージンの和より長いときだけ使える
+        BOOST_ASSERT(mesh_size_ * division_ > SL);
+
+        ml2_ = SL * SL;
+
+        // ステンシルから外す番地は、カットオフ半径とマージンの和で決まる
+        make_stencil();
+    }
+
+    void MeshList::set_mesh(double margin, std::int32_t division)
+    {
+        division_ = division;
+        m_ = MeshList::calc_mesh_number(periodiclen_, margin, division);
+        mesh_size_ = periodiclen_ / static_cast<double>(m_);
+        number_of_mesh_ = m_ * m_ * m_;
+
+        // 番地がステンシルの幅より少ないと、同じ番地の像を2回たどってしまう
+        BOOST_ASSERT(division_ >= 1);
+        BOOST_ASSERT(m_ > 2 * division_);
+
+        set_margin(margin);
+    }
+
+    void MeshList::set_number_of_atoms(std::size_t pn)
+    {
+        column_.resize(pn);
+        particle_position_.resize(pn);
+        sorted_buffer.resize(pn);
+
+        // 番地あたりの原子が少ないと、密な住所録では原子がいない番地をたどる時間とメモリが支配的になる
+        sparse_ = static_cast<double>(pn) < MeshList::SPARSEOCCUPANCY * static_cast<double>(number_of_mesh_);
+
+        if (sparse_) {
+            // 原子がいる番地の数は原子の数を超えないので、原子の数だけ確保しておく（作り直すたびにメモリを確保しない）
+            atomcode_.resize(pn);
+            count_.reserve(pn);
+            indexes_.reserve(pn);
+            occupiedcell_.reserve(pn);
+            cluster_indexes_.reserve(pn + 1);
+            colored_cells_.reserve(pn);
+
+            // ハッシュ表は、原子の数の4倍以上の2のべき乗の大きさにする
+            // （隣接番地の多くは空なので、見つからない探索の線形探索が短くなるように、4分の3以上を空ける）
+            auto hashsize = static_cast<std::size_t>(1);
+            while (hashsize < 4 * pn) {
+                hashsize <<= 1;
+            }
+
+            hashcell_.resize(hashsize);
+            hashslot_.resize(hashsize);
+        }
+        else {
+            count_.resize(number_of_mesh_);
+            indexes_.resize(number_of_mesh_);
+            cluster_indexes_.resize(number_of_mesh_ + 1);
+
+            // スレッドごとの原子の数の配列は、番地の数だけの大きさをスレッドの数だけ持つので、原子の数に比べて番地が多い箱では
+            // 原子の数を数えるスレッドを減らして、配列の大きさを原子の数のTHREADCOUNTPERATOM倍（1スレッド分より小さければ1スレッド分）までに抑える
+            auto const limit = static_cast<std::int64_t>(MeshList::THREADCOUNTPERATOM) * static_cast<std::int64_t>(pn);
+            countthreads_ = static_cast<std::int32_t>(std::max(std::min(limit / number_of_mesh_, static_cast<std::int64_t>(threadpairs_.size())), static_cast<std::int64_t>(1)));
+            threadcount_.resize(static_cast<std::size_t>(countthreads_) * number_of_mesh_);
+
+            make_cell_order();
+            make_colors();
+        }
+    }
+
+    void MeshList::set_simd_type(SimdType simdtype)
+    {
+        pairfilter_ = ljkernel::get_pair_filter(simdtype);
+    }
+
+    void MeshList::make_pair(AtomSoA const & atoms, PairList & pairs)
+    {
+        auto const pn = static_cast<std::int32_t>(atoms.size());
+        pairs.offsets.resize(pn + 1);
+
+        sort_atoms(atoms);
+
+        // 原子の行を、スレッドごとに連続した範囲に分けて、スレッドごとのバッファに登録してから、
+        // 行の順につなげる（ペアリストは、逐次で作ったものと同じになる）
+#pragma omp parallel num_threads(number_of_threads())
+        {
+#ifdef _OPENMP
+            auto const thread = omp_get_thread_num();
+            auto const nthreads = omp_get_num_threads();
+#else
+            auto const thread = 0;
+            auto const nthreads = 1;
+#endif
+            auto const ibegin = static_cast<std::int32_t>(static_cast<std::int64_t>(pn) * thread / nthreads);
+            auto const iend = static_cast<std::int32_t>(static_cast<std::int64_t>(pn) * (thread + 1) / nthreads);
+            auto & local = threadpairs_[thread];
+
+            // 登録する間にメモリを確保し直さないように、前回のペアの数に余裕を持たせた容量を先に確保しておく
+            auto const nlocal = local.jindex.size();
+            local.reserve(nlocal + nlocal / 8);
+
+            local.jindex.clear();
+            local.shift.clear();
+
+            // 原子iの相手を、原子iの行にまとめて登録する（offsetsには、まずスレッドのバッファの中の位置を入れる）
+            for (auto i = ibegin; i < iend; i++) {
+                pairs.offsets[i] = static_cast<std::int32_t>(local.jindex.size());
+                search(i, particle_position_[i], atoms, local);
             }
-            if (iz < 0) {
-                iz += m_;
+
+            threadoffsets_[thread + 1] = static_cast<std::int32_t>(local.jindex.size());
+
+#pragma omp barrier
+#pragma omp single
+            {
+                threadoffsets_[0] = 0;
+                for (auto t = 0; t < nthreads; t++) {
+                    threadoffsets_[t + 1] += threadoffsets_[t];
+                }
+
+                auto const npairs = threadoffsets_[nthreads];
+                pairs.reserve(npairs);
+                pairs.jindex.resize(npairs);
+                pairs.shift.resize(npairs + PairList::SHIFTPADDING);
+                std::fill(pairs.shift.begin() + npairs, pairs.shift.end(), SystemParam::shift_index(0, 0, 0));
+                pairs.offsets[pn] = npairs;
             }
-            else if (iz >= m_) {
-                iz -= m_;
+
+            auto const base = threadoffsets_[thread];
+            for (auto i = ibegin; i < iend; i++) {
+                pairs.offsets[i] += base;
             }
 
-            auto const index = ix + iy * m_ + iz * m_ * m_;
-            
-            BOOST_ASSERT(index >= 0);
-            BOOST_ASSERT(index < number_of_mesh_);
-            
-            count_[index]++;
-            particle_position[i] = index;
+            std::copy(local.jindex.begin(), local.jindex.end(), pairs.jindex.begin() + base);
+            std::copy(local.shift.begin(), local.shift.end(), pairs.shift.begin() + base);
         }
-        
-        indexes_[0] = 0;
-        auto sum = 0;
-        
-        for (auto i = 0; i < number_of_mesh_ - 1; i++) {
-            sum += count_[i];
-            indexes_[i + 1] = sum;
+    }
+
+    void MeshList::add_cluster_pair(std::int32_t ic, std::int32_t jc, std::int32_t sx, std::int32_t sy, std::int32_t sz, AtomSoA const & atoms, ClusterPairList & clusters)
+    {
+        auto const CS = ClusterPairList::CLUSTERSIZE;
+        auto const shiftx = static_cast<double>(sx) * periodiclen_;
+        auto const shifty = static_cast<double>(sy) * periodiclen_;
+        auto const shiftz = static_cast<double>(sz) * periodiclen_;
+        auto mask = 0;
+
+        for (auto li = 0; li < CS; li++) {
+            auto const i = clusters.atomindex[ic * CS + li];
+            if (i < 0) {
+                break;
+            }
+
+            for (auto lj = 0; lj < CS; lj++) {
+                auto const j = clusters.atomindex[jc * CS + lj];
+                if (j < 0) {
+                    break;
+                }
+
+                // 同じクラスタの中の組は、片方だけを登録する
+                if (ic == jc && lj <= li) {
+                    continue;
+                }
+
+                auto const dx = atoms.rx[j] - atoms.rx[i] + shiftx;
+                auto const dy = atoms.ry[j] - atoms.ry[i] + shifty;
+                auto const dz = atoms.rz[j] - atoms.rz[i] + shiftz;
+
+                if (dx * dx + dy * dy + dz * dz <= ml2_) {
+                    mask |= 1 << (li * CS + lj);
+                }
+            }
         }
-        
-        for (auto i = 0; i < pn; i++) {
-            auto const pos = particle_position[i];
-            auto const j = indexes_[pos] + pointer[pos];
-            sorted_buffer[j] = i;
-            ++pointer[pos];
+
+        if (mask) {
+            clusters.jcluster.push_back(jc);
+            clusters.mask.push_back(static_cast<std::uint16_t>(mask));
+            clusters.shift.push_back(SystemParam::shift_index(sx, sy, sz));
+
+            // 原点どうしの差はdoubleで求めてから丸めるので、floatの相対座標に足しても桁落ちしない
+            clusters.joriginx.push_back(static_cast<float>(clusters.originx[jc] + shiftx - clusters.originx[ic]));
+            clusters.joriginy.push_back(static_cast<float>(clusters.originy[jc] + shifty - clusters.originy[ic]));
+            clusters.joriginz.push_back(static_cast<float>(clusters.originz[jc] + shiftz - clusters.originz[ic]));
         }
-        
-        for (auto i = 0; i < number_of_mesh_; i++) {
-            search(i, atoms, pairs);
+    }
+
+    void MeshList::add_pairs(std::int32_t i, std::int32_t const * candidates, std::int32_t n, std::int32_t sx, std::int32_t sy, std::int32_t sz, AtomSoA const & atoms, PairList & pairs)
+    {
+        ljkernel::PairFilterArgs args;
+        args.rx = atoms.rx.data();
+        args.ry = atoms.ry.data();
+        args.rz = atoms.rz.data();
+        args.candidates = candidates;
+        args.n = n;
+        args.xi = atoms.rx[i];
+        args.yi = atoms.ry[i];
+        args.zi = atoms.rz[i];
+        args.shiftx = static_cast<double>(sx) * periodiclen_;
+        args.shifty = static_cast<double>(sy) * periodiclen_;
+        args.shiftz = static_cast<double>(sz) * periodiclen_;
+        args.ml2 = ml2_;
+
+        // 候補がすべて残っても入るように広げてからふるい分けた結果を書き込み、残った数に縮める
+        auto const size = pairs.jindex.size();
+        pairs.jindex.resize(size + n);
+        auto const kept = pairfilter_(args, pairs.jindex.data() + size);
+
+        pairs.jindex.resize(size + kept);
+        pairs.shift.resize(size + kept, SystemParam::shift_index(sx, sy, sz));
+    }
+
+    void MeshList::sort_atoms(AtomSoA const & atoms)
+    {
+        if (sparse_) {
+            sort_atoms_sparse(atoms);
+            return;
         }
+
+        auto const pn = static_cast<std::int32_t>(atoms.size());
+        auto const im = 1.0 / mesh_size_;
+
+        // 原子を、スレッドごとに連続した範囲に分けて数え、番地ごと・スレッドごとの書き込み位置を求めてから並べる
+        // （同じ番地の中では原子のインデックスの順に並ぶので、逐次の数え上げソートと同じ結果になる）
+        // スレッドの数は、スレッドごとの原子の数の配列を確保した数（countthreads_）までにする
+#pragma omp parallel num_threads(std::min(number_of_threads(), countthreads_))
+        {
+#ifdef _OPENMP
+            auto const thread = omp_get_thread_num();
+            auto const nthreads = omp_get_num_threads();
+#else
+            auto const thread = 0;
+            auto const nthreads = 1;
+#endif
+            auto const ibegin = static_cast<std::int32_t>(static_cast<std::int64_t>(pn) * thread / nthreads);
+            auto const iend = static_cast<std::int32_t>(static_cast<std::int64_t>(pn) * (thread + 1) / nthreads);
+            auto const threadcount = threadcount_.data() + thread * number_of_mesh_;
+
+            std::fill(threadcount, threadcount + number_of_mesh_, 0);
+
+            for (auto i = ibegin; i < iend; i++) {
+                auto const index = cell_index(atoms, i, im);
+
+                BOOST_ASSERT(index >= 0);
+                BOOST_ASSERT(index < number_of_mesh_);
+
+                threadcount[index]++;
+                particle_position_[i] = index;
+            }
+
+#pragma omp barrier
+#pragma omp for
+            for (std::int32_t id = 0; id < number_of_mesh_; id++) {
+                auto sum = 0;
+                for (auto t = 0; t < nthreads; t++) {
+                    sum += threadcount_[t * number_of_mesh_ + id];
+                }
+
+                count_[id] = sum;
+            }
+
+            // 番地は空間充填曲線の順に並べる（同じ番地の中は原子のインデックスの順）
+#pragma omp single
+            {
+                auto sum = 0;
+                for (auto k = 0; k < number_of_mesh_; k++) {
+                    auto const id = cellorder_[k];
+                    indexes_[id] = sum;
+                    sum += count_[id];
+                }
+            }
+
+            // スレッドごとの数を、番地の中でのスレッドごとの書き込み位置に置き換える
+#pragma omp for
+            for (std::int32_t id = 0; id < number_of_mesh_; id++) {
+                auto pointer = indexes_[id];
+                for (auto t = 0; t < nthreads; t++) {
+                    auto const n = threadcount_[t * number_of_mesh_ + id];
+                    threadcount_[t * number_of_mesh_ + id] = pointer;
+                    pointer += n;
+                }
+            }
+
+            for (auto i = ibegin; i < iend; i++) {
+                sorted_buffer[threadcount[particle_position_[i]]++] = i;
+            }
+        }
+    }
+
+    std::int32_t MeshList::cell_index(AtomSoA const & atoms, std::int32_t i, double im) const
+    {
+        auto ix = static_cast<std::int32_t>(atoms.rx[i] * im);
+        auto iy = static_cast<std::int32_t>(atoms.ry[i] * im);
+        auto iz = static_cast<std::int32_t>(atoms.rz[i] * im);
+
+        // 相手の原子の像の番号は番地から決めるので、周期の端にいる原子（座標がちょうど周期の長さになったものなど）は
+        // 反対側の番地に回さず、端の番地に入れる
+        ix = std::min(std::max(ix, 0), m_ - 1);
+        iy = std::min(std::max(iy, 0), m_ - 1);
+        iz = std::min(std::max(iz, 0), m_ - 1);
+
+        return ix + iy * m_ + iz * m_ * m_;
     }
 
-    void MeshList::search_other(std::int32_t id, std::int32_t ix, std::int32_t iy, std::int32_t iz, SystemParam::myatomvector & atoms, SystemParam::mypairvector & pairs)
+    void MeshList::sort_atoms_sparse(AtomSoA const & atoms)
     {
-        if (ix < 0) {
-            ix += m_;
+        auto const pn = static_cast<std::int32_t>(atoms.size());
+        auto const im = 1.0 / mesh_size_;
+
+#pragma omp parallel for num_threads(number_of_threads())
+        for (std::int32_t i = 0; i < pn; i++) {
+            particle_position_[i] = cell_index(atoms, i, im);
+            atomcode_[i] = morton_code(particle_position_[i]);
         }
-        else if (ix >= m_) {
-            ix -= m_;
+
+        // 密な住所録と同じ順（番地は空間充填曲線の順、同じ番地の中は原子のインデックスの順）に並べる
+        std::iota(sorted_buffer.begin(), sorted_buffer.end(), 0);
+        std::sort(sorted_buffer.begin(), sorted_buffer.end(), [this](std::int32_t a, std::int32_t b)
+        {
+            return atomcode_[a] != atomcode_[b] ? atomcode_[a] < atomcode_[b] : a < b;
+        });
+
+        // 原子がいる番地だけを、並べた順に登録する
+        count_.clear();
+        indexes_.clear();
+        occupiedcell_.clear();
+        for (auto m = 0; m < pn; m++) {
+            auto const id = particle_position_[sorted_buffer[m]];
+            if (occupiedcell_.empty() || occupiedcell_.back() != id) {
+                count_.push_back(0);
+                indexes_.push_back(m);
+                occupiedcell_.push_back(id);
+            }
+
+            count_.back()++;
         }
-        
-        if (iy < 0) {
-            iy += m_;
+
+        // 番地番号から、原子がいる番地の番号を引くハッシュ表（開番地法、線形探索）
+        auto const mask = static_cast<std::uint32_t>(hashcell_.size()) - 1;
+        std::fill(hashcell_.begin(), hashcell_.end(), -1);
+        for (auto k = 0; k < static_cast<std::int32_t>(occupiedcell_.size()); k++) {
+            auto const id = occupiedcell_[k];
+            auto h = hash_cell(id);
+            while (hashcell_[h] >= 0) {
+                h = (h + 1) & mask;
+            }
+
+            hashcell_[h] = id;
+            hashslot_[h] = k;
         }
-        else if (iy >= m_) {
-            iy -= m_;
+
+        make_colors();
+    }
+
+    std::int32_t MeshList::cell_color(std::int32_t id) const
+    {
+        // 原子iの行は、番地(ix, iy, iz)から見てx, y方向に-division_～+division_、z方向に0～+division_の番地の原子に力を書き込むので、
+        // x, y方向に2 * division_ + 1番地、z方向にdivision_ + 1番地以上離れた番地どうしは同時に計算できる
+        // 一辺のメッシュの数が周期で割り切れないときは、端数の番地に別の色を割り当てる
+        auto const color = [this](std::int32_t i, std::int32_t period)
+        {
+            auto const nfull = m_ - m_ % period;
+            return i < nfull ? i % period : period + i - nfull;
+        };
+
+        auto const px = 2 * division_ + 1;
+        auto const pz = division_ + 1;
+        auto const ncx = px + m_ % px;
+
+        return color(id % m_, px) + color((id / m_) % m_, px) * ncx + color(id / m_ / m_, pz) * ncx * ncx;
+    }
+
+    std::int32_t MeshList::find_cell(std::int32_t id) const
+    {
+        auto const mask = static_cast<std::uint32_t>(hashcell_.size()) - 1;
+
+        for (auto h = hash_cell(id); ; h = (h + 1) & mask) {
+            if (hashcell_[h] == id) {
+                return hashslot_[h];
+            }
+
+            if (hashcell_[h] < 0) {
+                return -1;
+            }
         }
-        
-        if (iz < 0) {
-            iz += m_;
+    }
+
+    std::uint32_t MeshList::hash_cell(std::int32_t id) const
+    {
+        // 原子がいる番地の番号は規則的に並ぶことが多いので、乗算ハッシュの上位ビットを下位ビットに混ぜてから表の大きさで切る
+        auto const h = static_cast<std::uint32_t>(id) * 2654435761U;
+        return (h ^ (h >> 16)) & (static_cast<std::uint32_t>(hashcell_.size()) - 1);
+    }
+
+    void MeshList::make_cell_order()
+    {
+        // 番地(ix, iy, iz)のビットを交互に並べたMorton符号の順に、番地をたどる
+        // （マージンの自動調整で番地の大きさを変えるたびに呼ばれるので、符号は一時的な配列に置かずにその場で求める）
+        cellorder_.resize(number_of_mesh_);
+        for (auto id = 0; id < number_of_mesh_; id++) {
+            cellorder_[id] = id;
         }
-        else if (iz >= m_) {
-            iz -= m_;
+
+        std::sort(cellorder_.begin(), cellorder_.end(), [this](std::int32_t a, std::int32_t b)
+        {
+            return morton_code(a) < morton_code(b);
+        });
+
+        cellrank_.resize(number_of_mesh_);
+        for (auto k = 0; k < number_of_mesh_; k++) {
+            cellrank_[cellorder_[k]] = k;
         }
-        
-        auto const id2 = ix + iy * m_ + iz * m_ * m_;
+    }
+
+    void MeshList::make_colors()
+    {
+        auto const px = 2 * division_ + 1;
+        auto const pz = division_ + 1;
+        auto const ncx = px + m_ % px;
+        auto const ncz = pz + m_ % pz;
+        auto const ncolors = ncx * ncx * ncz;
+        auto const ncells = sparse_ ? static_cast<std::int32_t>(occupiedcell_.size()) : number_of_mesh_;
 
-        for (auto k = indexes_[id]; k < indexes_[id] + count_[id]; k++) {
-            for (auto m_ = indexes_[id2]; m_ < indexes_[id2] + count_[id2]; m_++) {
-                auto const i = sorted_buffer[k];
-                auto const j = sorted_buffer[m_];
+        color_offsets_.assign(ncolors + 1, 0);
+        colored_cells_.resize(ncells);
 
-                Eigen::Vector4d d = atoms[j].r - atoms[i].r;
-                
-                SystemParam::adjust_periodic(d, periodiclen_);
-                
-                if (d.squaredNorm() <= SystemParam::ML2) {
-                    pairs.push_back(std::make_pair(i, j));
+        for (auto k = 0; k < ncells; k++) {
+            color_offsets_[cell_color(sparse_ ? occupiedcell_[k] : k) + 1]++;
+        }
+
+        for (auto c = 0; c < ncolors; c++) {
+            color_offsets_[c + 1] += color_offsets_[c];
+        }
+
+        // 色の頭出しのインデックスを書き込み位置に使ってから、1つずらして戻す（作業用の配列を確保しない）
+        for (auto k = 0; k < ncells; k++) {
+            colored_cells_[color_offsets_[cell_color(sparse_ ? occupiedcell_[k] : k)]++] = k;
+        }
+
+        for (auto c = ncolors; c > 0; c--) {
+            color_offsets_[c] = color_offsets_[c - 1];
+        }
+
+        color_offsets_[0] = 0;
+    }
+
+    void MeshList::make_stencil()
+    {
+        auto const nw = 2 * division_ + 1;
+
+        // 番地の座標の周期的な折り返しは、座標と相対位置の組ごとに先に求めておく（探索のたびに剰余や分岐を計算しない）
+        wrapcell_.resize(m_ * nw);
+        wrapshift_.resize(m_ * nw);
+        for (auto c = 0; c < m_; c++) {
+            for (auto d = -division_; d <= division_; d++) {
+                auto const w = c + d;
+                auto const s = w < 0 ? -1 : (w >= m_ ? 1 : 0);
+
+                wrapcell_[c * nw + d + division_] = w - s * m_;
+                wrapshift_[c * nw + d + division_] = s;
+            }
+        }
+
+        // 相対位置dの番地どうしの、ある方向の最短距離の2乗（間にある番地の数 × 番地の大きさ）
+        auto const gap2 = [this](std::int32_t d)
+        {
+            auto const g = static_cast<double>(std::max((d < 0 ? -d : d) - 1, 0)) * mesh_size_;
+            return g * g;
+        };
+
+        stencilx_.clear();
+        stencily_.clear();
+        stencilz_.clear();
+
+        // z方向、y方向（0, -1, 1, -2, 2, ...の順）、x方向の順に並べる（分割しないときは、13番地の順が以前と同じになる）
+        for (auto dz = 0; dz <= division_; dz++) {
+            for (auto l = 0; l < nw; l++) {
+                auto const dy = l % 2 ? -(l + 1) / 2 : l / 2;
+
+                for (auto dx = -division_; dx <= division_; dx++) {
+                    // 作用・反作用の法則を使うので、z > 0、z = 0ならy > 0、y = z = 0ならx > 0の半分の方向だけを入れる
+                    if (!dz && (dy < 0 || (!dy && dx <= 0))) {
+                        continue;
+                    }
+
+                    // 番地の中のどの2点もカットオフ半径とマージンの和より離れている番地は、距離を調べるまでもない
+                    if (gap2(dx) + gap2(dy) + gap2(dz) > ml2_) {
+                        continue;
+                    }
+
+                    stencilx_.push_back(dx);
+                    stencily_.push_back(dy);
+                    stencilz_.push_back(dz);
                 }
             }
         }
     }
 
-    void MeshList::search(std::int32_t id, SystemParam::myatomvector & atoms, SystemParam::mypairvector & pairs)
+    std::uint64_t MeshList::morton_code(std::int32_t id) const
+    {
+        // 21ビットの座標のビットの間に、2ビットずつ隙間を空ける
+        auto const spread = [](std::uint64_t v)
+        {
+            v &= 0x1FFFFF;
+            v = (v | v << 32) & 0x1F00000000FFFFULL;
+            v = (v | v << 16) & 0x1F0000FF0000FFULL;
+            v = (v | v << 8) & 0x100F00F00F00F00FULL;
+            v = (v | v << 4) & 0x10C30C30C30C30C3ULL;
+            v = (v | v << 2) & 0x1249249249249249ULL;
+            return v;
+        };
+
+        return spread(static_cast<std::uint64_t>(id % m_)) |
+               spread(static_cast<std::uint64_t>((id / m_) % m_)) << 1 |
+               spread(static_cast<std::uint64_t>(id / m_ / m_)) << 2;
+    }
+
+    std::int32_t MeshList::number_of_threads() const
+    {
+#ifdef _OPENMP
+        return std::min(static_cast<std::int32_t>(threadpairs_.size()), omp_get_max_threads());
+#else
+        return 1;
+#endif
+    }
+
+    void MeshList::search_other(std::int32_t i, std::int32_t id2, std::int32_t sx, std::int32_t sy, std::int32_t sz, AtomSoA const & atoms, PairList & pairs)
+    {
+        // 疎な住所録では、原子がいない番地はハッシュ表にない
+        auto const slot = sparse_ ? find_cell(id2) : id2;
+        if (slot < 0) {
+            return;
+        }
+
+        add_pairs(i, sorted_buffer.data() + indexes_[slot], count_[slot], sx, sy, sz, atoms, pairs);
+    }
+
+    void MeshList::search(std::int32_t i, std::int32_t id, AtomSoA const & atoms, PairList & pairs)
     {
         auto const ix = id % m_;
         auto const iy = (id / m_) % m_;
         auto const iz = (id / m_ / m_);
 
-        search_other(id, ix + 1, iy, iz, atoms, pairs);
-        search_other(id, ix - 1, iy + 1, iz, atoms, pairs);
-        search_other(id, ix, iy + 1, iz, atoms, pairs);
-        search_other(id, ix + 1, iy + 1, iz, atoms, pairs);
+        // Registration of self box
+        // 同じ番地の原子とのペアは、インデックスが大きい方の原子だけを登録する
+        auto const slot = sparse_ ? find_cell(id) : id;
+        // 同じ番地の中は原子のインデックスの順なので、原子iより後ろだけが候補になる
+        auto const first = sorted_buffer.data() + indexes_[slot];
+        auto const last = first + count_[slot];
+        BOOST_ASSERT(std::is_sorted(first, last));
 
-        search_other(id, ix - 1, iy, iz + 1, atoms, pairs);
-        search_other(id, ix, iy, iz + 1, atoms, pairs);
-        search_other(id, ix + 1, iy, iz + 1, atoms, pairs);
+        auto const next = std::upper_bound(first, last, i);
+        add_pairs(i, next, static_cast<std::int32_t>(last - next), 0, 0, 0, atoms, pairs);
 
-        search_other(id, ix - 1, iy - 1, iz + 1, atoms, pairs);
-        search_other(id, ix, iy - 1, iz + 1, atoms, pairs);
-        search_other(id, ix + 1, iy - 1, iz + 1, atoms, pairs);
+        // 隣接番地は、ステンシルの表と折り返しの表から引く
+        auto const nw = 2 * division_ + 1;
+        auto const ns = static_cast<std::int32_t>(stencilx_.size());
+        auto const wx = ix * nw + division_;
+        auto const wy = iy * nw + division_;
+        auto const wz = iz * nw + division_;
 
-        search_other(id, ix - 1, iy + 1, iz + 1, atoms, pairs);
-        search_other(id, ix, iy + 1, iz + 1, atoms, pairs);
-        search_other(id, ix + 1, iy + 1, iz + 1, atoms, pairs);
+        for (auto k = 0; k < ns; k++) {
+            auto const kx = wx + stencilx_[k];
+            auto const ky = wy + stencily_[k];
+            auto const kz = wz + stencilz_[k];
 
-        // Registration of self box
-        auto const si = indexes_[id];
-        auto const n = count_[id];
+            search_other(i, wrapcell_[kx] + wrapcell_[ky] * m_ + wrapcell_[kz] * m_ * m_, wrapshift_[kx], wrapshift_[ky], wrapshift_[kz], atoms, pairs);
+        }
+    }
+
+    void MeshList::search_cluster(std::int32_t ic, std::int32_t id, AtomSoA const & atoms, ClusterPairList & clusters)
+    {
+        auto const ix = id % m_;
+        auto const iy = (id / m_) % m_;
+        auto const iz = (id / m_ / m_);
 
-        for (auto k = si; k < si + n - 1; k++) {
-            for (auto m_ = k + 1; m_ < si + n; m_++) {
-                auto const i = sorted_buffer[k];
-                auto const j = sorted_buffer[m_];
+        // 同じ番地のクラスタとの組は、インデックスが大きい方のクラスタ（自分自身を含む）だけを登録する
+        auto const k = sparse_ ? find_cell(id) : cellrank_[id];
+        for (auto jc = ic; jc < cluster_indexes_[k + 1]; jc++) {
+            add_cluster_pair(ic, jc, 0, 0, 0, atoms, clusters);
+        }
 
-                Eigen::Vector4d d = atoms[j].r - atoms[i].r;
+        // 隣接番地は、ステンシルの表と折り返しの表から引く
+        auto const nw = 2 * division_ + 1;
+        auto const ns = static_cast<std::int32_t>(stencilx_.size());
+        auto const wx = ix * nw + division_;
+        auto const wy = iy * nw + division_;
+        auto const wz = iz * nw + division_;
 
-                SystemParam::adjust_periodic(d, periodiclen_);
+        for (auto k = 0; k < ns; k++) {
+            auto const kx = wx + stencilx_[k];
+            auto const ky = wy + stencily_[k];
+            auto const kz = wz + stencilz_[k];
 
-                if (d.squaredNorm() <= SystemParam::ML2) {
-                    pairs.push_back(std::make_pair(i, j));
-                }
-            }
+            search_cluster_other(ic, wrapcell_[kx] + wrapcell_[ky] * m_ + wrapcell_[kz] * m_ * m_, wrapshift_[kx], wrapshift_[ky], wrapshift_[kz], atoms, clusters);
+        }
+    }
+
+    void MeshList::search_cluster_other(std::int32_t ic, std::int32_t id2, std::int32_t sx, std::int32_t sy, std::int32_t sz, AtomSoA const & atoms, ClusterPairList & clusters)
+    {
+        auto const k2 = sparse_ ? find_cell(id2) : cellrank_[id2];
+        if (k2 < 0) {
+            return;
+        }
+
+        for (auto jc = cluster_indexes_[k2]; jc < cluster_indexes_[k2 + 1]; jc++) {
+            add_cluster_pair(ic, jc, sx, sy, sz, atoms, clusters);
         }
     }
 }
@@ -11,12 +11,15 @@
 
 #pragma once
 
+#include "ljkernel.h"
 #include "systemparam.h"
 
 namespace moleculardynamics {
     //! A class.
     /*!
         メッシュリストクラス    
+        原子の数に比べて番地が多い（番地あたりの原子が少ない）ときは、原子がいる番地だけをハッシュ表で引く疎な住所録を使う
+        （count()、indexes()の添字は、密な住所録では番地番号、疎な住所録では原子がいる番地の空間充填曲線の順の番号）
     */
     class MeshList final {
         // #region コンストラクタ・デストラクタ
@@ -26,8 +29,10 @@ namespace moleculardynamics {
         /*!
             唯一のコンストラクタ
             \param periodiclen 周期の長さ
+            \param margin ペアリストのマージン
+            \param division 番地の一辺を、カットオフ半径とマージンの和の何分の1にするか（1～3）
         */
-        explicit MeshList(double periodiclen);
+        MeshList(double periodiclen, double margin, std::int32_t division);
 
         //! A destructor.
         /*!
@@ -38,63 +43,425 @@ namespace moleculardynamics {
         // #endregion コンストラクタ・デストラクタ
 
         // #region publicメンバ関数
-        
+
+        //! A public static member function.
+        /*!
+            周期の長さとマージンから、一辺のメッシュの数を求める
+            \param periodiclen 周期の長さ
+            \param margin ペアリストのマージン
+            \param division 番地の一辺を、カットオフ半径とマージンの和の何分の1にするか
+            \return 一辺のメッシュの数
+        */
+        static std::int32_t calc_mesh_number(double periodiclen, double margin, std::int32_t division);
+
+        //! A public member function (constant).
+        /*!
+            色ごとにまとめた番地の、色の頭出しのインデックスを返す
+            \return 色cの番地は、colored_cells()[color_offsets()[c]]からcolored_cells()[color_offsets()[c + 1] - 1]まで
+            （疎な住所録では、ペアリストを作り直すたびに原子がいる番地だけを塗り分け直す）
+        */
+        std::vector<std::int32_t> const & color_offsets() const
+        {
+            return color_offsets_;
+        }
+
+        //! A public member function (constant).
+        /*!
+            色ごとにまとめた番地（count()とindexes()の添字）を返す
+            \return 色ごとにまとめた番地
+        */
+        std::vector<std::int32_t> const & colored_cells() const
+        {
+            return colored_cells_;
+        }
+
+        //! A public member function (constant).
+        /*!
+            番地の一辺を、カットオフ半径とマージンの和の何分の1にしているかを返す
+            \return 番地の一辺の分割数
+        */
+        std::int32_t division() const
+        {
+            return division_;
+        }
+
+        //! A public member function (constant).
+        /*!
+            どの番地に何個原子がいるかの数を返す
+            \return どの番地に何個原子がいるかの数（添字はクラスの説明を参照）
+        */
+        std::vector<std::int32_t> const & count() const
+        {
+            return count_;
+        }
+
+        //! A public member function (constant).
+        /*!
+            番地番号でソートした際の、番地番号の頭出しのインデックスを返す
+            \return 番地番号の頭出しのインデックス（添字はクラスの説明を参照）
+        */
+        std::vector<std::int32_t> const & indexes() const
+        {
+            return indexes_;
+        }
+
+        //! A public member function.
+        /*!
+            原子を番地ごとにクラスタにまとめ、クラスタペアリストを作成する
+            \param atoms 原子の座標が格納された構造体
+            \param clusters クラスタペアリスト
+        */
+        void make_cluster_pair(AtomSoA const & atoms, ClusterPairList & clusters);
+
         //! A public member function.
         /*!
             原子の住所録を作成する
-            \param atoms 原子の座標が格納された可変長配列
+            \param atoms 原子の座標が格納された構造体
             \param pairs 原子のペアが格納された可変長配列
         */
-        void make_pair(SystemParam::myatomvector & atoms, SystemParam::mypairvector & pairs);
+        void make_pair(AtomSoA const & atoms, PairList & pairs);
+
+        //! A public member function (constant).
+        /*!
+            一辺のメッシュの数を返す
+            \return 一辺のメッシュの数
+        */
+        std::int32_t mesh_number() const
+        {
+            return m_;
+        }
         
         //! A public member function.
         /*!
-            原子の数を設定する
+            各原子がいる番地を求め、原子を番地番号でソートする
+            番地は空間充填曲線（Morton順）の順に並ぶので、sorted_atoms()の順に原子を並べ替えると、近い原子がメモリ上でも近くなる
+            \param atoms 原子の座標が格納された構造体
+        */
+        void sort_atoms(AtomSoA const & atoms);
+
+        //! A public member function.
+        /*!
+            ペアリストのマージンを変更する
+            番地の大きさは変えないので、番地の一辺の分割数倍は、カットオフ半径と新しいマージンの和より長くなければならない
+            \param margin ペアリストのマージン
+        */
+        void set_margin(double margin);
+
+        //! A public member function.
+        /*!
+            番地の大きさを、マージンと番地の一辺の分割数から決め直す
+            番地ごとの配列の容量は残すので、続けてset_number_of_atoms()を呼び、住所録を作り直す
+            \param margin ペアリストのマージン
+            \param division 番地の一辺を、カットオフ半径とマージンの和の何分の1にするか（1～3）
+        */
+        void set_mesh(double margin, std::int32_t division);
+
+        //! A public member function.
+        /*!
+            原子の数を設定し、番地あたりの原子の数から密な住所録と疎な住所録のどちらを使うかを決める
             \param pn 原子の数
         */
-        void set_number_of_atoms(std::size_t pn) { sorted_buffer.resize(pn); }
+        void set_number_of_atoms(std::size_t pn);
+
+        //! A public member function.
+        /*!
+            ペアリストを作るときに、相手の原子の候補を距離でふるい分ける関数の命令セットを設定する
+            \param simdtype 使う命令セット
+        */
+        void set_simd_type(SimdType simdtype);
+
+        //! A public member function (constant).
+        /*!
+            疎な住所録を使っているかどうかを返す
+            \return 疎な住所録を使っているならtrue
+        */
+        bool sparse() const
+        {
+            return sparse_;
+        }
+
+        //! A public member function (constant).
+        /*!
+            番地ごとにまとめた原子インデックスを返す（番地は空間充填曲線の順、同じ番地の中は原子のインデックスの順）
+            \return 番地ごとにまとめた原子インデックス
+        */
+        std::vector<std::int32_t> const & sorted_atoms() const
+        {
+            return sorted_buffer;
+        }
         
         // #endregion publicメンバ関数
 
         // #region privateメンバ関数
 
     private:
+        //! A private member function (constant).
+        /*!
+            原子がいる番地を求める
+            \param atoms 原子の座標が格納された構造体
+            \param i 原子のインデックス
+            \param im メッシュのサイズの逆数
+            \return 番地番号
+        */
+        std::int32_t cell_index(AtomSoA const & atoms, std::int32_t i, double im) const;
+
+        //! A private member function (constant).
+        /*!
+            番地の色を求める
+            \param id 番地番号
+            \return 番地の色
+        */
+        std::int32_t cell_color(std::int32_t id) const;
+
+        //! A private member function (constant).
+        /*!
+            疎な住所録のハッシュ表から、番地を引く
+            \param id 番地番号
+            \return 原子がいる番地の空間充填曲線の順の番号（番地に原子がいないときは-1）
+        */
+        std::int32_t find_cell(std::int32_t id) const;
+
+        //! A private member function (constant).
+        /*!
+            疎な住所録のハッシュ表で、番地を最初に探す位置を求める
+            \param id 番地番号
+            \return ハッシュ表の位置
+        */
+        std::uint32_t hash_cell(std::int32_t id) const;
+
         //! A private member function.
         /*!
-            住所録から逆引きして調べる関数
-            \param id 番地
-            \param atoms 原子の座標が格納された可変長配列
-            \param pairs 原子のペアが格納された可変長配列
+            番地をたどる空間充填曲線（Morton順）の順番を求める
+        */
+        void make_cell_order();
+
+        //! A private member function.
+        /*!
+            番地を、同じ色の番地どうしが力を書き込む原子を共有しないように塗り分ける（疎な住所録では、原子がいる番地だけを塗り分ける）
+        */
+        void make_colors();
+
+        //! A private member function.
+        /*!
+            隣接番地のステンシル（相手の番地の相対位置の表）と、番地の番号の周期的な折り返しの表を作る
+            ステンシルには、番地どうしの最短距離がカットオフ半径とマージンの和以下になる番地だけを入れる
+        */
+        void make_stencil();
+
+        //! A private member function (constant).
+        /*!
+            番地のMorton符号（番地の座標のビットを交互に並べた値）を求める
+            \param id 番地番号
+            \return Morton符号
         */
-        void search(std::int32_t id, SystemParam::myatomvector & atoms, SystemParam::mypairvector & pairs);
+        std::uint64_t morton_code(std::int32_t id) const;
+
+        //! A private member function (constant).
+        /*!
+            呼び出したスレッドで作るOpenMPのチームのスレッド数を求める
+            （ヘルパースレッドのように、omp_set_num_threads()で減らしたスレッドからは、その数に抑える）
+            \return チームのスレッド数
+        */
+        std::int32_t number_of_threads() const;
+
+        //! A private member function.
+        /*!
+            住所録から逆引きして、クラスタicの相手のクラスタを調べる関数
+            \param ic クラスタのインデックス
+            \param id クラスタicがいる番地
+            \param atoms 原子の座標が格納された構造体
+            \param clusters クラスタペアリスト
+        */
+        void search_cluster(std::int32_t ic, std::int32_t id, AtomSoA const & atoms, ClusterPairList & clusters);
+
+        //! A private member function.
+        /*!
+            隣接番地で、クラスタicの相手のクラスタの探索を行う関数
+            \param ic クラスタのインデックス
+            \param id2 相手の番地
+            \param sx 相手の番地の像の、x方向の周期の長さの倍数
+            \param sy 相手の番地の像の、y方向の周期の長さの倍数
+            \param sz 相手の番地の像の、z方向の周期の長さの倍数
+            \param atoms 原子の座標が格納された構造体
+            \param clusters クラスタペアリスト
+        */
+        void search_cluster_other(std::int32_t ic, std::int32_t id2, std::int32_t sx, std::int32_t sy, std::int32_t sz, AtomSoA const & atoms, ClusterPairList & clusters);
+
+        //! A private member function.
+        /*!
+            クラスタicとクラスタjcの原子の組のうち、相互作用を計算する組のビットマスクを求め、0でなければ登録する
+            \param ic クラスタのインデックス
+            \param jc 相手のクラスタのインデックス
+            \param sx 相手のクラスタの像の、x方向の周期の長さの倍数
+            \param sy 相手のクラスタの像の、y方向の周期の長さの倍数
+            \param sz 相手のクラスタの像の、z方向の周期の長さの倍数
+            \param atoms 原子の座標が格納された構造体
+            \param clusters クラスタペアリスト
+        */
+        void add_cluster_pair(std::int32_t ic, std::int32_t jc, std::int32_t sx, std::int32_t sy, std::int32_t sz, AtomSoA const & atoms, ClusterPairList & clusters);
+
+        //! A private member function.
+        /*!
+            相手の原子の候補のうち、原子iとの距離がカットオフ半径とマージンの和以下のものをペアリストに追加する
+            候補はまとめてSIMD命令でふるい分け、候補の順番のまま追加する
+            \param i 原子のインデックス
+            \param candidates 相手の原子の候補のインデックス
+            \param n 相手の原子の候補の数
+            \param sx 相手の原子の像の、x方向の周期の長さの倍数
+            \param sy 相手の原子の像の、y方向の周期の長さの倍数
+            \param sz 相手の原子の像の、z方向の周期の長さの倍数
+            \param atoms 原子の座標が格納された構造体
+            \param pairs 原子のペアが格納されたペアリスト
+        */
+        void add_pairs(std::int32_t i, std::int32_t const * candidates, std::int32_t n, std::int32_t sx, std::int32_t sy, std::int32_t sz, AtomSoA const & atoms, PairList & pairs);
+
+        //! A private member function.
+        /*!
+            住所録から逆引きして、原子iの相手の原子を調べる関数
+            \param i 原子のインデックス
+            \param id 原子iがいる番地
+            \param atoms 原子の座標が格納された構造体
+            \param pairs 原子のペアが格納されたペアリスト
+        */
+        void search(std::int32_t i, std::int32_t id, AtomSoA const & atoms, PairList & pairs);
         
         //! A private member function.
         /*!
-            隣接番地での探索を行う関数
-            \param id 番地
-            \param ix 番地（x座標）
-            \param iy 番地（y座標）
-            \param iz 番地（z座標）
-            \param atoms 原子の座標が格納された可変長配列
-            \param pairs 原子のペアが格納された可変長配列
+            隣接番地で、原子iの相手の原子の探索を行う関数
+            \param i 原子のインデックス
+            \param id2 相手の番地
+            \param sx 相手の番地の像の、x方向の周期の長さの倍数
+            \param sy 相手の番地の像の、y方向の周期の長さの倍数
+            \param sz 相手の番地の像の、z方向の周期の長さの倍数
+            \param atoms 原子の座標が格納された構造体
+            \param pairs 原子のペアが格納されたペアリスト
         */
-        void search_other(std::int32_t id, std::int32_t ix, std::int32_t iy, std::int32_t iz, SystemParam::myatomvector & atoms, SystemParam::mypairvector & pairs);
+        void search_other(std::int32_t i, std::int32_t id2, std::int32_t sx, std::int32_t sy, std::int32_t sz, AtomSoA const & atoms, PairList & pairs);
+
+        //! A private member function.
+        /*!
+            原子を番地の空間充填曲線の順（同じ番地の中は原子のインデックスの順）に並べ、原子がいる番地だけを登録する（疎な住所録）
+            \param atoms 原子の座標が格納された構造体
+        */
+        void sort_atoms_sparse(AtomSoA const & atoms);
 
         // #endregion privateメンバ関数
 
         // #region privateメンバ変数
 
+        //! A private member variable (static constant).
+        /*!
+            番地あたりの原子の数がこれより少ないときは、疎な住所録を使う
+        */
+        static double const SPARSEOCCUPANCY;
+
+        //! A private member variable (static constant).
+        /*!
+            スレッドごと・番地ごとの原子の数の配列の大きさを、原子の数のこの倍数までに抑える
+        */
+        static std::int32_t const THREADCOUNTPERATOM = 4;
+
+        //! A private member variable.
+        /*!
+            各原子がいる番地のMorton符号（疎な住所録用）
+        */
+        std::vector<std::uint64_t> atomcode_;
+
+        //! A private member variable.
+        /*!
+            空間充填曲線の順にk番目の番地の、最初のクラスタのインデックス（要素数は番地の数 + 1、疎な住所録では原子がいる番地の数 + 1）
+        */
+        std::vector<std::int32_t> cluster_indexes_;
+
+        //! A private member variable.
+        /*!
+            空間充填曲線の順に並べた番地番号
+        */
+        std::vector<std::int32_t> cellorder_;
+
+        //! A private member variable.
+        /*!
+            番地が空間充填曲線の順で何番目か（cellorder_の逆引き）
+        */
+        std::vector<std::int32_t> cellrank_;
+
+        //! A private member variable.
+        /*!
+            色ごとにまとめた番地の、色の頭出しのインデックス
+        */
+        std::vector<std::int32_t> color_offsets_;
+
+        //! A private member variable.
+        /*!
+            色ごとにまとめた番地番号
+        */
+        std::vector<std::int32_t> colored_cells_;
+
+        //! A private member variable.
+        /*!
+            クラスタにまとめるときの、各原子がいる柱の番号
+        */
+        std::vector<std::int32_t> column_;
+
         //! A private member variable.
         /*!
             どの番地に何個原子がいるかの数
         */
         std::vector<std::int32_t> count_;
 
+        //! A private member variable.
+        /*!
+            疎な住所録のハッシュ表の、番地番号（空きは-1、要素数は2のべき乗）
+        */
+        std::vector<std::int32_t> hashcell_;
+
+        //! A private member variable.
+        /*!
+            疎な住所録のハッシュ表の、原子がいる番地の空間充填曲線の順の番号
+        */
+        std::vector<std::int32_t> hashslot_;
+
         //! A private member variable.
         /*!
             番地番号でソートした際に、番地番号の頭出しのインデックス
         */
         std::vector<std::int32_t> indexes_;
+
+        //! A private member variable.
+        /*!
+            原子がいる番地の番地番号（疎な住所録用、空間充填曲線の順）
+        */
+        std::vector<std::int32_t> occupiedcell_;
+
+        //! A private member variable.
+        /*!
+            各原子がいる番地
+        */
+        std::vector<std::int32_t> particle_position_;
+
+        //! A private member variable.
+        /*!
+            ステンシルの、相手の番地の相対位置のx, y, z成分（作用・反作用の法則を使うので、半分の方向だけを入れる）
+        */
+        std::vector<std::int32_t> stencilx_, stencily_, stencilz_;
+
+        //! A private member variable.
+        /*!
+            番地の座標cに相対位置dを足して周期で折り返した座標（添字はc * (2 * division_ + 1) + d + division_）
+        */
+        std::vector<std::int32_t> wrapcell_;
+
+        //! A private member variable.
+        /*!
+            番地の座標cに相対位置dを足したときの、周期の長さの倍数（添字はwrapcell_と同じ）
+        */
+        std::vector<std::int32_t> wrapshift_;
+
+        //! A private member variable.
+        /*!
+            番地の一辺を、カットオフ半径とマージンの和の何分の1にするか
+        */
+        std::int32_t division_;
         
         //! A private member variable.
         /*!
@@ -108,18 +475,60 @@ namespace moleculardynamics {
         */
         double mesh_size_;
 
+        //! A private member variable.
+        /*!
+            カットオフ半径とマージンの和の2乗（ペアリストに登録する距離の2乗）
+        */
+        double ml2_;
+
+        //! A private member variable.
+        /*!
+            相手の原子の候補を距離でふるい分ける関数
+        */
+        ljkernel::pairfilterfunc pairfilter_ = ljkernel::filter_pairs_scalar;
+
         //! A private member variable.
         /*!
             トータルのメッシュの数
         */
         std::int32_t number_of_mesh_;
 
+        //! A private member variable.
+        /*!
+            疎な住所録を使うかどうか
+        */
+        bool sparse_ = false;
+
         //! A private member variable.
         /*!
             番地番号でソートした原子インデックス
         */
         std::vector<std::int32_t> sorted_buffer;
 
+        //! A private member variable.
+        /*!
+            スレッドごと・番地ごとの原子の数（数え上げソートの途中で、書き込み位置に置き換える）
+        */
+        std::vector<std::int32_t> threadcount_;
+
+        //! A private member variable.
+        /*!
+            数え上げソートで原子を数えるスレッドの数（スレッドごと・番地ごとの原子の数の配列に収まる数）
+        */
+        std::int32_t countthreads_ = 1;
+
+        //! A private member variable.
+        /*!
+            スレッドごとのバッファを1つのペアリストにつなげるときの、スレッドごとの書き込み位置
+        */
+        std::vector<std::int32_t> threadoffsets_;
+
+        //! A private member variable.
+        /*!
+            スレッドごとのペアリストのバッファ（作り直すたびにメモリを確保し直さないように、使い回す）
+        */
+        std::vector<PairList> threadpairs_;
+
         //! A private member variable (constant).
         /*!
             周期の長さ
@@ -0,0 +1,94 @@
+﻿/*! \file pairtable.cpp
+    \brief 2体ポテンシャルの数表クラスの実装
+
+    Copyright ©  2017 @dc1394 All Rights Reserved.
+    This software is released under the BSD 2-Clause License.
+*/
+
+#include "pairtable.h"
+#include <algorithm>        // for std::max
+#include <cmath>            // for std::fabs
+#include <vector>           // for std::vector
+#include <boost/assert.hpp> // for BOOST_ASSERT
+
+namespace moleculardynamics {
+    // #region コンストラクタ
+
+    PairTable::PairTable(potentialfunc const & energy, potentialfunc const & dfdr, double r2min, double rc2, std::int32_t resolution)
+        :   dr2_((rc2 - r2min) / static_cast<double>(resolution)),
+            invdr2_(static_cast<double>(resolution) / (rc2 - r2min)),
+            r2min_(r2min),
+            resolution_(resolution)
+    {
+        BOOST_ASSERT(resolution > 0);
+        BOOST_ASSERT(r2min > 0.0 && r2min < rc2);
+
+        coefficients_.resize(resolution_ * ljkernel::TABLESTRIDE);
+
+        maxforceerror_ = make_spline(dfdr, 0);
+        maxenergyerror_ = make_spline(energy, 4);
+    }
+
+    // #endregion コンストラクタ
+
+    // #region privateメンバ関数
+
+    double PairTable::make_spline(potentialfunc const & func, std::int32_t offset)
+    {
+        auto const n = resolution_;
+        auto const h = dr2_;
+
+        std::vector<double> y(n + 1);
+        for (auto i = 0; i <= n; i++) {
+            y[i] = func(r2min_ + static_cast<double>(i) * h);
+        }
+
+        // 両端の傾きは中心差分で求める
+        auto const dh = h * 1.0E-3;
+        auto const slope0 = (func(r2min_ + dh) - func(r2min_ - dh)) / (2.0 * dh);
+        auto const slopen = (func(r2min_ + static_cast<double>(n) * h + dh) - func(r2min_ + static_cast<double>(n) * h - dh)) / (2.0 * dh);
+
+        // 節点の2階微分Mについての三重対角方程式を、Thomas法で解く
+        std::vector<double> a(n + 1, 1.0), b(n + 1, 4.0), c(n + 1, 1.0), d(n + 1);
+        b[0] = 2.0;
+        b[n] = 2.0;
+        d[0] = 6.0 / h * ((y[1] - y[0]) / h - slope0);
+        d[n] = 6.0 / h * (slopen - (y[n] - y[n - 1]) / h);
+        for (auto i = 1; i < n; i++) {
+            d[i] = 6.0 / (h * h) * (y[i + 1] - 2.0 * y[i] + y[i - 1]);
+        }
+
+        for (auto i = 1; i <= n; i++) {
+            auto const w = a[i] / b[i - 1];
+            b[i] -= w * c[i - 1];
+            d[i] -= w * d[i - 1];
+        }
+
+        std::vector<double> m(n + 1);
+        m[n] = d[n] / b[n];
+        for (auto i = n - 1; i >= 0; i--) {
+            m[i] = (d[i] - c[i] * m[i + 1]) / b[i];
+        }
+
+        // 区間の中の位置e（0～1）の3次式の係数にする
+        auto maxerror = 0.0;
+        for (auto i = 0; i < n; i++) {
+            auto const p = coefficients_.data() + i * ljkernel::TABLESTRIDE + offset;
+            p[0] = y[i];
+            p[1] = y[i + 1] - y[i] - h * h * (2.0 * m[i] + m[i + 1]) / 6.0;
+            p[2] = h * h * m[i] * 0.5;
+            p[3] = h * h * (m[i + 1] - m[i]) / 6.0;
+
+            // 区間の中の点で、解析的な式との差を調べる
+            for (auto k = 1; k < 8; k++) {
+                auto const e = static_cast<double>(k) / 8.0;
+                auto const v = p[0] + e * (p[1] + e * (p[2] + e * p[3]));
+                maxerror = std::max(maxerror, std::fabs(v - func(r2min_ + (static_cast<double>(i) + e) * h)));
+            }
+        }
+
+        return maxerror;
+    }
+
+    // #endregion privateメンバ関数
+}
@@ -0,0 +1,204 @@
+﻿/*! \file pairtable.h
+    \brief 2体ポテンシャルの数表クラスの宣言
+
+    Copyright ©  2017 @dc1394 All Rights Reserved.
+    This software is released under the BSD 2-Clause License.
+*/
+
+#ifndef _PAIRTABLE_H_
+#define _PAIRTABLE_H_
+
+#pragma once
+
+#include "ljkernel.h"
+#include "systemparam.h"
+#include <functional>   // for std::function
+
+namespace moleculardynamics {
+    //! A class.
+    /*!
+        2体ポテンシャルのエネルギーと力を、r^2の3次スプラインで表した数表のクラス
+        区間iの係数は、coefficients()[i * ljkernel::TABLESTRIDE]から、力の係数4個とエネルギーの係数4個の順に並ぶ
+        区間の中の位置を0～1の変数eで表すと、値はc0 + e * (c1 + e * (c2 + e * c3))になる
+    */
+    class PairTable final {
+        // #region 型エイリアス
+
+    public:
+        using potentialfunc = std::function<double (double)>;
+
+        // #endregion 型エイリアス
+
+        // #region コンストラクタ・デストラクタ
+
+        //! A constructor.
+        /*!
+            唯一のコンストラクタ
+            \param energy r^2からポテンシャルエネルギーを求める関数
+            \param dfdr r^2から、力の大きさをrで割った量（カーネル関数のdFdr）を求める関数
+            \param r2min 数表の最小のr^2（これより近い原子の組は、最初の区間の値を外挿する）
+            \param rc2 カットオフ半径の2乗
+            \param resolution 数表の区間の数
+        */
+        PairTable(potentialfunc const & energy, potentialfunc const & dfdr, double r2min, double rc2, std::int32_t resolution);
+
+        //! A destructor.
+        /*!
+            デフォルトデストラクタ
+        */
+        ~PairTable() = default;
+
+        // #endregion コンストラクタ・デストラクタ
+
+        // #region publicメンバ関数
+
+        //! A public member function (constant).
+        /*!
+            区間ごとのスプラインの係数を返す
+            \return 区間ごとのスプラインの係数
+        */
+        AtomSoA::mydoublevector const & coefficients() const
+        {
+            return coefficients_;
+        }
+
+        //! A public member function (constant).
+        /*!
+            区間の幅の逆数を返す
+            \return 区間の幅（r^2）の逆数
+        */
+        double inverse_interval() const
+        {
+            return invdr2_;
+        }
+
+        //! A public member function (constant).
+        /*!
+            解析的な式と比べた、力（dFdr）の誤差の最大値を返す
+            \return 力の誤差の絶対値の最大値
+        */
+        double max_force_error() const
+        {
+            return maxforceerror_;
+        }
+
+        //! A public member function (constant).
+        /*!
+            解析的な式と比べた、ポテンシャルエネルギーの誤差の最大値を返す
+            \return ポテンシャルエネルギーの誤差の絶対値の最大値
+        */
+        double max_energy_error() const
+        {
+            return maxenergyerror_;
+        }
+
+        //! A public member function (constant).
+        /*!
+            数表の最小のr^2を返す
+            \return 数表の最小のr^2
+        */
+        double r2min() const
+        {
+            return r2min_;
+        }
+
+        //! A public member function (constant).
+        /*!
+            数表の区間の数を返す
+            \return 数表の区間の数
+        */
+        std::int32_t size() const
+        {
+            return resolution_;
+        }
+
+        // #endregion publicメンバ関数
+
+        // #region privateメンバ関数
+
+    private:
+        //! A private member function.
+        /*!
+            関数の値を3次スプライン（両端の傾きを数値微分で与える）で補間して、係数を書き込む
+            \param func 補間する関数
+            \param offset 区間ごとの係数のうち、書き込みを始める位置
+            \return 区間の中の点で調べた、補間の誤差の絶対値の最大値
+        */
+        double make_spline(potentialfunc const & func, std::int32_t offset);
+
+        // #endregion privateメンバ関数
+
+        // #region privateメンバ変数
+
+    private:
+        //! A private member variable.
+        /*!
+            区間ごとのスプラインの係数
+        */
+        AtomSoA::mydoublevector coefficients_;
+
+        //! A private member variable.
+        /*!
+            区間の幅（r^2）
+        */
+        double dr2_;
+
+        //! A private member variable.
+        /*!
+            区間の幅の逆数
+        */
+        double invdr2_;
+
+        //! A private member variable.
+        /*!
+            力（dFdr）の誤差の最大値
+        */
+        double maxforceerror_;
+
+        //! A private member variable.
+        /*!
+            ポテンシャルエネルギーの誤差の最大値
+        */
+        double maxenergyerror_;
+
+        //! A private member variable.
+        /*!
+            数表の最小のr^2
+        */
+        double r2min_;
+
+        //! A private member variable.
+        /*!
+            数表の区間の数
+        */
+        std::int32_t resolution_;
+
+        // #endregion privateメンバ変数
+
+        // #region 禁止されたコンストラクタ・メンバ関数
+
+        //! A private constructor (deleted).
+        /*!
+            デフォルトコンストラクタ（禁止）
+        */
+        PairTable() = delete;
+
+        //! A private copy constructor (deleted).
+        /*!
+            コピーコンストラクタ（禁止）
+        */
+        PairTable(PairTable const &) = delete;
+
+        //! A private member function (deleted).
+        /*!
+            operator=()の宣言（禁止）
+            \param コピー元のオブジェクト（未使用）
+            \return コピー元のオブジェクト
+        */
+        PairTable & operator=(PairTable const &) = delete;
+
+        // #endregion 禁止されたコンストラクタ・メンバ関数
+    };
+}
+
+#endif  // _PAIRTABLE_H_
@@ -0,0 +1,230 @@
+﻿/*! \file potential.h
+    \brief 2体ポテンシャルのポリシー構造体の宣言
+
+    Copyright ©  2017 @dc1394 All Rights Reserved.
+    This software is released under the BSD 2-Clause License.
+*/
+
+#ifndef _POTENTIAL_H_
+#define _POTENTIAL_H_
+
+#pragma once
+
+#include "systemparam.h"
+#include <cmath>        // for std::exp, std::sqrt
+
+namespace moleculardynamics {
+    namespace potential {
+        // 2体ポテンシャルのポリシー構造体は、次の3つの静的メンバ関数を持つ（単位はすべて換算単位）
+        //   cutoff()        : カットオフ半径（ペアリストのSystemParam::RCUTOFFを超えてはならない）
+        //   energy(r2)      : 距離の2乗がr2のときのポテンシャルエネルギー（カットオフでの打ち切りは含まない）
+        //   force_over_r(r2): ポテンシャルのrについての微分をrで割った量（カーネル関数のdFdr）
+        // パラメータを変えるときは、同じ形の構造体を作ってAr_moleculardynamics::setPotential()に渡す
+
+        //! A struct.
+        /*!
+            Lennard-Jonesポテンシャル V(r) = 4(r^-12 - r^-6)
+        */
+        struct LennardJones {
+            //! A public static member function.
+            /*!
+                カットオフ半径を返す
+                \return カットオフ半径
+            */
+            static double cutoff()
+            {
+                return SystemParam::RCUTOFF;
+            }
+
+            //! A public static member function.
+            /*!
+                ポテンシャルエネルギーを求める
+                \param r2 原子間の距離の2乗
+                \return ポテンシャルエネルギー
+            */
+            static double energy(double r2)
+            {
+                auto const r6i = 1.0 / (r2 * r2 * r2);
+                return 4.0 * (r6i * r6i - r6i);
+            }
+
+            //! A public static member function.
+            /*!
+                ポテンシャルの微分をrで割った量を求める
+                \param r2 原子間の距離の2乗
+                \return ポテンシャルの微分をrで割った量
+            */
+            static double force_over_r(double r2)
+            {
+                auto const r2i = 1.0 / r2;
+                auto const r6i = r2i * r2i * r2i;
+                return (24.0 * r6i - 48.0 * r6i * r6i) * r2i;
+            }
+        };
+
+        //! A struct.
+        /*!
+            Weeks-Chandler-Andersenポテンシャル（Lennard-Jonesポテンシャルを極小点2^(1/6)で打ち切った斥力だけのポテンシャル）
+        */
+        struct WCA {
+            //! A public static member function.
+            /*!
+                カットオフ半径を返す
+                \return カットオフ半径（2^(1/6)）
+            */
+            static double cutoff()
+            {
+                return 1.122462048309373;
+            }
+
+            //! A public static member function.
+            /*!
+                ポテンシャルエネルギーを求める（打ち切りで、極小点の値-1を0にずらす）
+                \param r2 原子間の距離の2乗
+                \return ポテンシャルエネルギー
+            */
+            static double energy(double r2)
+            {
+                return LennardJones::energy(r2);
+            }
+
+            //! A public static member function.
+            /*!
+                ポテンシャルの微分をrで割った量を求める
+                \param r2 原子間の距離の2乗
+                \return ポテンシャルの微分をrで割った量
+            */
+            static double force_over_r(double r2)
+            {
+                return LennardJones::force_over_r(r2);
+            }
+        };
+
+        //! A struct.
+        /*!
+            Morseポテンシャル V(r) = D((1 - exp(-a(r - r0)))^2 - 1)
+            D = 1、r0 = 2^(1/6)、a = 6 / r0（Lennard-Jonesポテンシャルの極小点の曲率に合わせた値）
+        */
+        struct Morse {
+            //! A public static member function.
+            /*!
+                カットオフ半径を返す
+                \return カットオフ半径
+            */
+            static double cutoff()
+            {
+                return SystemParam::RCUTOFF;
+            }
+
+            //! A public static member function.
+            /*!
+                ポテンシャルエネルギーを求める
+                \param r2 原子間の距離の2乗
+                \return ポテンシャルエネルギー
+            */
+            static double energy(double r2)
+            {
+                auto const x = 1.0 - std::exp(-5.345392308842036 * (std::sqrt(r2) - 1.122462048309373));
+                return x * x - 1.0;
+            }
+
+            //! A public static member function.
+            /*!
+                ポテンシャルの微分をrで割った量を求める
+                \param r2 原子間の距離の2乗
+                \return ポテンシャルの微分をrで割った量
+            */
+            static double force_over_r(double r2)
+            {
+                auto const r = std::sqrt(r2);
+                auto const e = std::exp(-5.345392308842036 * (r - 1.122462048309373));
+                return 2.0 * 5.345392308842036 * e * (1.0 - e) / r;
+            }
+        };
+
+        //! A struct.
+        /*!
+            Buckinghamポテンシャル V(r) = A exp(-r / ρ) - C / r^6
+            exp-6型で、極小点をLennard-Jonesポテンシャルと同じ位置rm = 2^(1/6)、深さ1に合わせ、急峻さのパラメータをα = 14にした値
+            （A = 6 / (α - 6) exp(α)、ρ = rm / α、C = α / (α - 6) rm^6。r < 0.6付近でエネルギーが-∞に向かうので、原子がそこまで近づかない条件で使う）
+        */
+        struct Buckingham {
+            //! A public static member function.
+            /*!
+                カットオフ半径を返す
+                \return カットオフ半径
+            */
+            static double cutoff()
+            {
+                return SystemParam::RCUTOFF;
+            }
+
+            //! A public static member function.
+            /*!
+                ポテンシャルエネルギーを求める
+                \param r2 原子間の距離の2乗
+                \return ポテンシャルエネルギー
+            */
+            static double energy(double r2)
+            {
+                return 901953.2131235825 * std::exp(-std::sqrt(r2) / 0.08017586059352665) - 3.5 / (r2 * r2 * r2);
+            }
+
+            //! A public static member function.
+            /*!
+                ポテンシャルの微分をrで割った量を求める
+                \param r2 原子間の距離の2乗
+                \return ポテンシャルの微分をrで割った量
+            */
+            static double force_over_r(double r2)
+            {
+                auto const r = std::sqrt(r2);
+                auto const r2i = 1.0 / r2;
+                return -901953.2131235825 / 0.08017586059352665 * std::exp(-r / 0.08017586059352665) / r + 21.0 * r2i * r2i * r2i * r2i;
+            }
+        };
+
+        //! A struct.
+        /*!
+            ソフトコアLennard-Jonesポテンシャル V(r) = 4λ(1 / s^2 - 1 / s)、s = α(1 - λ) + r^6
+            結合パラメータλ = 0.5、ソフトコアの強さα = 0.5の値
+        */
+        struct SoftCore {
+            //! A public static member function.
+            /*!
+                カットオフ半径を返す
+                \return カットオフ半径
+            */
+            static double cutoff()
+            {
+                return SystemParam::RCUTOFF;
+            }
+
+            //! A public static member function.
+            /*!
+                ポテンシャルエネルギーを求める
+                \param r2 原子間の距離の2乗
+                \return ポテンシャルエネルギー
+            */
+            static double energy(double r2)
+            {
+                auto const si = 1.0 / (0.25 + r2 * r2 * r2);
+                return 2.0 * (si * si - si);
+            }
+
+            //! A public static member function.
+            /*!
+                ポテンシャルの微分をrで割った量を求める
+                \param r2 原子間の距離の2乗
+                \return ポテンシャルの微分をrで割った量
+            */
+            static double force_over_r(double r2)
+            {
+                auto const si = 1.0 / (0.25 + r2 * r2 * r2);
+                return 12.0 * r2 * r2 * (si * si - 2.0 * si * si * si);
+            }
+        };
+    }
+}
+
+#endif  // _POTENTIAL_H_
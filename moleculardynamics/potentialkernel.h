@@ -0,0 +1,152 @@
+﻿/*! \file potentialkernel.h
+    \brief 2体ポテンシャルのポリシー構造体で特殊化する、汎用のカーネル関数の宣言と実装
+
+    Copyright ©  2017 @dc1394 All Rights Reserved.
+    This software is released under the BSD 2-Clause License.
+*/
+
+#ifndef _POTENTIALKERNEL_H_
+#define _POTENTIALKERNEL_H_
+
+#pragma once
+
+#include "ljkernel.h"
+#include "potential.h"
+
+namespace moleculardynamics {
+    namespace ljkernel {
+        // 命令セットごとの翻訳単位からはインクルードしない（関数テンプレートが違うコンパイルオプションで実体化されないようにする）
+
+        template <typename Potential, bool Newton, bool Energy, bool Virial, bool Compact>
+        //! A template function.
+        /*!
+            ポテンシャルのポリシー構造体の式をインライン展開して、原子に働く力を計算する
+            \tparam Potential 2体ポテンシャルのポリシー構造体（potential.hを参照）
+            \tparam Newton 作用・反作用の法則を使って、相手の原子jにも力を書き込むかどうか
+            \tparam Energy ポテンシャルエネルギーを計算するかどうか
+            \tparam Virial ビリアルを計算するかどうか
+            \tparam Compact 圧縮したペアリスト（相手の原子のインデックスを、区間の基準からの16ビットの差で表したもの）を使うかどうか
+            \param args カーネル関数に渡す引数（args.rc2とargs.vrcは、ポテンシャルのカットオフとその打ち切りの値）
+            \param up ポテンシャルエネルギー（Energyがtrueのときだけ加算される）
+            \param virial ビリアル（Virialがtrueのときだけ加算される）
+        */
+        void calc_force_potential_impl(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            // 圧縮したペアリストでは、原子iの行を相手の原子のインデックスの基準ごとの区間に分けてあるので、区間を1つの行として扱う
+            auto const rbegin = Compact ? args.segoffsets[args.ibegin] : args.ibegin;
+            auto const rend = Compact ? args.segoffsets[args.iend] : args.iend;
+
+            for (auto r = rbegin; r < rend; r++) {
+                auto const i = Compact ? args.segatom[r] : r;
+                auto const base = Compact ? args.segbase[r] : 0;
+
+                auto const xi = args.rx[i];
+                auto const yi = args.ry[i];
+                auto const zi = args.rz[i];
+
+                // 原子iに働く力は、行の最後にまとめて書き込む
+                auto fxi = 0.0, fyi = 0.0, fzi = 0.0;
+
+                for (auto k = args.offsets[r]; k < args.offsets[r + 1]; k++) {
+                    auto const j = Compact ? base + args.jdelta[k] : args.jindex[k];
+
+                    // 周期的境界条件の補正は、ペアリストに記録した相手の原子の像の番号から求める（分岐しない）
+                    auto const s = args.shift[k];
+                    auto const dx = args.rx[j] - xi + static_cast<double>((s & 3) - 1) * args.periodiclen;
+                    auto const dy = args.ry[j] - yi + static_cast<double>((s >> 2 & 3) - 1) * args.periodiclen;
+                    auto const dz = args.rz[j] - zi + static_cast<double>((s >> 4 & 3) - 1) * args.periodiclen;
+
+                    auto const r2 = dx * dx + dy * dy + dz * dz;
+
+                    if (r2 <= args.rc2) {
+                        auto const dFdr = Potential::force_over_r(r2);
+
+                        fxi += dFdr * dx;
+                        fyi += dFdr * dy;
+                        fzi += dFdr * dz;
+
+                        if (Newton) {
+                            args.fx[j] -= dFdr * dx;
+                            args.fy[j] -= dFdr * dy;
+                            args.fz[j] -= dFdr * dz;
+                        }
+
+                        if (Energy) {
+                            up += Potential::energy(r2) + args.vrc;
+                        }
+
+                        if (Virial) {
+                            virial += r2 * dFdr;
+                        }
+                    }
+                }
+
+                args.fx[i] += fxi;
+                args.fy[i] += fyi;
+                args.fz[i] += fzi;
+            }
+        }
+
+        template <typename Potential, bool Newton, bool Compact>
+        //! A template function.
+        /*!
+            ポテンシャルのポリシー構造体の式をインライン展開して、原子に働く力を計算する（計算する量はargs.flagsで選ぶ）
+            \tparam Potential 2体ポテンシャルのポリシー構造体
+            \tparam Newton 作用・反作用の法則を使って、相手の原子jにも力を書き込むかどうか
+            \tparam Compact 圧縮したペアリスト（相手の原子のインデックスを、区間の基準からの16ビットの差で表したもの）を使うかどうか
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（加算される）
+            \param virial ビリアル（加算される）
+        */
+        void calc_force_potential_flags(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            switch (args.flags) {
+            case ComputeFlags::FORCE:
+                calc_force_potential_impl<Potential, Newton, false, false, Compact>(args, up, virial);
+                break;
+
+            case ComputeFlags::ENERGY:
+                calc_force_potential_impl<Potential, Newton, true, false, Compact>(args, up, virial);
+                break;
+
+            case ComputeFlags::VIRIAL:
+                calc_force_potential_impl<Potential, Newton, false, true, Compact>(args, up, virial);
+                break;
+
+            default:
+                calc_force_potential_impl<Potential, Newton, true, true, Compact>(args, up, virial);
+                break;
+            }
+        }
+
+        template <typename Potential>
+        //! A template function.
+        /*!
+            ポテンシャルのポリシー構造体で特殊化した、原子に働く力を計算するカーネル関数
+            get_kernel()が返すカーネル関数と同じ型なので、ljkernelfuncとして使える（args.tableは使わない）
+            \tparam Potential 2体ポテンシャルのポリシー構造体
+            \param args カーネル関数に渡す引数
+            \param up ポテンシャルエネルギー（args.flagsにENERGYが含まれるときだけ加算される）
+            \param virial ビリアル（args.flagsにVIRIALが含まれるときだけ加算される）
+        */
+        void calc_force_potential(ForceKernelArgs const & args, double & up, double & virial)
+        {
+            if (args.jdelta) {
+                if (args.newton) {
+                    calc_force_potential_flags<Potential, true, true>(args, up, virial);
+                }
+                else {
+                    calc_force_potential_flags<Potential, false, true>(args, up, virial);
+                }
+            }
+            else if (args.newton) {
+                calc_force_potential_flags<Potential, true, false>(args, up, virial);
+            }
+            else {
+                calc_force_potential_flags<Potential, false, false>(args, up, virial);
+            }
+        }
+    }
+}
+
+#endif  // _POTENTIALKERNEL_H_
@@ -10,8 +10,9 @@
 
 #pragma once
 
-#include <cstdint>                              // for std::int32_t
-#include <utility>                              // for std::pair
+#include <algorithm>                            // for std::max
+#include <cstddef>                              // for std::size_t
+#include <cstdint>                              // for std::int16_t, std::int32_t, std::uint8_t, std::uint16_t
 #include <vector>                               // for std::vector
 #include <Eigen/Core>                           // for Eigen::Vector4d
 #include <boost/align/aligned_allocator.hpp>    // for boost::alignment::aligned_allocator
@@ -28,6 +29,366 @@ namespace moleculardynamics {
         Eigen::Vector4d r;
     };
 
+    //! A struct.
+    /*!
+        原子の情報を、成分ごとの配列（Structure of Arrays）で格納した構造体
+    */
+    struct AtomSoA {
+        // #region 型エイリアス
+
+        using mydoublevector = std::vector<double, boost::alignment::aligned_allocator<double, 64> >;
+
+        using myfloatvector = std::vector<float, boost::alignment::aligned_allocator<float, 64> >;
+
+        // #endregion 型エイリアス
+
+        // #region publicメンバ関数
+
+        //! A public member function.
+        /*!
+            原子の数を変更する
+            \param n 原子の数
+        */
+        void resize(std::size_t n)
+        {
+            fx.resize(n);
+            fy.resize(n);
+            fz.resize(n);
+            px.resize(n);
+            py.resize(n);
+            pz.resize(n);
+            rx.resize(n);
+            ry.resize(n);
+            rz.resize(n);
+        }
+
+        //! A public member function (constant).
+        /*!
+            原子の数を返す
+            \return 原子の数
+        */
+        std::size_t size() const
+        {
+            return rx.size();
+        }
+
+        // #endregion publicメンバ関数
+
+        // #region publicメンバ変数
+
+        //! A public member variable.
+        /*!
+            原子に働く力のx, y, z成分
+        */
+        mydoublevector fx, fy, fz;
+
+        //! A public member variable.
+        /*!
+            原子の運動量のx, y, z成分
+        */
+        mydoublevector px, py, pz;
+
+        //! A public member variable.
+        /*!
+            原子の座標のx, y, z成分
+        */
+        mydoublevector rx, ry, rz;
+
+        // #endregion publicメンバ変数
+    };
+
+    //! A struct.
+    /*!
+        スレッドごとに力を溜めておくバッファ
+    */
+    struct ForceBuffer {
+        // #region publicメンバ関数
+
+        //! A public member function.
+        /*!
+            バッファの大きさを変更する
+            \param n 原子の数
+        */
+        void resize(std::size_t n)
+        {
+            fx.resize(n);
+            fy.resize(n);
+            fz.resize(n);
+        }
+
+        // #endregion publicメンバ関数
+
+        // #region publicメンバ変数
+
+        //! A public member variable.
+        /*!
+            原子に働く力のx, y, z成分
+        */
+        AtomSoA::mydoublevector fx, fy, fz;
+
+        // #endregion publicメンバ変数
+    };
+
+    //! A struct.
+    /*!
+        原子iごとにまとめたペアリスト（Compressed Sparse Row形式）
+        原子iの相手の原子のインデックスは、jindex[offsets[i]]からjindex[offsets[i + 1] - 1]までに格納される
+    */
+    struct PairList {
+        // #region publicメンバ関数
+
+        //! A public member function.
+        /*!
+            ペアの数がnpairsになってもメモリを確保し直さないように、容量を確保する
+            足りないときだけ、作り直すたびにペアの数が少し増えても足りるように余裕を持たせて確保する
+            （ペアがほとんどない疎な箱でも、ペアが現れたり数組増えたりするたびに確保し直さないように、
+            ペアの数が少なくても少なくともRESERVEMIN組の容量を持たせ、余裕も少なくともRESERVEMIN組にする）
+            \param npairs ペアの数
+        */
+        void reserve(std::size_t npairs)
+        {
+            auto const required = std::max(npairs, static_cast<std::size_t>(RESERVEMIN));
+            auto const slack = std::max(npairs / 8, static_cast<std::size_t>(RESERVEMIN));
+
+            if (jindex.capacity() < required) {
+                jindex.reserve(npairs + slack);
+            }
+
+            if (shift.capacity() < required + SHIFTPADDING) {
+                shift.reserve(npairs + slack + SHIFTPADDING);
+            }
+        }
+
+        //! A public member function (constant).
+        /*!
+            ペアの数を返す
+            \return ペアの数
+        */
+        std::size_t size() const
+        {
+            return jindex.size();
+        }
+
+        // #endregion publicメンバ関数
+
+        // #region publicメンバ変数
+
+        //! A public member variable (static constant).
+        /*!
+            容量を確保し直すときに持たせる余裕の、最小のペアの数
+        */
+        static std::int32_t const RESERVEMIN = 1024;
+
+        //! A public member variable (static constant).
+        /*!
+            SIMDのカーネル関数が行の端数をまとめて読み込めるように、shiftの末尾に付け足す要素の数
+        */
+        static std::int32_t const SHIFTPADDING = 8;
+
+        //! A public member variable.
+        /*!
+            相手の原子のインデックス
+        */
+        std::vector<std::int32_t> jindex;
+
+        //! A public member variable.
+        /*!
+            原子iの相手の原子が、jindexのどこから始まるかを表すインデックス（要素数は原子数 + 1）
+        */
+        std::vector<std::int32_t> offsets;
+
+        //! A public member variable.
+        /*!
+            ペアごとの、相手の原子の周期的な像の番号（SystemParam::shift_indexを参照、要素数はペアの数 + SHIFTPADDING）
+        */
+        std::vector<std::uint8_t> shift;
+
+        // #endregion publicメンバ変数
+    };
+
+    //! A struct.
+    /*!
+        PairListの相手の原子のインデックスを、16ビットの差で表して圧縮したペアリスト
+        原子iの行を、相手の原子のインデックスが基準から16ビットの差で表せる区間に分け、区間rの相手の原子のインデックスは
+        segbase[r] + jdelta[k]（kはoffsets[r]からoffsets[r + 1] - 1まで）になる（ペアの番号kと周期的な像の番号shiftは、元のPairListと同じ）
+        原子を空間充填曲線の順に並べていれば、ほとんどの行は1つの区間に収まり、差で表せない遠い相手の原子がいるときだけ区間を分ける
+    */
+    struct CompactPairList {
+        // #region publicメンバ変数
+
+        //! A public member variable.
+        /*!
+            原子iの区間の始まりを表すインデックス（要素数は原子数 + 1）
+        */
+        std::vector<std::int32_t> segoffsets;
+
+        //! A public member variable.
+        /*!
+            区間ごとの、原子iのインデックス
+        */
+        std::vector<std::int32_t> segatom;
+
+        //! A public member variable.
+        /*!
+            区間ごとの、相手の原子のインデックスの基準
+        */
+        std::vector<std::int32_t> segbase;
+
+        //! A public member variable.
+        /*!
+            区間ごとの、ペアの始まりを表すインデックス（要素数は区間の数 + 1）
+        */
+        std::vector<std::int32_t> offsets;
+
+        //! A public member variable.
+        /*!
+            ペアごとの、相手の原子のインデックスの区間の基準からの差（要素数はペアの数 + PairList::SHIFTPADDING）
+        */
+        std::vector<std::int16_t> jdelta;
+
+        // #endregion publicメンバ変数
+    };
+
+    //! A struct.
+    /*!
+        原子をCLUSTERSIZE個ずつのクラスタにまとめ、クラスタの組ごとにまとめたペアリスト（Compressed Sparse Row形式）
+        クラスタiの相手のクラスタは、jcluster[offsets[i]]からjcluster[offsets[i + 1] - 1]までに格納される
+    */
+    struct ClusterPairList {
+        // #region publicメンバ関数
+
+        //! A public member function (constant).
+        /*!
+            クラスタの数を返す
+            \return クラスタの数
+        */
+        std::int32_t number_of_clusters() const
+        {
+            return static_cast<std::int32_t>(atomindex.size()) / CLUSTERSIZE;
+        }
+
+        //! A public member function.
+        /*!
+            クラスタの数がnclusters、クラスタペアの数がnpairsになってもメモリを確保し直さないように、容量を確保する
+            足りないときだけ、作り直すたびに数が少し増えても足りるように余裕を持たせて確保する
+            \param nclusters クラスタの数
+            \param npairs クラスタペアの数
+        */
+        void reserve(std::size_t nclusters, std::size_t npairs)
+        {
+            if (originx.capacity() < nclusters) {
+                auto const n = nclusters + nclusters / 8;
+                originx.reserve(n);
+                originy.reserve(n);
+                originz.reserve(n);
+                offsets.reserve(n + 1);
+
+                atomindex.reserve(n * CLUSTERSIZE);
+                x.reserve(n * CLUSTERSIZE);
+                y.reserve(n * CLUSTERSIZE);
+                z.reserve(n * CLUSTERSIZE);
+                xf.reserve(n * CLUSTERSIZE);
+                yf.reserve(n * CLUSTERSIZE);
+                zf.reserve(n * CLUSTERSIZE);
+                fx.reserve(n * CLUSTERSIZE);
+                fy.reserve(n * CLUSTERSIZE);
+                fz.reserve(n * CLUSTERSIZE);
+            }
+
+            if (jcluster.capacity() < npairs) {
+                auto const n = npairs + npairs / 8;
+                jcluster.reserve(n);
+                mask.reserve(n);
+                shift.reserve(n);
+                joriginx.reserve(n);
+                joriginy.reserve(n);
+                joriginz.reserve(n);
+            }
+        }
+
+        //! A public member function (constant).
+        /*!
+            クラスタペアの数を返す
+            \return クラスタペアの数
+        */
+        std::size_t size() const
+        {
+            return jcluster.size();
+        }
+
+        // #endregion publicメンバ関数
+
+        // #region publicメンバ変数
+
+        //! A public member variable (static constant).
+        /*!
+            1つのクラスタにまとめる原子の数（ビットマスクが16ビットなので、4×4の組まで）
+        */
+        static std::int32_t const CLUSTERSIZE = 4;
+
+        //! A public member variable.
+        /*!
+            クラスタの順に並べた原子のインデックス（クラスタの端数は-1）
+        */
+        std::vector<std::int32_t> atomindex;
+
+        //! A public member variable.
+        /*!
+            相手のクラスタのインデックス
+        */
+        std::vector<std::int32_t> jcluster;
+
+        //! A public member variable.
+        /*!
+            クラスタペアごとの、相互作用を計算する原子の組のビットマスク
+        */
+        std::vector<std::uint16_t> mask;
+
+        //! A public member variable.
+        /*!
+            クラスタiの相手のクラスタが、jclusterのどこから始まるかを表すインデックス（要素数はクラスタの数 + 1）
+        */
+        std::vector<std::int32_t> offsets;
+
+        //! A public member variable.
+        /*!
+            クラスタペアごとの、相手のクラスタの周期的な像の番号（SystemParam::shift_indexを参照）
+        */
+        std::vector<std::uint8_t> shift;
+
+        //! A public member variable.
+        /*!
+            クラスタペアごとの、クラスタiの番地の原点から見た、相手のクラスタの像の番地の原点のx, y, z成分（混合精度用）
+        */
+        AtomSoA::myfloatvector joriginx, joriginy, joriginz;
+
+        //! A public member variable.
+        /*!
+            クラスタごとの、クラスタがいる番地の原点のx, y, z成分
+        */
+        AtomSoA::mydoublevector originx, originy, originz;
+
+        //! A public member variable.
+        /*!
+            クラスタの順に並べ替えた、原子の座標のx, y, z成分
+        */
+        AtomSoA::mydoublevector x, y, z;
+
+        //! A public member variable.
+        /*!
+            クラスタの順に並べ替えた、クラスタがいる番地の原点から見た原子の座標のx, y, z成分（混合精度用）
+        */
+        AtomSoA::myfloatvector xf, yf, zf;
+
+        //! A public member variable.
+        /*!
+            クラスタの順に並べ替えた、原子に働く力のx, y, z成分
+        */
+        AtomSoA::mydoublevector fx, fy, fz;
+
+        // #endregion publicメンバ変数
+    };
+
     //! A struct.
     /*!
         型エイリアスや定数が格納された構造体
@@ -37,8 +398,6 @@ namespace moleculardynamics {
 
         using myatomvector = std::vector<Atom, boost::alignment::aligned_allocator<Atom> >;
 
-        using mypairvector = std::vector<std::pair<std::int32_t, std::int32_t> >;
-
         // #endregion 型エイリアス
 
         // #region static publicメンバ関数
@@ -51,13 +410,54 @@ namespace moleculardynamics {
         */
         inline static void adjust_periodic(Eigen::Vector4d & d, double periodiclen);
 
+        //! A public static member function.
+        /*!
+            周期的境界条件の補正をする
+            \param dx x方向の補正
+            \param dy y方向の補正
+            \param dz z方向の補正
+            \param periodiclen 周期の長さ
+        */
+        inline static void adjust_periodic(double & dx, double & dy, double & dz, double periodiclen);
+
+        //! A public static member function.
+        /*!
+            周期的境界条件の補正をして、補正に使った周期的な像の番号を返す
+            \param dx x方向の補正
+            \param dy y方向の補正
+            \param dz z方向の補正
+            \param periodiclen 周期の長さ
+            \return 周期的な像の番号
+        */
+        inline static std::uint8_t periodic_shift(double & dx, double & dy, double & dz, double periodiclen);
+
+        //! A public static member function.
+        /*!
+            原子iから原子jへの周期的な像の番号から、原子jから原子iへの像の番号を求める
+            \param shift 原子iから原子jへの周期的な像の番号
+            \return 原子jから原子iへの周期的な像の番号
+        */
+        inline static std::uint8_t reverse_shift(std::uint8_t shift);
+
+        //! A public static member function.
+        /*!
+            周期的な像の番号を求める
+            相手の原子の座標には、x, y, z方向にそれぞれ(sx, sy, sz) × 周期の長さを足して使う
+            番号のビット0～1、2～3、4～5に、sx + 1、sy + 1、sz + 1が入る
+            \param sx x方向の周期の長さの倍数（-1、0、1のどれか）
+            \param sy y方向の周期の長さの倍数（-1、0、1のどれか）
+            \param sz z方向の周期の長さの倍数（-1、0、1のどれか）
+            \return 周期的な像の番号
+        */
+        inline static std::uint8_t shift_index(std::int32_t sx, std::int32_t sy, std::int32_t sz);
+
         // #endregion static publicメンバ関数
 
         // #region publicメンバ変数
 
         //! A public member variable (static constant).
         /*!
-            マージン
+            ペアリストのマージン（Ar_moleculardynamicsのマージンの自動調整を使わないときの値）
         */
         static double const MARGIN;
 
@@ -104,6 +504,76 @@ namespace moleculardynamics {
         }
     }
 
+    void SystemParam::adjust_periodic(double & dx, double & dy, double & dz, double periodiclen)
+    {
+        auto const LH = periodiclen * 0.5;
+
+        if (dx < -LH) {
+            dx += periodiclen;
+        }
+        else if (dx > LH) {
+            dx -= periodiclen;
+        }
+
+        if (dy < -LH) {
+            dy += periodiclen;
+        }
+        else if (dy > LH) {
+            dy -= periodiclen;
+        }
+
+        if (dz < -LH) {
+            dz += periodiclen;
+        }
+        else if (dz > LH) {
+            dz -= periodiclen;
+        }
+    }
+
+    std::uint8_t SystemParam::periodic_shift(double & dx, double & dy, double & dz, double periodiclen)
+    {
+        auto const LH = periodiclen * 0.5;
+        auto sx = 0, sy = 0, sz = 0;
+
+        if (dx < -LH) {
+            sx = 1;
+        }
+        else if (dx > LH) {
+            sx = -1;
+        }
+
+        if (dy < -LH) {
+            sy = 1;
+        }
+        else if (dy > LH) {
+            sy = -1;
+        }
+
+        if (dz < -LH) {
+            sz = 1;
+        }
+        else if (dz > LH) {
+            sz = -1;
+        }
+
+        dx += static_cast<double>(sx) * periodiclen;
+        dy += static_cast<double>(sy) * periodiclen;
+        dz += static_cast<double>(sz) * periodiclen;
+
+        return shift_index(sx, sy, sz);
+    }
+
+    std::uint8_t SystemParam::reverse_shift(std::uint8_t shift)
+    {
+        // 各ビットの組の値vを2 - vにする（どの組も2以下なので、桁借りは起きない）
+        return static_cast<std::uint8_t>(0x2A - shift);
+    }
+
+    std::uint8_t SystemParam::shift_index(std::int32_t sx, std::int32_t sy, std::int32_t sz)
+    {
+        return static_cast<std::uint8_t>((sx + 1) | (sy + 1) << 2 | (sz + 1) << 4);
+    }
+
     // #endregion publicメンバ関数の実装
 }
 